@@ -0,0 +1,216 @@
+// Checks that encoding and muxing don't allocate once recording has got
+// going, since an allocation on those threads can stall for as long as the
+// allocator likes. malloc() and the scalar operator new are replaced with
+// versions that count. operator new[] is already replaced by FrameArena,
+// which falls back to malloc(), so that is counted too.
+//
+// OpusWriter on its own must not allocate at all. libwebm allocates a few
+// objects whenever it starts a new cluster (about every 32 seconds of audio
+// with only audio tracks) and it can't be told to make room for them in
+// advance, so the muxer is allowed MaxAllocationsPerCluster for each cluster
+// it could have started. Without FrameArena it would be one per packet.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "OpusWriter.h"
+#include "WebmMuxer.h"
+
+using namespace std;
+
+// Audio that is encoded before counting starts, so that anything done on the
+// first frames (e.g. the file's headers) isn't counted.
+static const int WarmUpSeconds = 2;
+
+// Audio that is counted.
+static const int EncodeSeconds = 60;
+static const int MuxSeconds = 600;
+
+// A new Cluster and CuePoint, the cluster's block timestamp map node, and the
+// odd time the cluster and cue lists double in size.
+static const uint64_t MaxAllocationsPerCluster = 8;
+// The longest a cluster can be, since block timestamps are 16 bit
+// milliseconds relative to it.
+static const int ClusterSeconds = 32;
+
+static atomic<bool> counting{false};
+static atomic<uint64_t> allocations{0};
+
+#if defined(__GLIBC__)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+extern "C" void* malloc(size_t size)
+{
+	if (counting.load(memory_order_relaxed))
+		allocations.fetch_add(1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	if (counting.load(memory_order_relaxed))
+		allocations.fetch_add(1, memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size)
+{
+	if (counting.load(memory_order_relaxed))
+		allocations.fetch_add(1, memory_order_relaxed);
+	return __libc_realloc(pointer, size);
+}
+#endif
+
+void* operator new(size_t size)
+{
+	void* pointer = malloc(size);
+	if (pointer == nullptr)
+		throw bad_alloc();
+	return pointer;
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept
+{
+	return malloc(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+	free(pointer);
+}
+
+void operator delete(void* pointer, const nothrow_t&) noexcept
+{
+	free(pointer);
+}
+
+// A second of 48 kHz stereo that looks a bit like audio: a tone in each
+// channel plus some noise.
+template <typename T>
+static vector<T> testSignal(double scale)
+{
+	vector<T> samples(48000 * 2);
+	uint32_t noise = 12345;
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		noise = noise * 1664525 + 1013904223;
+		double tone = sin(2.0 * 3.14159265358979323846 * 220.0 * (1 + i % 2) * (i / 2) / 48000.0);
+		double value = 0.3 * tone + 0.05 * (static_cast<int32_t>(noise) / 2147483648.0);
+		samples[i] = static_cast<T>(value * scale);
+	}
+	return samples;
+}
+
+// Write `seconds` of `signal` (which is one second long) to `writer`, a
+// frame at a time like the pipeline does.
+template <typename T>
+static bool writeSeconds(OpusWriter& writer, const vector<T>& signal, int seconds)
+{
+	const int frameSamples = writer.samplesPerFrame();
+	for (int s = 0; s < seconds; ++s)
+	{
+		for (size_t i = 0; i + frameSamples <= signal.size(); i += frameSamples)
+		{
+			if (!writer.write(signal.data() + i, frameSamples))
+				return false;
+		}
+	}
+	return true;
+}
+
+// Counts the allocations made by `run`.
+template <typename F>
+static uint64_t countAllocations(F run, bool& succeeded)
+{
+	allocations = 0;
+	counting = true;
+	succeeded = run();
+	counting = false;
+	return allocations;
+}
+
+int main()
+{
+#if !defined(__GLIBC__)
+	cout << "Allocations can only be counted with glibc." << endl;
+	// Meson counts this as skipped.
+	return 77;
+#else
+	const vector<int16_t> samples = testSignal<int16_t>(32767.0);
+	const vector<float> floatSamples = testSignal<float>(1.0);
+	bool passed = true;
+	bool succeeded = false;
+
+	// Encoding only.
+	uint64_t bytes = 0;
+	OpusWriter encoder([&bytes](const uint8_t*, int length) {
+		                   bytes += length;
+		                   return true;
+	                   },
+	                   OpusWriter::Rate_48000,
+	                   OpusWriter::Channels_Stereo,
+	                   OpusWriter::Frame_20ms,
+	                   64000,
+	                   OpusWriter::Complexity_10);
+	if (encoder.status() != OpusWriter::Status_Ok || !writeSeconds(encoder, samples, WarmUpSeconds) ||
+	    !writeSeconds(encoder, floatSamples, WarmUpSeconds))
+	{
+		cerr << "Unable to encode." << endl;
+		return 1;
+	}
+
+	uint64_t encodeAllocations = countAllocations([&] {
+		return writeSeconds(encoder, samples, EncodeSeconds) && writeSeconds(encoder, floatSamples, EncodeSeconds);
+	}, succeeded);
+	cout << "Encoding " << 2 * EncodeSeconds << " s: " << encodeAllocations << " allocations" << endl;
+	if (!succeeded || encodeAllocations != 0)
+		passed = false;
+
+	// Encoding and writing a WebM file.
+	const string filename = "allocation-test.webm";
+	{
+		WebmMuxer muxer;
+		if (!muxer.open(filename))
+		{
+			cerr << "Unable to open " << filename << endl;
+			return 1;
+		}
+		OpusWriter writer(muxer,
+		                  OpusWriter::Rate_48000,
+		                  OpusWriter::Channels_Stereo,
+		                  OpusWriter::Frame_20ms,
+		                  64000,
+		                  OpusWriter::Complexity_10);
+		if (writer.status() != OpusWriter::Status_Ok || !writeSeconds(writer, samples, WarmUpSeconds))
+		{
+			cerr << "Unable to write " << filename << endl;
+			return 1;
+		}
+
+		uint64_t muxAllocations = countAllocations([&] {
+			return writeSeconds(writer, samples, MuxSeconds);
+		}, succeeded);
+		uint64_t allowed = (MuxSeconds / ClusterSeconds + 2) * MaxAllocationsPerCluster;
+		cout << "Encoding and muxing " << MuxSeconds << " s: " << muxAllocations << " allocations, "
+		     << allowed << " allowed for new clusters" << endl;
+		if (!succeeded || muxAllocations > allowed)
+			passed = false;
+
+		if (!muxer.close())
+			passed = false;
+	}
+	remove(filename.c_str());
+
+	cout << (passed ? "Passed." : "FAILED.") << endl;
+	return passed ? 0 : 1;
+#endif
+}
@@ -0,0 +1,428 @@
+#include "AsyncFileWriter.h"
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// The buffers are page aligned, which lets the kernel copy them a bit
+// faster. O_DIRECT isn't used since Segment::Finalize() rewrites a few bytes
+// here and there, which would need read-modify-write of whole blocks.
+static const size_t BufferAlignment = 4096;
+
+#if defined(_WIN32)
+
+#include <malloc.h>
+#include <windows.h>
+
+struct AsyncFileWriter::Impl
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+	// False for stdout, which isn't ours to close.
+	bool ownsFile = true;
+
+	bool open(const string& filename, bool& seekable)
+	{
+		if (filename == "-")
+		{
+			file = GetStdHandle(STD_OUTPUT_HANDLE);
+			ownsFile = false;
+		}
+		else if (filename.compare(0, 5, "unix:") == 0)
+		{
+			cerr << "Unix domain sockets aren't supported on Windows." << endl;
+			return false;
+		}
+		else
+		{
+			file = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			ownsFile = true;
+		}
+		if (file == INVALID_HANDLE_VALUE || file == nullptr)
+		{
+			cerr << "Unable to open " << filename << ": error " << GetLastError() << endl;
+			file = INVALID_HANDLE_VALUE;
+			return false;
+		}
+		seekable = GetFileType(file) == FILE_TYPE_DISK;
+		return true;
+	}
+
+	// Returns false and prints an error on failure.
+	bool write(const string& filename, const uint8_t* data, size_t length, int64_t offset, bool seekable)
+	{
+		while (length > 0)
+		{
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = static_cast<DWORD>(offset);
+			overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+			DWORD chunk = static_cast<DWORD>(min<size_t>(length, 0x40000000));
+			DWORD written = 0;
+			if (!WriteFile(file, data, chunk, &written, seekable ? &overlapped : nullptr))
+			{
+				cerr << "Error writing " << filename << ": error " << GetLastError() << endl;
+				return false;
+			}
+			data += written;
+			length -= written;
+			offset += written;
+		}
+		return true;
+	}
+
+	// Returns false and prints an error on failure.
+	bool sync(const string& filename)
+	{
+		if (!FlushFileBuffers(file))
+		{
+			cerr << "Error syncing " << filename << ": error " << GetLastError() << endl;
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (file != INVALID_HANDLE_VALUE && ownsFile)
+			CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+	}
+};
+
+static uint8_t* allocateBuffer(size_t size)
+{
+	return static_cast<uint8_t*>(_aligned_malloc(size, BufferAlignment));
+}
+
+static void freeBuffer(uint8_t* buffer)
+{
+	_aligned_free(buffer);
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Connect to the Unix domain socket at `path`. Returns -1 on failure, with
+// errno set.
+static int connectUnixSocket(const string& path)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		int error = errno;
+		::close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+struct AsyncFileWriter::Impl
+{
+	int fd = -1;
+
+	bool open(const string& filename, bool& seekable)
+	{
+		if (filename == "-")
+			fd = dup(STDOUT_FILENO);
+		else if (filename.compare(0, 5, "unix:") == 0)
+			fd = connectUnixSocket(filename.substr(5));
+		else
+			fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0)
+		{
+			cerr << "Unable to open " << filename << ": " << strerror(errno) << endl;
+			return false;
+		}
+		struct stat st;
+		seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+		// If whatever is reading a pipe or socket goes away we want write()
+		// to fail rather than the whole program being killed.
+		if (!seekable)
+			signal(SIGPIPE, SIG_IGN);
+		return true;
+	}
+
+	// Returns false and prints an error on failure.
+	bool write(const string& filename, const uint8_t* data, size_t length, int64_t offset, bool seekable)
+	{
+		while (length > 0)
+		{
+			ssize_t written = seekable ? pwrite(fd, data, length, offset) : ::write(fd, data, length);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+			{
+				cerr << "Error writing " << filename << ": " << strerror(errno) << endl;
+				return false;
+			}
+			data += written;
+			length -= written;
+			offset += written;
+		}
+		return true;
+	}
+
+	// Returns false and prints an error on failure.
+	bool sync(const string& filename)
+	{
+#if defined(__APPLE__)
+		// fsync() on macOS doesn't flush the drive's own cache.
+		int result = fcntl(fd, F_FULLFSYNC);
+#elif defined(__linux__)
+		// The file's size is synced too, which is all the metadata we need.
+		int result = fdatasync(fd);
+#else
+		int result = fsync(fd);
+#endif
+		if (result != 0)
+		{
+			cerr << "Error syncing " << filename << ": " << strerror(errno) << endl;
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (fd >= 0)
+			::close(fd);
+		fd = -1;
+	}
+};
+
+static uint8_t* allocateBuffer(size_t size)
+{
+	void* buffer = nullptr;
+	if (posix_memalign(&buffer, BufferAlignment, size) != 0)
+		return nullptr;
+	return static_cast<uint8_t*>(buffer);
+}
+
+static void freeBuffer(uint8_t* buffer)
+{
+	free(buffer);
+}
+
+#endif
+
+AsyncFileWriter::AsyncFileWriter() : mImpl(new Impl)
+{
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+	close();
+	for (Buffer& buffer : mBuffers)
+		freeBuffer(buffer.data);
+}
+
+bool AsyncFileWriter::open(const string& filename)
+{
+	close();
+
+	for (Buffer& buffer : mBuffers)
+	{
+		if (buffer.data == nullptr)
+			buffer.data = allocateBuffer(BufferSize);
+		if (buffer.data == nullptr)
+		{
+			cerr << "Out of memory" << endl;
+			return false;
+		}
+		buffer.length = 0;
+		buffer.offset = 0;
+	}
+
+	if (!mImpl->open(filename, mSeekable))
+		return false;
+
+	mFilename = filename;
+	mPosition = 0;
+	mSubmitted = 0;
+	mWritten = 0;
+	mSyncTarget = 0;
+	mSynced = 0;
+	mStopping = false;
+	mFailed = false;
+
+	// The first buffer is being filled, and the rest are free.
+	for (size_t i = 1; i < BufferCount; ++i)
+		mFree.post();
+
+	mThread = thread(&AsyncFileWriter::ioThread, this);
+	mOpen = true;
+	return true;
+}
+
+bool AsyncFileWriter::close()
+{
+	if (!mOpen)
+		return true;
+
+	flush();
+
+	mStopping = true;
+	mFull.post();
+	mThread.join();
+
+	// Take back the free buffers so the counts are right if it is reopened.
+	for (size_t i = 1; i < BufferCount; ++i)
+	{
+		while (!mFree.waitFor(chrono::seconds(1)))
+		{
+		}
+	}
+
+	mImpl->close();
+	mOpen = false;
+	return !mFailed;
+}
+
+void AsyncFileWriter::flush()
+{
+	if (mOpen && mBuffers[mSubmitted % BufferCount].length > 0)
+		submit();
+}
+
+void AsyncFileWriter::sync()
+{
+	if (!mOpen || !mSeekable)
+		return;
+
+	flush();
+	mSyncTarget = mSubmitted.load();
+	// Wake the I/O thread in case it has already written everything.
+	mFull.post();
+}
+
+bool AsyncFileWriter::syncPending() const
+{
+	return mSynced < mSyncTarget;
+}
+
+mkvmuxer::int32 AsyncFileWriter::Write(const void* buffer, mkvmuxer::uint32 length)
+{
+	if (!mOpen || mFailed)
+		return -1;
+
+	const uint8_t* data = static_cast<const uint8_t*>(buffer);
+	while (length > 0)
+	{
+		Buffer& current = mBuffers[mSubmitted % BufferCount];
+		size_t count = min<size_t>(length, BufferSize - current.length);
+		memcpy(current.data + current.length, data, count);
+		current.length += count;
+		mPosition += count;
+		data += count;
+		length -= count;
+
+		if (current.length == BufferSize)
+			submit();
+	}
+	return 0;
+}
+
+mkvmuxer::int64 AsyncFileWriter::Position() const
+{
+	return mPosition;
+}
+
+mkvmuxer::int32 AsyncFileWriter::Position(mkvmuxer::int64 position)
+{
+	if (!mOpen || !mSeekable || position < 0)
+		return -1;
+
+	mPosition = position;
+	Buffer& current = mBuffers[mSubmitted % BufferCount];
+	if (current.length > 0)
+		submit();
+	else
+		current.offset = position;
+	return 0;
+}
+
+bool AsyncFileWriter::Seekable() const
+{
+	return mSeekable;
+}
+
+void AsyncFileWriter::ElementStartNotify(mkvmuxer::uint64 elementId, mkvmuxer::int64 position)
+{
+}
+
+void AsyncFileWriter::submit()
+{
+	++mSubmitted;
+	mFull.post();
+
+	// Wait for the next buffer to be free.
+	while (!mFree.waitFor(chrono::seconds(1)))
+	{
+	}
+
+	Buffer& next = mBuffers[mSubmitted % BufferCount];
+	next.length = 0;
+	next.offset = mPosition;
+}
+
+void AsyncFileWriter::ioThread()
+{
+	TRACE_THREAD("file_io");
+	for (;;)
+	{
+		if (!mFull.waitFor(chrono::seconds(1)))
+			continue;
+
+		if (mWritten != mSubmitted)
+		{
+			// After a failure the buffers are still passed back so that the
+			// muxing thread never gets stuck, but nothing else is written.
+			Buffer& buffer = mBuffers[mWritten % BufferCount];
+			TRACE_SCOPE("file_write");
+			if (!mFailed && !mImpl->write(mFilename, buffer.data, buffer.length, buffer.offset, mSeekable))
+				mFailed = true;
+
+			++mWritten;
+			mFree.post();
+		}
+
+		// Sync once everything before the last sync() has been written.
+		uint64_t target = mSyncTarget;
+		if (target > mSynced && mWritten >= target)
+		{
+			TRACE_SCOPE("file_sync");
+			if (!mFailed && !mImpl->sync(mFilename))
+				mFailed = true;
+			mSynced = target;
+		}
+
+		if (mWritten == mSubmitted && mStopping)
+			return;
+	}
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <mkvmuxer/mkvmuxer.h>
+
+#include "Semaphore.h"
+
+// An mkvmuxer::IMkvWriter that collects the output in a few big buffers and
+// writes them to the file on its own thread, instead of calling fwrite() for
+// every little EBML element on the thread that is muxing. That is hundreds
+// of times fewer system calls, and a slow disk only holds up muxing if all
+// the buffers are waiting to be written.
+//
+// Each buffer is written at the file offset it started at, so seeking back
+// (which Segment::Finalize() does to fill in sizes and cues) just starts a
+// new buffer; the buffers are written in order so the later data wins.
+// Outputs that can't seek, like pipes and sockets, are written sequentially.
+class AsyncFileWriter : public mkvmuxer::IMkvWriter
+{
+public:
+	AsyncFileWriter();
+	virtual ~AsyncFileWriter();
+
+	// Create or truncate `filename` and start the I/O thread. "-" means
+	// stdout, and "unix:<path>" connects to a Unix domain socket. Anything
+	// else is opened as a file, which may be a FIFO. Prints an error and
+	// returns false on failure.
+	bool open(const std::string& filename);
+
+	// Hand whatever has been written so far to the I/O thread now, instead of
+	// waiting for a buffer to fill up.
+	void flush();
+
+	// Like flush(), and then once the I/O thread has written everything up
+	// to here it makes sure it is on the disk (with fsync()), so that it
+	// survives a crash or the power going off. This doesn't wait for it, and
+	// does nothing more than flush() for pipes and sockets.
+	void sync();
+
+	// True from sync() until the data is on the disk.
+	bool syncPending() const;
+
+	// Write whatever is buffered, wait for it to finish and close the file.
+	// Returns false if any write failed. This is called automatically on
+	// destruction.
+	bool close();
+
+	// mkvmuxer::IMkvWriter
+	virtual mkvmuxer::int32 Write(const void* buffer, mkvmuxer::uint32 length) override;
+	virtual mkvmuxer::int64 Position() const override;
+	virtual mkvmuxer::int32 Position(mkvmuxer::int64 position) override;
+	virtual bool Seekable() const override;
+	virtual void ElementStartNotify(mkvmuxer::uint64 elementId, mkvmuxer::int64 position) override;
+
+private:
+	AsyncFileWriter(const AsyncFileWriter&) = delete;
+	AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+	// Size and number of the buffers. At normal bitrates a buffer takes
+	// several seconds to fill.
+	static const size_t BufferSize = 256 * 1024;
+	static const size_t BufferCount = 4;
+
+	struct Buffer
+	{
+		uint8_t* data = nullptr;
+		size_t length = 0;
+		// Where in the file it goes.
+		int64_t offset = 0;
+	};
+
+	// Hand the current buffer to the I/O thread if there's anything in it,
+	// and start the next one at mPosition. Waits if they are all in use.
+	void submit();
+
+	void ioThread();
+
+	// The platform-specific file handle.
+	struct Impl;
+	std::unique_ptr<Impl> mImpl;
+
+	std::string mFilename;
+	bool mSeekable = false;
+
+	// The buffers are used in turn. mSubmitted counts the ones that have been
+	// handed to the I/O thread and mWritten the ones it has finished with,
+	// so the one being filled is mBuffers[mSubmitted % BufferCount].
+	Buffer mBuffers[BufferCount];
+	std::atomic<uint64_t> mSubmitted{0};
+	std::atomic<uint64_t> mWritten{0};
+	// Posted when a buffer is submitted, or to stop the I/O thread.
+	Semaphore mFull;
+	// Posted when the I/O thread has finished with a buffer.
+	Semaphore mFree;
+
+	// The position in the file that the next Write() goes to.
+	int64_t mPosition = 0;
+
+	std::thread mThread;
+	// sync() was last called when this many buffers had been submitted, and
+	// the I/O thread has synced the file after writing this many.
+	std::atomic<uint64_t> mSyncTarget{0};
+	std::atomic<uint64_t> mSynced{0};
+
+	std::atomic<bool> mStopping{false};
+	std::atomic<bool> mFailed{false};
+	bool mOpen = false;
+};
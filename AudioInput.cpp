@@ -1,6 +1,550 @@
 #include "AudioInput.h"
 
+#include "SampleConvert.h"
+#include "Semaphore.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// Copy `n` bytes to `offset` bytes into a region of the ring buffer.
+static void writeToRegion(RingBuffer<uint8_t>::Region& region, size_t offset, const uint8_t* src, size_t n)
+{
+	if (offset < region.first_size)
+	{
+		size_t first = min(n, region.first_size - offset);
+		memcpy(region.first + offset, src, first);
+		src += first;
+		n -= first;
+		offset = region.first_size;
+	}
+	memcpy(region.second + (offset - region.first_size), src, n);
+}
+
+// The formats to capture in, best first. Float is what Opus uses internally
+// so it needs no conversion at all, and native int16 needs none until Opus
+// converts it. Otherwise the more bits the better.
+static const SoundIoFormat PreferredFormats[] = {
+	SoundIoFormatFloat32NE,
+	SoundIoFormatS16NE,
+	SoundIoFormatS32NE,
+	SoundIoFormatS24NE,
+	SoundIoFormatFloat32FE,
+	SoundIoFormatS32FE,
+	SoundIoFormatS24FE,
+	SoundIoFormatS16FE,
+};
+
+// Convert `frames` frames from `areas` into `region` of the ring buffer, as
+// `Out` samples. `region` may wrap part way through a frame.
+template <typename Out>
+static void convertToRegion(const SoundIoInStream* instream,
+                            const SoundIoChannelArea* areas,
+                            const int* order,
+                            int frames,
+                            RingBuffer<uint8_t>::Region& region)
+{
+	const int channels = instream->layout.channel_count;
+	const size_t frameBytes = channels * sizeof(Out);
+
+	// Convert the frames that fit before the end of the ring buffer's
+	// storage, then the rest at the start. A frame that wraps around is
+	// converted separately and copied.
+	int firstFrames = min<int>(frames, region.first_size / frameBytes);
+	ConvertAreas(instream->format, areas, order, channels, 0, firstFrames,
+	             reinterpret_cast<Out*>(region.first));
+
+	int done = firstFrames;
+	size_t wrapped = region.first_size - done * frameBytes;
+	if (done < frames && wrapped > 0)
+	{
+		Out frame[SOUNDIO_MAX_CHANNELS];
+		ConvertAreas(instream->format, areas, order, channels, done, 1, frame);
+		writeToRegion(region, done * frameBytes, reinterpret_cast<const uint8_t*>(frame), frameBytes);
+		++done;
+	}
+
+	if (done < frames)
+	{
+		size_t offset = done * frameBytes - region.first_size;
+		ConvertAreas(instream->format, areas, order, channels, done, frames - done,
+		             reinterpret_cast<Out*>(region.second + offset));
+	}
+}
+
+// Choose which rate to capture `device` at when we are going to resample to
+// `samplingRate` ourselves. That is the rate it is running at if it says,
+// since anything else means the backend resamples it.
+static int chooseSampleRate(SoundIoDevice* device, int samplingRate)
+{
+	if (device->sample_rate_current > 0 && soundio_device_supports_sample_rate(device, device->sample_rate_current))
+		return device->sample_rate_current;
+	if (device->sample_rate_count == 0)
+		return samplingRate;
+	return soundio_device_nearest_sample_rate(device, samplingRate);
+}
+
+// Choose which format to capture `device` in.
+static SoundIoFormat chooseFormat(SoundIoDevice* device)
+{
+	// Some backends don't list any formats; they can convert.
+	if (device->format_count == 0)
+		return SoundIoFormatS16NE;
+
+	for (SoundIoFormat format : PreferredFormats)
+	{
+		if (soundio_device_supports_format(device, format))
+			return format;
+	}
+	return SoundIoFormatInvalid;
+}
+
+// A position in the Vorbis channel order, and the libsoundio channels that
+// can be used for it. Most devices call the rear channels of 4, 5 and 5.1
+// channel layouts "side" rather than "back", so either is accepted.
+struct VorbisPosition
+{
+	SoundIoChannelId channel;
+	SoundIoChannelId alternative;
+};
+
+static const VorbisPosition FrontLeft = {SoundIoChannelIdFrontLeft, SoundIoChannelIdInvalid};
+static const VorbisPosition FrontRight = {SoundIoChannelIdFrontRight, SoundIoChannelIdInvalid};
+static const VorbisPosition Center = {SoundIoChannelIdFrontCenter, SoundIoChannelIdInvalid};
+static const VorbisPosition RearLeft = {SoundIoChannelIdBackLeft, SoundIoChannelIdSideLeft};
+static const VorbisPosition RearRight = {SoundIoChannelIdBackRight, SoundIoChannelIdSideRight};
+static const VorbisPosition SideLeft = {SoundIoChannelIdSideLeft, SoundIoChannelIdInvalid};
+static const VorbisPosition SideRight = {SoundIoChannelIdSideRight, SoundIoChannelIdInvalid};
+static const VorbisPosition BackLeft = {SoundIoChannelIdBackLeft, SoundIoChannelIdInvalid};
+static const VorbisPosition BackRight = {SoundIoChannelIdBackRight, SoundIoChannelIdInvalid};
+static const VorbisPosition BackCenter = {SoundIoChannelIdBackCenter, SoundIoChannelIdInvalid};
+static const VorbisPosition Lfe = {SoundIoChannelIdLfe, SoundIoChannelIdInvalid};
+
+// The channel order for Opus mapping family 1, for 3 to 8 channels.
+// See https://tools.ietf.org/html/rfc7845 Section 5.1.1.2
+static const VorbisPosition VorbisOrder[6][8] = {
+	{FrontLeft, Center, FrontRight},
+	{FrontLeft, FrontRight, RearLeft, RearRight},
+	{FrontLeft, Center, FrontRight, RearLeft, RearRight},
+	{FrontLeft, Center, FrontRight, RearLeft, RearRight, Lfe},
+	{FrontLeft, Center, FrontRight, SideLeft, SideRight, BackCenter, Lfe},
+	{FrontLeft, Center, FrontRight, SideLeft, SideRight, BackLeft, BackRight, Lfe},
+};
+
+// Work out which channel of `layout` goes in each position of the Vorbis
+// order. Returns false if it isn't a layout that Opus knows about.
+static bool vorbisChannelOrder(const SoundIoChannelLayout* layout, vector<int>& order)
+{
+	int channels = layout->channel_count;
+	if (channels < 3 || channels > 8)
+		return false;
+
+	order.assign(channels, -1);
+	for (int i = 0; i < channels; ++i)
+	{
+		const VorbisPosition& position = VorbisOrder[channels - 3][i];
+		order[i] = soundio_channel_layout_find_channel(layout, position.channel);
+		if (order[i] < 0 && position.alternative != SoundIoChannelIdInvalid)
+			order[i] = soundio_channel_layout_find_channel(layout, position.alternative);
+		if (order[i] < 0)
+			return false;
+	}
+	return true;
+}
+
 AudioInput::AudioInput()
 {
+}
+
+AudioInput::~AudioInput()
+{
+	close();
+}
+
+bool AudioInput::open(SoundIo* soundio,
+                      const std::string& deviceId,
+                      bool isRaw,
+                      int samplingRate,
+                      bool nativeRate,
+                      int channels,
+                      size_t wakeFrames,
+                      Semaphore& dataReady)
+{
+	// Find the device.
+	std::vector<int> selected_devices;
+
+	for (int i = 0; i < soundio_input_device_count(soundio); ++i)
+	{
+		SoundIoDevice* device = soundio_get_input_device(soundio, i);
+		if (device == nullptr)
+		{
+			cerr << "Error getting device: " << i << endl;
+			return false;
+		}
+
+		if (device->is_raw == isRaw && (deviceId.empty() || device->id == deviceId))
+			selected_devices.push_back(i);
+
+		soundio_device_unref(device);
+	}
+
+	if (selected_devices.size() != 1)
+	{
+		cerr << "Device not found, or too many devices: " << deviceId << endl;
+		return false;
+	}
+
+	mDevice = soundio_get_input_device(soundio, selected_devices[0]);
+	if (mDevice == nullptr)
+	{
+		cerr << "Error getting device " << selected_devices[0] << endl;
+		return false;
+	}
+
+	cerr << "Device: " << mDevice->name << (mDevice->is_raw ? " raw" : " not raw") << endl;
+
+	if (mDevice->probe_error)
+	{
+		cerr << "Unable to probe device: " << soundio_strerror(mDevice->probe_error) << endl;
+		return false;
+	}
+
+	soundio_device_sort_channel_layouts(mDevice);
+
+	SoundIoFormat fmt = chooseFormat(mDevice);
+	if (fmt == SoundIoFormatInvalid)
+	{
+		cerr << "Device doesn't support any formats that can be converted." << endl;
+		return false;
+	}
+
+	// Open the input stream.
+	mStream = soundio_instream_create(mDevice);
+	if (mStream == nullptr)
+	{
+		cerr << "Out of memory" << endl;
+		return false;
+	}
+
+	cerr << "Default format: " << mStream->format << " sample rate: " << mStream->sample_rate << endl;
+
+	mSampleRate = nativeRate ? chooseSampleRate(mDevice, samplingRate) : samplingRate;
+
+	// Keep the extra bits if there are any. The resampler works in float
+	// too, so there's no point converting to int16 first.
+	mFloat = (fmt != SoundIoFormatS16NE && fmt != SoundIoFormatS16FE) || mSampleRate != samplingRate;
+	mSampleBytes = mFloat ? sizeof(float) : sizeof(int16_t);
+
+	// Whoever reads the ring buffer is woken up as soon as there is a frame
+	// to encode, so this only needs to cover scheduling delays. One second is
+	// plenty.
+	mRingBuffer.reset(new RingBuffer<uint8_t>(mSampleRate * mSampleBytes * channels));
+	mWakeBytes = static_cast<int64_t>(wakeFrames) * mSampleRate / samplingRate * mSampleBytes * channels;
+	mDataReady = &dataReady;
+
+	mStream->format = fmt;
+	mStream->sample_rate = mSampleRate;
+	mStream->read_callback = readCallback;
+	mStream->overflow_callback = overflowCallback;
+	mStream->userdata = this;
+	if (!chooseLayout(channels))
+		return false;
+
+	cerr << "Opening with format: " << mStream->format << " sample rate: " << mStream->sample_rate << endl;
+
+	int err = soundio_instream_open(mStream);
+	if (err != SoundIoErrorNone)
+	{
+		cerr << "Unable to open input stream: " << soundio_strerror(err) << endl;
+		return false;
+	}
+
+	const char* layoutName = mStream->layout.name != nullptr ? mStream->layout.name : "Unnamed layout";
+	cerr << layoutName << " (" << channels << (mSurround ? " channels) " : " discrete channels) ")
+	     << mSampleRate << " Hz " << soundio_format_string(fmt);
+	if (fmt != SoundIoFormatS16NE && fmt != SoundIoFormatFloat32NE)
+		cerr << " (converted to " << (mFloat ? "float" : "int16") << " with " << ConvertIsa() << ")";
+	cerr << endl;
+	return true;
+}
+
+bool AudioInput::start()
+{
+	int err = soundio_instream_start(mStream);
+	if (err != SoundIoErrorNone)
+	{
+		cerr <<  "Unable to start input device: " << soundio_strerror(err) << endl;
+		return false;
+	}
+	return true;
+}
+
+void AudioInput::close()
+{
+	if (mStream != nullptr)
+	{
+		soundio_instream_destroy(mStream);
+		mStream = nullptr;
+	}
+	if (mDevice != nullptr)
+	{
+		soundio_device_unref(mDevice);
+		mDevice = nullptr;
+	}
+}
+
+RingBuffer<uint8_t>& AudioInput::ringBuffer()
+{
+	return *mRingBuffer;
+}
+
+int64_t AudioInput::startTime() const
+{
+	return mStartTime;
+}
+
+uint64_t AudioInput::overflows() const
+{
+	return mOverflows;
+}
+
+void AudioInput::addMetrics(Metrics& metrics, const Metrics::Labels& labels) const
+{
+	const RingBuffer<uint8_t>* ring = mRingBuffer.get();
+	metrics.addGauge("opusrec_ring_fill_ratio", "How full the capture ring buffer is now.", labels, [ring]() {
+		return static_cast<double>(ring->size()) / ring->capacity();
+	});
+	metrics.addHistogram("opusrec_ring_fill_at_callback_ratio", "How full the capture ring buffer was at the start of each read callback.", labels, mRingFill, 1e-3);
+	metrics.addHistogram("opusrec_callback_seconds", "Time spent in each realtime read callback.", labels, mCallbackTime, 1e-9);
+	metrics.addCounter("opusrec_overflows_total", "Overflows reported by the audio backend.", labels, mOverflows);
+	metrics.addCounter("opusrec_holes_total", "Holes in the captured audio that were filled with silence.", labels, mHoles);
+	metrics.addCounter("opusrec_hole_frames_total", "Frames of silence that holes were filled with.", labels, mHoleFrames);
+}
+
+std::string AudioInput::error() const
+{
+	// mSoundIoError is stored before mError, so it is up to date here.
+	Error error = mError;
+	int soundIoError = mSoundIoError;
+	switch (error)
+	{
+	case Error_None:
+		return "";
+	case Error_RingBufferOverflow:
+		return "Ring buffer overflow";
+	case Error_BeginRead:
+		return std::string("Begin read error: ") + soundio_strerror(soundIoError);
+	case Error_EndRead:
+		return std::string("End read error: ") + soundio_strerror(soundIoError);
+	}
+	return "Unknown error";
+}
+
+void AudioInput::fail(Error error, int soundIoError)
+{
+	if (mError != Error_None)
+		return;
+	mSoundIoError = soundIoError;
+	mError = error;
+}
+
+std::string AudioInput::name() const
+{
+	return mDevice != nullptr ? mDevice->name : "";
+}
+
+int AudioInput::sampleRate() const
+{
+	return mSampleRate;
+}
+
+bool AudioInput::isFloat() const
+{
+	return mFloat;
+}
+
+bool AudioInput::isSurround() const
+{
+	return mSurround;
+}
+
+bool AudioInput::chooseLayout(int channels)
+{
+	const SoundIoChannelLayout* defaultLayout = soundio_channel_layout_get_default(channels);
+
+	mChannelOrder.resize(channels);
+	for (int i = 0; i < channels; ++i)
+		mChannelOrder[i] = i;
+	mReorder = false;
+	mSurround = true;
+
+	// For mono and stereo let the backend up- or downmix if it has to.
+	if (channels <= 2)
+	{
+		mStream->layout = *defaultLayout;
+		return true;
+	}
+
+	// Otherwise find the layouts the device has with this many channels,
+	// preferring the standard one.
+	vector<const SoundIoChannelLayout*> candidates;
+	if (defaultLayout != nullptr && soundio_device_supports_layout(mDevice, defaultLayout))
+		candidates.push_back(defaultLayout);
+	for (int i = 0; i < mDevice->layout_count; ++i)
+	{
+		if (mDevice->layouts[i].channel_count == channels)
+			candidates.push_back(&mDevice->layouts[i]);
+	}
+
+	if (candidates.empty())
+	{
+		cerr << "Device doesn't support " << channels << " channels. Supported channel counts:";
+		for (int i = 0; i < mDevice->layout_count; ++i)
+			cerr << " " << mDevice->layouts[i].channel_count;
+		cerr << endl;
+		return false;
+	}
+
+	// Use a surround layout if there is one, so that Opus can take advantage
+	// of the correlation between channels.
+	for (const SoundIoChannelLayout* layout : candidates)
+	{
+		if (vorbisChannelOrder(layout, mChannelOrder))
+		{
+			mStream->layout = *layout;
+			for (int i = 0; i < channels; ++i)
+				mReorder = mReorder || mChannelOrder[i] != i;
+			return true;
+		}
+	}
+
+	// Otherwise the channels are just numbered inputs, so keep them in the
+	// device's order and encode them independently.
+	for (int i = 0; i < channels; ++i)
+		mChannelOrder[i] = i;
+	mStream->layout = *candidates.front();
+	mSurround = false;
+	return true;
+}
+
+// This callback is called when libsoundio has some auto data to send us.
+void AudioInput::readCallback(SoundIoInStream* instream, int frameCountMin, int frameCountMax)
+{
+	AudioInput* input = static_cast<AudioInput*>(instream->userdata);
+	TRACE_THREAD("capture");
+	TRACE_SCOPE("read_callback");
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	input->read(frameCountMin, frameCountMax);
+	input->mCallbackTime.record(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+void AudioInput::overflowCallback(SoundIoInStream* instream)
+{
+	// This is reported by whoever checks overflows().
+	TRACE_INSTANT("overflow");
+	++static_cast<AudioInput*>(instream->userdata)->mOverflows;
+}
+
+void AudioInput::read(int frameCountMin, int frameCountMax)
+{
+	SoundIoInStream* instream = mStream;
+
+	// Once something has gone wrong we wait to be closed.
+	if (mError != Error_None)
+		return;
+
+	if (mStartTime == 0)
+	{
+		// This is the first audio. Work out when the oldest sample in it was
+		// captured so that separate inputs can be lined up.
+		double latency = 0.0;
+		soundio_instream_get_latency(instream, &latency);
+		chrono::steady_clock::duration now = chrono::steady_clock::now().time_since_epoch();
+		mStartTime = chrono::duration_cast<chrono::nanoseconds>(now).count() - static_cast<int64_t>(latency * 1e9);
+	}
+
+	// The ring buffer holds int16 or float samples whatever the device's format is.
+	const size_t frameBytes = instream->layout.channel_count * mSampleBytes;
+	const int* order = mReorder ? mChannelOrder.data() : nullptr;
+
+	mRingFill.record(mRingBuffer->size() * 1000 / mRingBuffer->capacity());
+
+	size_t free_bytes = mRingBuffer->free();
+	int free_count = free_bytes / frameBytes;
+	
+	if (free_count < frameCountMin)
+	{
+		fail(Error_RingBufferOverflow);
+		return;
+	}
+
+	int write_frames = min(free_count, frameCountMax);
+	int frames_left = write_frames;
+	for (;;)
+	{
+		int frame_count = frames_left;
+		
+		SoundIoChannelArea* areas = nullptr;
+		
+		int err = soundio_instream_begin_read(instream, &areas, &frame_count);
+		if (err != SoundIoErrorNone)
+		{
+			fail(Error_BeginRead, err);
+			return;
+		}
+
+		if (frame_count == 0)
+			break;
+
+		// Convert straight into the ring buffer's free space.
+		size_t bytes = static_cast<size_t>(frame_count) * frameBytes;
+		RingBuffer<uint8_t>::Region region = mRingBuffer->reserve(bytes);
+		if (region.size() < bytes)
+		{
+			fail(Error_RingBufferOverflow);
+			soundio_instream_end_read(instream);
+			return;
+		}
+		
+		if (areas == nullptr)
+		{
+			// Due to an overflow there is a hole. Fill the ring buffer with
+			// silence for the size of the hole.
+			fill(region.first, region.first + region.first_size, 0);
+			fill(region.second, region.second + region.second_size, 0);
+			TRACE_INSTANT("hole");
+			mHoles.fetch_add(1, memory_order_relaxed);
+			mHoleFrames.fetch_add(frame_count, memory_order_relaxed);
+		}
+		else if (mFloat)
+		{
+			convertToRegion<float>(instream, areas, order, frame_count, region);
+		}
+		else
+		{
+			convertToRegion<int16_t>(instream, areas, order, frame_count, region);
+		}
+		mRingBuffer->commit(bytes);
+
+		// Wake the reader if there is at least a frame to encode. If it is
+		// already awake this doesn't make a syscall.
+		if (mRingBuffer->size() >= mWakeBytes)
+			mDataReady->post();
+		
+		err = soundio_instream_end_read(instream);
+		if (err != SoundIoErrorNone)
+		{
+			fail(Error_EndRead, err);
+			return;
+		}
 
+		frames_left -= frame_count;
+		if (frames_left <= 0)
+			break;
+	}
 }
@@ -1,7 +1,136 @@
 #pragma once
 
-class AudioInput
+#include <soundio/soundio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "AudioSource.h"
+#include "Metrics.h"
+#include "RingBuffer.h"
+
+class Semaphore;
+
+// Captures audio from one libsoundio input device into a ring buffer of
+// interleaved native-endian samples. The device is opened in the best format
+// it supports and converted (see SampleConvert.h). The samples are floats if
+// the device has more than 16 bits, so nothing is lost before encoding, and
+// int16 otherwise (see isFloat()). The ring buffer is filled from
+// libsoundio's realtime thread and should be read from one other thread.
+//
+// For more than two channels it picks one of the device's channel layouts
+// with that many channels. If it is a surround layout the channels are
+// reordered into the Vorbis order that Opus uses (see isSurround()).
+class AudioInput : public AudioSource
 {
 public:
 	AudioInput();
+	~AudioInput() override;
+
+	// Open the input device with the given ID, or the only device if the ID
+	// is empty. If `nativeRate` is set the device is opened at the rate it is
+	// running at rather than `samplingRate`, and the caller has to resample
+	// (see sampleRate()). `dataReady` is posted from the realtime thread
+	// whenever there are at least `wakeFrames` frames (at `samplingRate`) in
+	// the ring buffer. Prints an error and returns false on failure.
+	bool open(SoundIo* soundio,
+	          const std::string& deviceId,
+	          bool isRaw,
+	          int samplingRate,
+	          bool nativeRate,
+	          int channels,
+	          size_t wakeFrames,
+	          Semaphore& dataReady);
+
+	bool start();
+
+	// Stop capturing and close the device.
+	void close();
+
+	RingBuffer<uint8_t>& ringBuffer() override;
+
+	// When the first captured sample was recorded, as a steady_clock time in
+	// nanoseconds. It is set before anything is written to the ring buffer.
+	int64_t startTime() const override;
+
+	// How many times libsoundio reported an overflow.
+	uint64_t overflows() const;
+
+	// Add the capture metrics: how full the ring buffer is, how long the
+	// realtime callback takes, overflows and holes.
+	void addMetrics(Metrics& metrics, const Metrics::Labels& labels) const;
+
+	// Nothing is printed from the realtime thread, since that can block or
+	// allocate. If capturing fails it stops and this says why; otherwise it
+	// is empty. It should be checked regularly.
+	std::string error() const;
+
+	std::string name() const override;
+
+	// The rate the device was opened at.
+	int sampleRate() const override;
+
+	// True if the ring buffer holds floats rather than int16 samples. It
+	// always does if the sample rate isn't the one that was asked for.
+	bool isFloat() const override;
+
+	// True if the channels are a surround layout in Vorbis channel order,
+	// false if they are just numbered channels in the device's order.
+	// Mono and stereo always count as surround.
+	bool isSurround() const;
+
+private:
+	AudioInput(const AudioInput&) = delete;
+	AudioInput& operator=(const AudioInput&) = delete;
+
+	static void readCallback(SoundIoInStream* instream, int frameCountMin, int frameCountMax);
+	static void overflowCallback(SoundIoInStream* instream);
+
+	void read(int frameCountMin, int frameCountMax);
+
+	enum Error
+	{
+		Error_None,
+		Error_RingBufferOverflow,
+		Error_BeginRead,
+		Error_EndRead,
+	};
+
+	// Record an error from the realtime thread. Only the first one is kept.
+	void fail(Error error, int soundIoError = SoundIoErrorNone);
+
+	// Choose the stream's channel layout and set mChannelOrder.
+	bool chooseLayout(int channels);
+
+	SoundIoDevice* mDevice = nullptr;
+	SoundIoInStream* mStream = nullptr;
+
+	std::unique_ptr<RingBuffer<uint8_t>> mRingBuffer;
+	Semaphore* mDataReady = nullptr;
+	size_t mWakeBytes = 0;
+	int mSampleRate = 0;
+	bool mFloat = false;
+	size_t mSampleBytes = sizeof(int16_t);
+
+	// Channel `i` of the output comes from channel `mChannelOrder[i]` of the
+	// device. mReorder is false if this is the identity.
+	std::vector<int> mChannelOrder;
+	bool mReorder = false;
+	bool mSurround = true;
+
+	std::atomic<int64_t> mStartTime{0};
+	std::atomic<uint64_t> mOverflows{0};
+	// Times libsoundio gave us a hole instead of samples because of an
+	// overflow, and how many frames of silence they were filled with.
+	std::atomic<uint64_t> mHoles{0};
+	std::atomic<uint64_t> mHoleFrames{0};
+	// How long each read callback took in nanoseconds, and how full the ring
+	// buffer was at the start of it in parts per thousand.
+	Histogram mCallbackTime;
+	Histogram mRingFill;
+	std::atomic<Error> mError{Error_None};
+	std::atomic<int> mSoundIoError{SoundIoErrorNone};
 };
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "RingBuffer.h"
+
+// Something that fills a ring buffer with interleaved native-endian samples
+// for a Pipeline: a capture device (AudioInput) or a generated signal
+// (SyntheticInput). The ring buffer is filled from one thread and read from
+// one other thread.
+class AudioSource
+{
+public:
+	virtual ~AudioSource()
+	{
+	}
+
+	virtual RingBuffer<uint8_t>& ringBuffer() = 0;
+
+	// When the first sample was recorded, as a steady_clock time in
+	// nanoseconds. It is set before anything is written to the ring buffer.
+	virtual int64_t startTime() const = 0;
+
+	// The rate the samples are at.
+	virtual int sampleRate() const = 0;
+
+	// True if the ring buffer holds floats rather than int16 samples.
+	virtual bool isFloat() const = 0;
+
+	virtual std::string name() const = 0;
+};
@@ -0,0 +1,153 @@
+#include "Benchmark.h"
+
+#include "OpusWriter.h"
+#include "Pipeline.h"
+#include "ProcessStats.h"
+#include "Semaphore.h"
+#include "WorkerPool.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+using namespace std;
+
+// The results of one combination.
+struct BenchmarkResult
+{
+	// Audio seconds per second, for each input.
+	double realtimeMultiple = 0.0;
+	// Percent of one core that each channel needs to keep up in realtime.
+	double cpuPercentPerChannel = 0.0;
+	double kilobitsPerSecond = 0.0;
+	uint64_t peakRss = 0;
+};
+
+static bool runOne(const BenchmarkOptions& options, int rate, int channels, int complexity, int frameLength, BenchmarkResult& result)
+{
+	Semaphore workReady;
+	Semaphore packetReady;
+
+	int inputRate = options.inputRate > 0 ? options.inputRate : rate;
+	size_t wakeFrames = static_cast<size_t>(rate) * frameLength / 1000000;
+	int bitrate = options.bitrate > 0 ? options.bitrate : (channels > 2 ? 32000 * channels : 64000);
+	OpusWriter::ChannelMapping mapping = channels <= 8 ? OpusWriter::Mapping_Surround : OpusWriter::Mapping_Discrete;
+
+	ResetPeakRss();
+
+	// The callbacks are all called on the mux thread.
+	uint64_t bytes = 0;
+	vector<unique_ptr<SyntheticInput>> inputs;
+	vector<unique_ptr<OpusWriter>> writers;
+	for (int i = 0; i < options.inputs; ++i)
+	{
+		inputs.emplace_back(new SyntheticInput(options.signal, inputRate, rate, channels, options.format, options.seconds, wakeFrames, workReady));
+		writers.emplace_back(new OpusWriter([&bytes](const uint8_t*, int length) {
+			                                    bytes += length;
+			                                    return true;
+		                                    },
+		                                    static_cast<OpusWriter::SamplingRate>(rate),
+		                                    static_cast<OpusWriter::Channels>(channels),
+		                                    static_cast<OpusWriter::FrameLength>(frameLength),
+		                                    bitrate,
+		                                    static_cast<OpusWriter::ComputationalComplexity>(complexity),
+		                                    mapping));
+		if (writers.back()->status() != OpusWriter::Status_Ok)
+		{
+			cerr << "Opus error: " << writers.back()->status() << endl;
+			return false;
+		}
+	}
+
+	int64_t clockOrigin = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	WorkerPool pool(options.threads > 0 ? options.threads : WorkerPool::defaultThreads(2 * options.inputs), workReady);
+
+	vector<unique_ptr<Pipeline>> pipelines;
+	vector<Pipeline*> muxed;
+	for (int i = 0; i < options.inputs; ++i)
+	{
+		pipelines.emplace_back(new Pipeline(*inputs[i], *writers[i], options.resampleQuality, clockOrigin, workReady, packetReady));
+		if (pipelines.back()->failed())
+		{
+			cerr << "Unable to resample from " << inputRate << " Hz." << endl;
+			return false;
+		}
+		pipelines.back()->addJobs(pool);
+		muxed.push_back(pipelines.back().get());
+	}
+	MuxThread mux(muxed, false, workReady, packetReady);
+
+	double cpuStart = ProcessCpuSeconds();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	pool.start();
+	mux.start();
+	for (unique_ptr<SyntheticInput>& input : inputs)
+		input->start();
+
+	for (unique_ptr<SyntheticInput>& input : inputs)
+		input->join();
+	for (unique_ptr<Pipeline>& pipeline : pipelines)
+		pipeline->finish();
+	mux.join();
+	pool.stop();
+
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	// The signal generators aren't what is being measured.
+	double cpu = ProcessCpuSeconds() - cpuStart;
+	for (unique_ptr<SyntheticInput>& input : inputs)
+		cpu -= input->cpuSeconds();
+
+	bool failed = mux.failed();
+	for (unique_ptr<Pipeline>& pipeline : pipelines)
+		failed = failed || pipeline->failed();
+	if (failed)
+	{
+		cerr << "Encoding failed." << endl;
+		return false;
+	}
+
+	double audioSeconds = options.seconds;
+	result.realtimeMultiple = seconds > 0.0 ? audioSeconds / seconds : 0.0;
+	result.cpuPercentPerChannel = 100.0 * cpu / (audioSeconds * channels * options.inputs);
+	result.kilobitsPerSecond = bytes * 8.0 / 1000.0 / (audioSeconds * options.inputs);
+	result.peakRss = PeakRssBytes();
+	return true;
+}
+
+bool RunBenchmark(const BenchmarkOptions& options)
+{
+	static const char* const signals[] = {"sweep", "noise", "silence", "speech"};
+	int threads = options.threads > 0 ? options.threads : WorkerPool::defaultThreads(2 * options.inputs);
+	cout << signals[options.signal] << " signal, " << options.seconds << " s per run, "
+	     << options.inputs << (options.inputs == 1 ? " input, " : " inputs, ")
+	     << threads << (threads == 1 ? " encoding thread" : " encoding threads") << endl;
+	cout << setw(6) << "rate" << setw(4) << "ch" << setw(4) << "cx" << setw(7) << "frame"
+	     << setw(11) << "realtime" << setw(10) << "cpu/ch" << setw(9) << "kbps" << setw(11) << "peak RSS" << endl;
+	cout << fixed;
+
+	for (int rate : options.rates)
+	{
+		for (int channels : options.channels)
+		{
+			for (int complexity : options.complexities)
+			{
+				for (int frameLength : options.frameLengths)
+				{
+					BenchmarkResult result;
+					if (!runOne(options, rate, channels, complexity, frameLength, result))
+						return false;
+
+					cout << setw(6) << rate << setw(4) << channels << setw(4) << complexity
+					     << setw(4) << setprecision(frameLength % 1000 == 0 ? 0 : 1) << frameLength / 1000.0 << " ms"
+					     << setw(10) << setprecision(1) << result.realtimeMultiple << "x"
+					     << setw(9) << setprecision(2) << result.cpuPercentPerChannel << "%"
+					     << setw(9) << setprecision(1) << result.kilobitsPerSecond
+					     << setw(8) << setprecision(1) << result.peakRss / 1e6 << " MB" << endl;
+				}
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <soundio/soundio.h>
+
+#include <vector>
+
+#include "Resampler.h"
+#include "SyntheticInput.h"
+
+// Settings for `OpusRec benchmark`. Every combination of the rates, channel
+// counts, complexities and frame lengths is run.
+struct BenchmarkOptions
+{
+	std::vector<int> rates = {16000, 48000};
+	std::vector<int> channels = {1, 2, 6};
+	std::vector<int> complexities = {0, 5, 10};
+	// In microseconds, like OpusWriter::FrameLength.
+	std::vector<int> frameLengths = {10000, 20000, 60000};
+
+	SyntheticInput::Signal signal = SyntheticInput::Signal_Speech;
+	// The format the signal is generated in, which is converted like a
+	// device's would be.
+	SoundIoFormat format = SoundIoFormatS16NE;
+	// The rate the signal is generated at, or 0 for the encoder's rate. Any
+	// other rate is resampled.
+	int inputRate = 0;
+	Resampler::Quality resampleQuality = Resampler::Quality_Medium;
+	// 0 for what `record` uses for the number of channels.
+	int bitrate = 0;
+	// Inputs that are encoded at the same time, as with several devices.
+	int inputs = 1;
+	// Worker threads, or 0 for what `record` uses.
+	int threads = 0;
+	// Seconds of audio per input for each combination.
+	double seconds = 10.0;
+};
+
+// Encode synthetic audio through the same pipeline as `record`, as fast as it
+// will go, and print a table of how fast it was, the CPU time per channel and
+// the peak memory for each combination of settings. Prints an error and
+// returns false on failure.
+bool RunBenchmark(const BenchmarkOptions& options);
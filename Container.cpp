@@ -0,0 +1,47 @@
+#include "Container.h"
+
+#include "OggMuxer.h"
+#include "WebmMuxer.h"
+
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+// The file extensions that mean Ogg.
+static const char* OggExtensions[] = {".ogg", ".opus", ".oga"};
+
+static bool hasExtension(const string& filename, const string& extension)
+{
+	if (filename.size() < extension.size())
+		return false;
+	return equal(extension.begin(), extension.end(), filename.end() - extension.size(), [](char a, char b) {
+		return tolower(static_cast<unsigned char>(a)) == tolower(static_cast<unsigned char>(b));
+	});
+}
+
+Container* Container::create(Format format, const string& filename)
+{
+	if (format == Format_Auto)
+	{
+		format = Format_WebM;
+		for (const char* extension : OggExtensions)
+		{
+			if (hasExtension(filename, extension))
+				format = Format_Ogg;
+		}
+	}
+
+	if (format == Format_Ogg)
+		return new OggMuxer;
+	return new WebmMuxer;
+}
+
+string Container::insertBeforeExtension(const string& filename, const string& text)
+{
+	size_t dot = filename.find_last_of('.');
+	size_t slash = filename.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = filename.size();
+	return filename.substr(0, dot) + text + filename.substr(dot);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A file format that Opus tracks can be written to. Normally an OpusWriter
+// makes its own, but one can be shared by several OpusWriters to put several
+// tracks in one file.
+//
+// It is not thread-safe; all the writes must come from one thread, and the
+// frames from all the tracks must be written in timestamp order.
+class Container
+{
+public:
+	enum Format
+	{
+		// Choose from the file extension: Ogg for .ogg, .opus and .oga, and
+		// WebM for anything else.
+		Format_Auto,
+		Format_WebM,
+		Format_Ogg,
+	};
+
+	// Make a container that hasn't been opened yet.
+	static Container* create(Format format, const std::string& filename);
+
+	// Insert `text` before the extension of `filename`, e.g. rec.webm becomes
+	// rec-2.webm for "-2". A dot in a directory name isn't an extension.
+	static std::string insertBeforeExtension(const std::string& filename, const std::string& text);
+
+	virtual ~Container() {}
+
+	// Create the file. Returns false if it couldn't be opened.
+	virtual bool open(const std::string& filename) = 0;
+
+	// Stream to `output` instead, which is "-" for stdout, "unix:<path>" for
+	// a Unix domain socket, or the name of a file or FIFO (see
+	// AsyncFileWriter), in a form that can be played while it is being
+	// written. Data is passed on at least every `flushMilliseconds`. Returns
+	// false if it couldn't be opened.
+	virtual bool openLive(const std::string& output, int flushMilliseconds) = 0;
+
+	// Add an Opus track. `opusHead` is the OpusHead header (see RFC 7845
+	// section 5.1), and `maxPacketLength` is the longest packet that will be
+	// written to it. Returns the track number, or 0 on error.
+	virtual uint64_t addOpusTrack(int samplingRate, int channels, const std::vector<uint8_t>& opusHead, int maxPacketLength) = 0;
+
+	// Write one packet. The timestamp is in nanoseconds.
+	virtual bool writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp) = 0;
+
+	// Every `milliseconds` of audio, leave the file in a state that can be
+	// played and make sure it is on the disk, so that at most that much is
+	// lost if the program is killed or the power goes off. 0 (the default)
+	// turns it off. The cost is bounded: if the disk hasn't finished the
+	// last checkpoint the next one waits.
+	virtual void setCheckpointInterval(int milliseconds) = 0;
+
+	// How many bytes have been written to the file so far.
+	virtual uint64_t bytesWritten() const = 0;
+
+	// Finish writing the file. Close is called automatically on destruction.
+	virtual bool close() = 0;
+};
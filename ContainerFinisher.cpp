@@ -0,0 +1,41 @@
+#include "ContainerFinisher.h"
+
+#include <iostream>
+
+using namespace std;
+
+ContainerFinisher::ContainerFinisher()
+{
+}
+
+ContainerFinisher::~ContainerFinisher()
+{
+	wait();
+}
+
+void ContainerFinisher::finish(unique_ptr<Container> container, const string& filename)
+{
+	wait();
+
+	Container* previous = container.release();
+	mThread = thread([this, previous, filename]() {
+		if (!previous->close())
+		{
+			cerr << "Error finishing " << filename << endl;
+			mFailed = true;
+		}
+		delete previous;
+	});
+}
+
+bool ContainerFinisher::wait()
+{
+	if (mThread.joinable())
+		mThread.join();
+	return !mFailed;
+}
+
+void ContainerFinisher::reset()
+{
+	mFailed = false;
+}
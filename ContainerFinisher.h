@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "Container.h"
+
+// Closes containers on a background thread, one at a time, so that finishing
+// a file (which for WebM means writing the cues and going back to fill in
+// sizes and the duration) never holds up muxing the next one.
+class ContainerFinisher
+{
+public:
+	ContainerFinisher();
+	// Waits for the last container to be finished.
+	~ContainerFinisher();
+
+	// Close and delete `container` in the background. It waits for the
+	// previous one first, since there is only ever one being finished.
+	// `filename` is for the error message.
+	void finish(std::unique_ptr<Container> container, const std::string& filename);
+
+	// Wait for the last container to be finished, if it is still going.
+	// Returns false if any of them couldn't be finished since the last
+	// `reset()`.
+	bool wait();
+
+	// Forget about earlier failures, e.g. when a new recording starts.
+	void reset();
+
+private:
+	ContainerFinisher(const ContainerFinisher&) = delete;
+	ContainerFinisher& operator=(const ContainerFinisher&) = delete;
+
+	std::thread mThread;
+	std::atomic<bool> mFailed{false};
+};
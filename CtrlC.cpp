@@ -1,6 +1,7 @@
 #include "CtrlC.h"
 
 static CtrlCCallback userCallback = nullptr;
+static CtrlCCallback userSignalCallback = nullptr;
 
 #if defined(_WIN32)
 
@@ -29,6 +30,11 @@ bool SetCtrlCHandler(CtrlCCallback callback)
 	return SetConsoleCtrlHandler(CtrlCHandler, callback ? TRUE : FALSE) != 0;
 }
 
+bool SetUserSignalHandler(CtrlCCallback callback)
+{
+	return false;
+}
+
 #elif defined(__unix)
 
 #include <signal.h>
@@ -67,6 +73,26 @@ bool SetCtrlCHandler(CtrlCCallback callback)
 	return false;
 }
 
+static void UserSignalHandler(int s)
+{
+	if (userSignalCallback)
+		userSignalCallback();
+}
+
+bool SetUserSignalHandler(CtrlCCallback callback)
+{
+	userSignalCallback = callback;
+
+	struct sigaction userSignalAction;
+
+	userSignalAction.sa_handler = callback ? UserSignalHandler : SIG_DFL;
+	sigemptyset(&userSignalAction.sa_mask);
+	// Don't interrupt whatever system call the main thread is in.
+	userSignalAction.sa_flags = SA_RESTART;
+
+	return sigaction(SIGUSR1, &userSignalAction, nullptr) == 0;
+}
+
 
 #else
 #error Ctrl-C support not written for this platform yet.
@@ -9,3 +9,8 @@
 typedef void (*CtrlCCallback)();
 
 bool SetCtrlCHandler(CtrlCCallback callback);
+
+// Set a handler for SIGUSR1 (e.g. `kill -USR1 <pid>`), for asking a running
+// program to do something without stopping it. Windows doesn't have
+// anything like it, so there this always returns false.
+bool SetUserSignalHandler(CtrlCCallback callback);
@@ -0,0 +1,543 @@
+#include "FileEncoder.h"
+
+#include "OpusWriter.h"
+#include "PcmFile.h"
+#include "Semaphore.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// The input is converted in blocks of this many frames.
+static const size_t BlockFrames = 4096;
+
+// Roughly how long each chunk is when encoding in parallel, and how much
+// before it its encoder starts. The pre-roll costs about 2% extra.
+static const int ChunkSeconds = 60;
+static const int PreRollSeconds = 1;
+
+// Chunks that are encoded but not written yet are kept in memory, so limit
+// how far ahead of the writing the encoding can get.
+static const int ChunksPerThread = 2;
+
+// The channel masks of the standard WAV layouts for 3 to 8 channels, and the
+// WAV channel that goes in each position of the Vorbis order for each of
+// them (the same as opusenc). 5.1 may also use side rather than back
+// channels, which is 0x60F.
+static const uint32_t StandardMasks[6] = {0x7, 0x33, 0x37, 0x3F, 0x70F, 0x63F};
+static const uint32_t SideMask5point1 = 0x60F;
+static const int WavToVorbis[6][8] = {
+	{0, 2, 1},
+	{0, 1, 2, 3},
+	{0, 2, 1, 3, 4},
+	{0, 2, 1, 4, 5, 3},
+	{0, 2, 1, 5, 6, 4, 3},
+	{0, 2, 1, 6, 7, 4, 5, 3},
+};
+
+// Everything about the encode that is the same for every chunk.
+struct EncodeSettings
+{
+	EncodeOptions options;
+	int bitrate = 0;
+	// Where each channel comes from, if they need reordering.
+	vector<int> order;
+	OpusWriter::ChannelMapping mapping = OpusWriter::Mapping_Surround;
+	// Output rate / input rate = up / down, in lowest terms.
+	uint64_t up = 1;
+	uint64_t down = 1;
+	// Length of the output in frames, before padding the last Opus frame.
+	uint64_t frames = 0;
+};
+
+// The packets for one chunk.
+struct Chunk
+{
+	vector<uint8_t> data;
+	vector<int> lengths;
+	bool ok = false;
+	atomic<bool> done{false};
+};
+
+// Where the converted samples go: through the resampler, if there is one,
+// and then to the writer.
+struct Output
+{
+	OpusWriter* writer = nullptr;
+	int channels = 0;
+	// Frames given to the writer so far, and how many to give it in total.
+	// When resampling that doesn't include the silence that flushes the filter.
+	uint64_t written = 0;
+	uint64_t target = 0;
+
+	// Only used when resampling. `resampled` is `resampledFrames` long.
+	Resampler* resampler = nullptr;
+	float* resampled = nullptr;
+	size_t resampledFrames = 0;
+};
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+	while (b != 0)
+	{
+		uint64_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Work out which channel of the input goes in each position of the Vorbis
+// order. Returns false if it isn't one of the standard layouts.
+static bool vorbisChannelOrder(const PcmFile& input, vector<int>& order)
+{
+	int channels = input.channels();
+	if (channels < 3 || channels > 8)
+		return false;
+
+	// No mask means the default layout.
+	uint32_t mask = input.channelMask();
+	if (mask != 0 && mask != StandardMasks[channels - 3] && !(channels == 6 && mask == SideMask5point1))
+		return false;
+
+	order.assign(WavToVorbis[channels - 3], WavToVorbis[channels - 3] + channels);
+	return true;
+}
+
+template <typename T>
+static void reorder(T* samples, size_t frames, const vector<int>& order)
+{
+	const size_t channels = order.size();
+	T frame[8];
+	for (size_t i = 0; i < frames; ++i, samples += channels)
+	{
+		copy(samples, samples + channels, frame);
+		for (size_t ch = 0; ch < channels; ++ch)
+			samples[ch] = frame[order[ch]];
+	}
+}
+
+// Write whatever the resampler has ready, up to the target length.
+static bool drainResampler(Output& output)
+{
+	for (;;)
+	{
+		size_t wanted = static_cast<size_t>(min<uint64_t>(output.resampledFrames, output.target - output.written));
+		size_t n = output.resampler->read(output.resampled, wanted);
+		if (n == 0)
+			return true;
+
+		output.written += n;
+		if (!output.writer->write(output.resampled, static_cast<int>(n * output.channels)))
+			return false;
+	}
+}
+
+static bool writeFrames(Output& output, const int16_t* samples, size_t frames)
+{
+	frames = static_cast<size_t>(min<uint64_t>(frames, output.target - output.written));
+	output.written += frames;
+	return output.writer->write(samples, static_cast<int>(frames * output.channels));
+}
+
+static bool writeFrames(Output& output, const float* samples, size_t frames)
+{
+	if (output.resampler == nullptr)
+	{
+		frames = static_cast<size_t>(min<uint64_t>(frames, output.target - output.written));
+		output.written += frames;
+		return output.writer->write(samples, static_cast<int>(frames * output.channels));
+	}
+
+	// The resampler always has room for a block once its output has been read.
+	while (frames > 0 && output.written < output.target)
+	{
+		size_t n = output.resampler->write(samples, frames);
+		samples += n * output.channels;
+		frames -= n;
+		if (!drainResampler(output))
+			return false;
+	}
+	return true;
+}
+
+// Flush the resampler and pad the last frame with silence.
+template <typename T>
+static bool finish(Output& output)
+{
+	if (output.resampler != nullptr)
+	{
+		// Feed it silence from the output buffer, which isn't in use here.
+		while (output.written < output.target)
+		{
+			fill(output.resampled, output.resampled + output.resampledFrames * output.channels, 0.0f);
+			output.resampler->write(output.resampled, output.resampledFrames);
+			if (!drainResampler(output))
+				return false;
+		}
+	}
+
+	const uint64_t frameLength = output.writer->samplesPerFrame() / output.channels;
+	const uint64_t partial = output.written % frameLength;
+	if (partial == 0)
+		return true;
+
+	vector<T> padding((frameLength - partial) * output.channels, T());
+	return output.writer->write(padding.data(), static_cast<int>(padding.size()));
+}
+
+// Encode from output frame `start` until `output.target` frames have been
+// written, converting the input in `block`. If resampling, `start` must be
+// a multiple of `settings.up` so that it is at a whole input frame.
+template <typename T>
+static bool encodeSamples(const PcmFile& input, const EncodeSettings& settings, uint64_t start, Output& output, vector<T>& block)
+{
+	block.resize(BlockFrames * input.channels());
+	for (uint64_t pos = start / settings.up * settings.down; pos < input.frames() && output.written < output.target; pos += BlockFrames)
+	{
+		size_t frames = static_cast<size_t>(min<uint64_t>(BlockFrames, input.frames() - pos));
+		input.convert(pos, frames, block.data());
+		if (!settings.order.empty())
+			reorder(block.data(), frames, settings.order);
+		if (!writeFrames(output, block.data(), frames))
+			return false;
+	}
+	return finish<T>(output);
+}
+
+// Encode output frames [start, end) with a new encoder, passing all but the
+// first `skip` packets to `sink`.
+template <typename T>
+static bool encodeRange(const PcmFile& input,
+                        const EncodeSettings& settings,
+                        uint64_t start,
+                        uint64_t end,
+                        uint64_t skip,
+                        const OpusWriter::PacketCallback& sink)
+{
+	uint64_t skipped = 0;
+	OpusWriter writer(
+	        [&](const uint8_t* packet, int length) {
+		        if (skipped < skip)
+		        {
+			        ++skipped;
+			        return true;
+		        }
+		        return sink(packet, length);
+	        },
+	        static_cast<OpusWriter::SamplingRate>(settings.options.samplingRate),
+	        static_cast<OpusWriter::Channels>(input.channels()),
+	        OpusWriter::Frame_20ms,
+	        settings.bitrate,
+	        static_cast<OpusWriter::ComputationalComplexity>(settings.options.complexity),
+	        settings.mapping);
+	if (writer.status() != OpusWriter::Status_Ok)
+		return false;
+
+	Output output;
+	output.writer = &writer;
+	output.channels = input.channels();
+	output.target = end - start;
+
+	unique_ptr<Resampler> resampler;
+	vector<float> resampled;
+	if (settings.up != settings.down)
+	{
+		resampler.reset(new Resampler(input.sampleRate(), settings.options.samplingRate, input.channels(), settings.options.resampleQuality, BlockFrames));
+		resampled.resize(BlockFrames * input.channels());
+		output.resampler = resampler.get();
+		output.resampled = resampled.data();
+		output.resampledFrames = BlockFrames;
+	}
+
+	vector<T> block;
+	return encodeSamples(input, settings, start, output, block);
+}
+
+// How a file is split into chunks. This only depends on the file and the
+// settings, so the output doesn't depend on the number of threads.
+struct ChunkLayout
+{
+	// Opus frame length.
+	uint64_t frameLength = 0;
+	uint64_t chunkFrames = 0;
+	uint64_t preRoll = 0;
+	size_t count = 0;
+};
+
+static ChunkLayout chunkLayout(const EncodeSettings& settings)
+{
+	ChunkLayout layout;
+	const uint64_t rate = settings.options.samplingRate;
+	layout.frameLength = rate * OpusWriter::Frame_20ms / 1000000;
+
+	// Chunks start on a whole Opus frame and, if resampling, a whole input frame.
+	const uint64_t align = layout.frameLength / gcd(layout.frameLength, settings.up) * settings.up;
+	layout.chunkFrames = max<uint64_t>(1, rate * ChunkSeconds / align) * align;
+	layout.preRoll = (rate * PreRollSeconds + align - 1) / align * align;
+	layout.count = static_cast<size_t>((settings.frames + layout.chunkFrames - 1) / layout.chunkFrames);
+	return layout;
+}
+
+// Work out the settings for encoding `input`.
+static EncodeSettings encodeSettings(const PcmFile& input, const EncodeOptions& options)
+{
+	const int channels = input.channels();
+
+	EncodeSettings settings;
+	settings.options = options;
+	settings.bitrate = options.bitrate > 0 ? options.bitrate : (channels > 2 ? 32000 * channels : 64000);
+	bool surround = channels <= 2 || vorbisChannelOrder(input, settings.order);
+	settings.mapping = surround ? OpusWriter::Mapping_Surround : OpusWriter::Mapping_Discrete;
+
+	uint64_t divisor = gcd(options.samplingRate, input.sampleRate());
+	settings.up = options.samplingRate / divisor;
+	settings.down = input.sampleRate() / divisor;
+	settings.frames = input.frames() / settings.down * settings.up + input.frames() % settings.down * settings.up / settings.down;
+	return settings;
+}
+
+static void printResampleError(const PcmFile& input, const EncodeOptions& options)
+{
+	cerr << "Unable to resample from " << input.sampleRate() << " Hz to " << options.samplingRate << " Hz." << endl;
+}
+
+template <typename T>
+static bool encodeChunks(const PcmFile& input, const EncodeSettings& settings, const ChunkLayout& layout, OpusWriter& writer, int threads)
+{
+	const uint64_t frameLength = layout.frameLength;
+	const uint64_t chunkFrames = layout.chunkFrames;
+	const uint64_t preRoll = layout.preRoll;
+	const size_t chunkCount = layout.count;
+
+	vector<unique_ptr<Chunk>> chunks;
+	for (size_t i = 0; i < chunkCount; ++i)
+		chunks.emplace_back(new Chunk);
+
+	atomic<size_t> nextChunk{0};
+	atomic<bool> stopping{false};
+	// Posted once for each chunk that may be started, and whenever one is done.
+	Semaphore slots;
+	Semaphore chunkDone;
+
+	auto worker = [&]() {
+		for (;;)
+		{
+			while (!slots.waitFor(chrono::seconds(1)))
+			{
+			}
+
+			size_t index = nextChunk++;
+			if (index >= chunkCount || stopping)
+			{
+				// Let the next worker see that too.
+				slots.post();
+				return;
+			}
+
+			Chunk& chunk = *chunks[index];
+			uint64_t start = index * chunkFrames;
+			uint64_t end = min(start + chunkFrames, settings.frames);
+			uint64_t skip = index == 0 ? 0 : preRoll / frameLength;
+			if (index != 0)
+				start -= preRoll;
+
+			chunk.ok = encodeRange<T>(input, settings, start, end, skip, [&](const uint8_t* packet, int length) {
+				chunk.data.insert(chunk.data.end(), packet, packet + length);
+				chunk.lengths.push_back(length);
+				return true;
+			});
+			chunk.done = true;
+			chunkDone.post();
+		}
+	};
+
+	threads = min<int>(threads, static_cast<int>(chunkCount));
+	for (int i = 0; i < threads * ChunksPerThread; ++i)
+		slots.post();
+
+	vector<thread> workers;
+	for (int i = 0; i < threads; ++i)
+		workers.push_back(thread(worker));
+
+	// Write the chunks in order as they are finished.
+	bool ok = true;
+	for (size_t i = 0; i < chunkCount && ok; ++i)
+	{
+		Chunk& chunk = *chunks[i];
+		while (!chunk.done)
+			chunkDone.waitFor(chrono::seconds(1));
+
+		ok = chunk.ok;
+		size_t offset = 0;
+		for (size_t p = 0; p < chunk.lengths.size() && ok; ++p)
+		{
+			ok = writer.writePacket(chunk.data.data() + offset, chunk.lengths[p]);
+			offset += chunk.lengths[p];
+		}
+
+		chunks[i].reset();
+		slots.post();
+	}
+
+	if (!ok)
+	{
+		stopping = true;
+		slots.post();
+	}
+	for (thread& t : workers)
+		t.join();
+	return ok;
+}
+
+double EncodeStats::realtimeMultiple() const
+{
+	return seconds > 0.0 ? audioSeconds / seconds : 0.0;
+}
+
+bool EncodeFile(const PcmFile& input, const string& outfile, const EncodeOptions& options, EncodeStats& stats)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	EncodeSettings settings = encodeSettings(input, options);
+	ChunkLayout layout = chunkLayout(settings);
+	if (layout.count <= 1)
+		return FileEncoder(options).encode(input, outfile, stats);
+
+	// This writer only writes; the encoding is done by an OpusWriter for
+	// each chunk, which have the same settings.
+	OpusWriter writer(outfile,
+	                  static_cast<OpusWriter::SamplingRate>(options.samplingRate),
+	                  static_cast<OpusWriter::Channels>(input.channels()),
+	                  OpusWriter::Frame_20ms,
+	                  settings.bitrate,
+	                  static_cast<OpusWriter::ComputationalComplexity>(options.complexity),
+	                  settings.mapping,
+	                  options.container);
+	if (writer.status() != OpusWriter::Status_Ok)
+	{
+		cerr << "Error creating " << outfile << ": Opus writer error " << writer.status() << endl;
+		return false;
+	}
+
+	bool resampling = settings.up != settings.down;
+	if (resampling && !Resampler(input.sampleRate(), options.samplingRate, input.channels(), options.resampleQuality, BlockFrames).valid())
+	{
+		printResampleError(input, options);
+		return false;
+	}
+
+	int threads = options.threads > 0 ? options.threads : max(1, static_cast<int>(thread::hardware_concurrency()));
+
+	// Resampling is done in float.
+	bool ok = input.isFloat() || resampling ? encodeChunks<float>(input, settings, layout, writer, threads)
+	                                        : encodeChunks<int16_t>(input, settings, layout, writer, threads);
+	ok = writer.close() && ok;
+	if (!ok)
+		cerr << "Error encoding " << outfile << ": Opus writer error " << writer.status() << endl;
+
+	stats.audioSeconds = static_cast<double>(input.frames()) / input.sampleRate();
+	stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	stats.bytes = input.dataBytes();
+	return ok;
+}
+
+FileEncoder::FileEncoder(const EncodeOptions& options) : mOptions(options)
+{
+}
+
+FileEncoder::~FileEncoder()
+{
+}
+
+bool FileEncoder::encode(const PcmFile& input, const string& outfile, EncodeStats& stats)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	const int channels = input.channels();
+	EncodeSettings settings = encodeSettings(input, mOptions);
+
+	OpusWriter::SamplingRate rate = static_cast<OpusWriter::SamplingRate>(mOptions.samplingRate);
+	OpusWriter::Channels chans = static_cast<OpusWriter::Channels>(channels);
+	OpusWriter::ComputationalComplexity complexity = static_cast<OpusWriter::ComputationalComplexity>(mOptions.complexity);
+	if (mWriter)
+		mWriter->reopen(outfile, rate, chans, OpusWriter::Frame_20ms, settings.bitrate, complexity, settings.mapping, mOptions.container);
+	else
+		mWriter.reset(new OpusWriter(outfile, rate, chans, OpusWriter::Frame_20ms, settings.bitrate, complexity, settings.mapping, mOptions.container));
+	if (mWriter->status() != OpusWriter::Status_Ok)
+	{
+		cerr << "Error creating " << outfile << ": Opus writer error " << mWriter->status() << endl;
+		return false;
+	}
+
+	Output output;
+	output.writer = mWriter.get();
+	output.channels = channels;
+	output.target = settings.frames;
+
+	bool resampling = settings.up != settings.down;
+	if (resampling)
+	{
+		if (mResampler && mResamplerRate == input.sampleRate() && mResamplerChannels == channels)
+		{
+			mResampler->reset();
+		}
+		else
+		{
+			mResampler.reset(new Resampler(input.sampleRate(), mOptions.samplingRate, channels, mOptions.resampleQuality, BlockFrames));
+			mResamplerRate = input.sampleRate();
+			mResamplerChannels = channels;
+		}
+		if (!mResampler->valid())
+		{
+			printResampleError(input, mOptions);
+			return false;
+		}
+
+		mResampled.resize(BlockFrames * channels);
+		output.resampler = mResampler.get();
+		output.resampled = mResampled.data();
+		output.resampledFrames = BlockFrames;
+	}
+
+	// Resampling is done in float.
+	bool ok = input.isFloat() || resampling ? encodeSamples(input, settings, 0, output, mFloatBlock)
+	                                        : encodeSamples(input, settings, 0, output, mBlock);
+	ok = mWriter->close() && ok;
+	if (!ok)
+		cerr << "Error encoding " << outfile << ": Opus writer error " << mWriter->status() << endl;
+
+	stats.audioSeconds = static_cast<double>(input.frames()) / input.sampleRate();
+	stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	stats.bytes = input.dataBytes();
+	return ok;
+}
+
+void EncodeBatch(vector<BatchJob>& jobs, const EncodeOptions& options, const OpenInput& open)
+{
+	int threads = options.threads > 0 ? options.threads : max(1, static_cast<int>(thread::hardware_concurrency()));
+	threads = max(1, min(threads, static_cast<int>(jobs.size())));
+
+	atomic<size_t> nextJob{0};
+	auto worker = [&]() {
+		FileEncoder encoder(options);
+		for (size_t index = nextJob++; index < jobs.size(); index = nextJob++)
+		{
+			BatchJob& job = jobs[index];
+			PcmFile input;
+			job.ok = open(input, job.input) && encoder.encode(input, job.output, job.stats);
+		}
+	};
+
+	vector<thread> workers;
+	for (int i = 0; i < threads; ++i)
+		workers.push_back(thread(worker));
+	for (thread& t : workers)
+		t.join();
+}
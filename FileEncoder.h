@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Container.h"
+#include "Resampler.h"
+
+class OpusWriter;
+class PcmFile;
+
+// Settings for `EncodeFile()`, `FileEncoder` and `EncodeBatch()`.
+struct EncodeOptions
+{
+	// The Opus sampling rate. The input is resampled if it is different.
+	int samplingRate = 48000;
+	int complexity = 10;
+	// Bits per second for all channels together, or 0 for the same default
+	// as recording: 64000, or 32000 per channel for more than 2 channels.
+	int bitrate = 0;
+	Resampler::Quality resampleQuality = Resampler::Quality_Medium;
+	// Number of threads to encode with, or 0 for one per core.
+	int threads = 0;
+	Container::Format container = Container::Format_Auto;
+};
+
+// How long an encode took.
+struct EncodeStats
+{
+	// Length of the input.
+	double audioSeconds = 0.0;
+	// Wall clock time that encoding took, including writing the output.
+	double seconds = 0.0;
+	// Size of the input's audio data.
+	uint64_t bytes = 0;
+
+	// How many times faster than realtime it was.
+	double realtimeMultiple() const;
+};
+
+// Encode a whole PCM file to a WebM or Ogg Opus file as fast as possible, through
+// the same conversion and OpusWriter code as recording. The last frame is
+// padded with silence. WAV files with 3 to 8 channels in the standard WAV
+// layouts are encoded as surround; other multichannel files as separate
+// channels. Prints an error and returns false on failure.
+//
+// Long files are split into chunks which are encoded in parallel, each with
+// its own encoder. Each chunk's encoder starts a little before the chunk so
+// that its state has settled by the time it gets there, and the packets for
+// that pre-roll are thrown away. The chunks' packets are then written in
+// order as one continuous track.
+bool EncodeFile(const PcmFile& input, const std::string& outfile, const EncodeOptions& options, EncodeStats& stats);
+
+// Encodes files one at a time on the calling thread, like `EncodeFile()` with
+// one thread except that files aren't split into chunks. The encoder, the
+// resampler and the buffers are kept and reused for the next file, which
+// matters when there are lots of short files.
+class FileEncoder
+{
+public:
+	explicit FileEncoder(const EncodeOptions& options);
+	~FileEncoder();
+
+	// Prints an error and returns false on failure.
+	bool encode(const PcmFile& input, const std::string& outfile, EncodeStats& stats);
+
+private:
+	FileEncoder(const FileEncoder&) = delete;
+	FileEncoder& operator=(const FileEncoder&) = delete;
+
+	EncodeOptions mOptions;
+
+	std::unique_ptr<OpusWriter> mWriter;
+	std::unique_ptr<Resampler> mResampler;
+	// What mResampler was made for.
+	int mResamplerRate = 0;
+	int mResamplerChannels = 0;
+
+	std::vector<int16_t> mBlock;
+	std::vector<float> mFloatBlock;
+	std::vector<float> mResampled;
+};
+
+// One file for `EncodeBatch()`.
+struct BatchJob
+{
+	std::string input;
+	std::string output;
+	// Set when it has been done.
+	bool ok = false;
+	EncodeStats stats;
+};
+
+// Opens an input file for `EncodeBatch()`. It should print an error and
+// return false on failure.
+typedef std::function<bool(PcmFile& file, const std::string& filename)> OpenInput;
+
+// Encode a list of files on `options.threads` threads, with a FileEncoder for
+// each thread. Failures are printed and recorded in the jobs.
+void EncodeBatch(std::vector<BatchJob>& jobs, const EncodeOptions& options, const OpenInput& open);
@@ -0,0 +1,162 @@
+#include "FrameArena.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Every array from operator new[] starts with one of these, which says which
+// arena it came from, or null for malloc(). The union keeps the array after
+// it aligned for anything.
+union ArrayHeader
+{
+	FrameArena* arena;
+	std::max_align_t align;
+};
+
+// The arena that new[] uses on this thread, if any.
+static thread_local FrameArena* currentArena = nullptr;
+
+static size_t roundUp(size_t size)
+{
+	return (size + sizeof(ArrayHeader) - 1) / sizeof(ArrayHeader) * sizeof(ArrayHeader);
+}
+
+FrameArena::FrameArena()
+{
+}
+
+FrameArena::~FrameArena()
+{
+	std::free(mMemory);
+	std::free(mFree);
+}
+
+bool FrameArena::reserve(size_t blockSize, size_t blockCount)
+{
+	blockSize = roundUp(blockSize + sizeof(ArrayHeader));
+	if (blockSize <= mBlockSize && blockCount <= mBlockCount)
+		return true;
+
+	lock();
+	bool inUse = mFreeCount != mBlockCount;
+	unlock();
+	if (inUse)
+		return false;
+
+	blockSize = blockSize > mBlockSize ? blockSize : mBlockSize;
+	blockCount = blockCount > mBlockCount ? blockCount : mBlockCount;
+
+	unsigned char* memory = static_cast<unsigned char*>(std::malloc(blockSize * blockCount));
+	void** freeList = static_cast<void**>(std::malloc(blockCount * sizeof(void*)));
+	if (memory == nullptr || freeList == nullptr)
+	{
+		std::free(memory);
+		std::free(freeList);
+		return false;
+	}
+
+	std::free(mMemory);
+	std::free(mFree);
+	mMemory = memory;
+	mFree = freeList;
+	mBlockSize = blockSize;
+	mBlockCount = blockCount;
+	for (size_t i = 0; i < blockCount; ++i)
+		mFree[i] = mMemory + i * blockSize;
+	mFreeCount = blockCount;
+	return true;
+}
+
+void* FrameArena::allocate(size_t size)
+{
+	if (size > mBlockSize)
+		return nullptr;
+
+	void* block = nullptr;
+	lock();
+	if (mFreeCount > 0)
+		block = mFree[--mFreeCount];
+	unlock();
+	return block;
+}
+
+void FrameArena::free(void* block)
+{
+	lock();
+	mFree[mFreeCount++] = block;
+	unlock();
+}
+
+void FrameArena::lock()
+{
+	while (mLock.test_and_set(std::memory_order_acquire))
+	{
+	}
+}
+
+void FrameArena::unlock()
+{
+	mLock.clear(std::memory_order_release);
+}
+
+FrameArena::Scope::Scope(FrameArena& arena) : mPrevious(currentArena)
+{
+	currentArena = &arena;
+}
+
+FrameArena::Scope::~Scope()
+{
+	currentArena = mPrevious;
+}
+
+static void* allocateArray(std::size_t size)
+{
+	FrameArena* arena = currentArena;
+	void* block = arena != nullptr ? arena->allocate(size + sizeof(ArrayHeader)) : nullptr;
+	if (block == nullptr)
+	{
+		arena = nullptr;
+		block = std::malloc(size + sizeof(ArrayHeader));
+		if (block == nullptr)
+			return nullptr;
+	}
+
+	ArrayHeader* header = static_cast<ArrayHeader*>(block);
+	header->arena = arena;
+	return header + 1;
+}
+
+static void freeArray(void* array)
+{
+	if (array == nullptr)
+		return;
+
+	ArrayHeader* header = static_cast<ArrayHeader*>(array) - 1;
+	if (header->arena != nullptr)
+		header->arena->free(header);
+	else
+		std::free(header);
+}
+
+void* operator new[](std::size_t size)
+{
+	void* array = allocateArray(size);
+	if (array == nullptr)
+		throw std::bad_alloc();
+	return array;
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return allocateArray(size);
+}
+
+void operator delete[](void* array) noexcept
+{
+	freeArray(array);
+}
+
+void operator delete[](void* array, const std::nothrow_t&) noexcept
+{
+	freeArray(array);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// A pool of fixed-size blocks for the copy that mkvmuxer makes of every frame
+// (mkvmuxer::Frame::Init() does `new uint8_t[length]`), so that muxing
+// doesn't allocate for each packet.
+//
+// libwebm has no way to supply an allocator, so FrameArena.cpp replaces the
+// global `operator new[]` and `operator delete[]`. While a Scope is alive on
+// a thread, array allocations on that thread that fit in a block come from
+// its arena; everything else goes to malloc() as normal. Each array has a
+// small header saying where it came from, so it can be deleted from any
+// thread. If the blocks run out it falls back to malloc().
+class FrameArena
+{
+public:
+	FrameArena();
+	~FrameArena();
+
+	// Make sure there are at least `blockCount` blocks of at least
+	// `blockSize` bytes. This can only grow the blocks while none of them are
+	// in use. Returns false if that isn't possible.
+	bool reserve(size_t blockSize, size_t blockCount);
+
+	// Use `arena` for `new[]` on this thread for the lifetime of the Scope.
+	class Scope
+	{
+	public:
+		explicit Scope(FrameArena& arena);
+		~Scope();
+
+	private:
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+		FrameArena* mPrevious;
+	};
+
+	// Used by operator new[] and delete[]. `allocate()` returns nullptr if
+	// `size` doesn't fit in a block or there aren't any free.
+	void* allocate(size_t size);
+	void free(void* block);
+
+private:
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator=(const FrameArena&) = delete;
+
+	void lock();
+	void unlock();
+
+	// The blocks, one after the other.
+	unsigned char* mMemory = nullptr;
+	size_t mBlockSize = 0;
+	size_t mBlockCount = 0;
+
+	// A stack of the free blocks. Blocks are normally allocated and freed on
+	// the muxing thread, but they may be freed anywhere, so this is guarded
+	// by a spinlock.
+	void** mFree = nullptr;
+	size_t mFreeCount = 0;
+	std::atomic_flag mLock = ATOMIC_FLAG_INIT;
+};
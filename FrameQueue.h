@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+#include "RingBuffer.h"
+#include "Semaphore.h"
+
+// A bounded queue for passing objects from one thread to another without
+// allocating. All the objects are created up front; the producer takes an
+// empty one with `acquire()`, fills it and `push()`es it, and the consumer
+// `pop()`s it and gives it back with `release()` when it is done.
+//
+// Like RingBuffer it is only thread-safe with one producer and one consumer.
+//
+// There are blocking and non-blocking versions of the calls. The blocking
+// ones wait on the queue's own semaphores; users of the non-blocking ones
+// are expected to arrange their own wakeups.
+template <typename T>
+class FrameQueue
+{
+public:
+	// Make `count` copies of `prototype`.
+	FrameQueue(size_t count, const T& prototype)
+	    : mObjects(count, prototype), mFree(count), mFull(count)
+	{
+		for (T& object : mObjects)
+			mFree.push(&object);
+	}
+
+	// Producer: get an empty object without waiting. Returns nullptr if they
+	// are all in use, i.e. the consumer is behind.
+	T* tryAcquire()
+	{
+		T* object = nullptr;
+		mFree.pop(object);
+		return object;
+	}
+
+	// Producer: get an empty object, waiting for the consumer to release one
+	// if necessary.
+	T* acquire()
+	{
+		T* object = nullptr;
+		while (!mFree.pop(object))
+			mReleased.waitFor(WaitTimeout);
+		return object;
+	}
+
+	// Producer: pass a filled object to the consumer.
+	void push(T* object)
+	{
+		mFull.push(object);
+		mPushed.post();
+	}
+
+	// Producer: there will be no more objects.
+	void close()
+	{
+		mClosed.store(true, std::memory_order_release);
+		mPushed.post();
+	}
+
+	// Consumer: get the next filled object, waiting for one if necessary.
+	// Returns nullptr once the queue is closed and empty.
+	T* pop()
+	{
+		T* object = nullptr;
+		for (;;)
+		{
+			// Check `mClosed` first so that we can't miss the last objects.
+			bool closed = mClosed.load(std::memory_order_acquire);
+			if (mFull.pop(object))
+				return object;
+			if (closed)
+				return nullptr;
+			mPushed.waitFor(WaitTimeout);
+		}
+	}
+
+	// Consumer: get the next filled object without waiting or removing it.
+	// Returns nullptr if there isn't one.
+	T* front()
+	{
+		typename RingBuffer<T*>::Region region = mFull.peek(1);
+		return region.size() == 0 ? nullptr : *region.first;
+	}
+
+	// Consumer: get the next filled object without waiting. Returns nullptr
+	// if there isn't one.
+	T* tryPop()
+	{
+		T* object = nullptr;
+		mFull.pop(object);
+		return object;
+	}
+
+	// Consumer: true once the queue is closed and empty, so `pop()` would
+	// return nullptr.
+	bool finished() const
+	{
+		// Check `mClosed` first for the same reason as in `pop()`.
+		bool closed = mClosed.load(std::memory_order_acquire);
+		return closed && mFull.empty();
+	}
+
+	// Consumer: give back an object from `pop()` so it can be reused.
+	void release(T* object)
+	{
+		mFree.push(object);
+		mReleased.post();
+	}
+
+	// Number of filled objects waiting for the consumer.
+	size_t size() const
+	{
+		return mFull.size();
+	}
+
+	// Total number of objects.
+	size_t capacity() const
+	{
+		return mObjects.size();
+	}
+
+private:
+	// The semaphores should always be posted, but don't rely on it.
+	static constexpr std::chrono::microseconds WaitTimeout{100000};
+
+	std::vector<T> mObjects;
+
+	// Objects that the producer can fill.
+	RingBuffer<T*> mFree;
+	// Objects that the consumer can read.
+	RingBuffer<T*> mFull;
+
+	Semaphore mPushed;
+	Semaphore mReleased;
+
+	std::atomic<bool> mClosed{false};
+};
+
+template <typename T>
+constexpr std::chrono::microseconds FrameQueue<T>::WaitTimeout;
@@ -0,0 +1,171 @@
+#include "MappedFile.h"
+
+#include <iostream>
+
+using namespace std;
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+struct MappedFile::Impl
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+};
+
+bool MappedFile::open(const string& filename)
+{
+	close();
+
+	mImpl->file = CreateFileA(filename.c_str(),
+	                          GENERIC_READ,
+	                          FILE_SHARE_READ,
+	                          nullptr,
+	                          OPEN_EXISTING,
+	                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+	                          nullptr);
+	if (mImpl->file == INVALID_HANDLE_VALUE)
+	{
+		cerr << "Unable to open " << filename << ": error " << GetLastError() << endl;
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mImpl->file, &size))
+	{
+		cerr << "Unable to get the size of " << filename << ": error " << GetLastError() << endl;
+		close();
+		return false;
+	}
+	mSize = static_cast<uint64_t>(size.QuadPart);
+
+	// Empty files can't be mapped.
+	if (mSize == 0)
+		return true;
+
+	if (mSize > static_cast<uint64_t>(SIZE_MAX))
+	{
+		cerr << filename << " is too big to map." << endl;
+		close();
+		return false;
+	}
+
+	mImpl->mapping = CreateFileMappingA(mImpl->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mImpl->mapping != nullptr)
+		mData = static_cast<const uint8_t*>(MapViewOfFile(mImpl->mapping, FILE_MAP_READ, 0, 0, 0));
+	if (mData == nullptr)
+	{
+		cerr << "Unable to map " << filename << ": error " << GetLastError() << endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (mData != nullptr)
+		UnmapViewOfFile(mData);
+	if (mImpl->mapping != nullptr)
+		CloseHandle(mImpl->mapping);
+	if (mImpl->file != INVALID_HANDLE_VALUE)
+		CloseHandle(mImpl->file);
+
+	mImpl->mapping = nullptr;
+	mImpl->file = INVALID_HANDLE_VALUE;
+	mData = nullptr;
+	mSize = 0;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct MappedFile::Impl
+{
+	int fd = -1;
+};
+
+bool MappedFile::open(const string& filename)
+{
+	close();
+
+	mImpl->fd = ::open(filename.c_str(), O_RDONLY);
+	if (mImpl->fd < 0)
+	{
+		cerr << "Unable to open " << filename << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(mImpl->fd, &st) != 0)
+	{
+		cerr << "Unable to get the size of " << filename << ": " << strerror(errno) << endl;
+		close();
+		return false;
+	}
+	mSize = static_cast<uint64_t>(st.st_size);
+
+	// Empty files can't be mapped.
+	if (mSize == 0)
+		return true;
+
+	if (mSize > static_cast<uint64_t>(SIZE_MAX))
+	{
+		cerr << filename << " is too big to map." << endl;
+		close();
+		return false;
+	}
+
+	void* data = mmap(nullptr, static_cast<size_t>(mSize), PROT_READ, MAP_PRIVATE, mImpl->fd, 0);
+	if (data == MAP_FAILED)
+	{
+		cerr << "Unable to map " << filename << ": " << strerror(errno) << endl;
+		close();
+		return false;
+	}
+	mData = static_cast<const uint8_t*>(data);
+
+	// This is only a hint, so it doesn't matter if it fails.
+	madvise(data, static_cast<size_t>(mSize), MADV_SEQUENTIAL);
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (mData != nullptr)
+		munmap(const_cast<uint8_t*>(mData), static_cast<size_t>(mSize));
+	if (mImpl->fd >= 0)
+		::close(mImpl->fd);
+
+	mImpl->fd = -1;
+	mData = nullptr;
+	mSize = 0;
+}
+
+#endif
+
+MappedFile::MappedFile() : mImpl(new Impl)
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+const uint8_t* MappedFile::data() const
+{
+	return mData;
+}
+
+uint64_t MappedFile::size() const
+{
+	return mSize;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// A read-only memory mapping of a whole file. The mapping is hinted for
+// sequential access, so the OS reads ahead and can drop pages that have been
+// read, which means files much bigger than RAM are fine (on 64-bit systems).
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Map `filename`. Prints an error and returns false on failure.
+	bool open(const std::string& filename);
+
+	// Unmap the file. This is called automatically on destruction.
+	void close();
+
+	// The contents of the file. `data()` is null if the file is empty.
+	const uint8_t* data() const;
+	uint64_t size() const;
+
+private:
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// The platform-specific handles.
+	struct Impl;
+	std::unique_ptr<Impl> mImpl;
+
+	const uint8_t* mData = nullptr;
+	uint64_t mSize = 0;
+};
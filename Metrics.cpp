@@ -0,0 +1,262 @@
+#include "Metrics.h"
+
+#include <cmath>
+#include <ostream>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+// The quantiles that histograms are summarised with. 1 is the maximum.
+static const double Quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+
+// Index of the highest set bit. `value` must not be 0.
+static int highestBit(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return static_cast<int>(index);
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+static void writeEscaped(ostream& os, const string& s)
+{
+	for (char c : s)
+	{
+		if (c == '\\' || c == '"')
+			os << '\\' << c;
+		else if (c == '\n')
+			os << "\\n";
+		else if (static_cast<unsigned char>(c) < 0x20)
+			os << ' ';
+		else
+			os << c;
+	}
+}
+
+// Prometheus accepts NaN and infinities but JSON doesn't.
+static void writeJsonNumber(ostream& os, double value)
+{
+	if (isfinite(value))
+		os << value;
+	else
+		os << "null";
+}
+
+Histogram::Histogram()
+{
+	for (atomic<uint64_t>& bucket : mBuckets)
+		bucket.store(0, memory_order_relaxed);
+}
+
+int Histogram::bucketIndex(uint64_t value)
+{
+	if (value < 2 * SubBuckets)
+		return static_cast<int>(value);
+	int shift = highestBit(value) - SubBucketBits;
+	return shift * SubBuckets + static_cast<int>(value >> shift);
+}
+
+uint64_t Histogram::bucketMax(int index)
+{
+	if (index < 2 * SubBuckets)
+		return index;
+	int shift = index / SubBuckets - 1;
+	uint64_t mantissa = index - shift * SubBuckets;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+	mBuckets[bucketIndex(value)].fetch_add(1, memory_order_relaxed);
+	mSum.fetch_add(value, memory_order_relaxed);
+	uint64_t max = mMax.load(memory_order_relaxed);
+	while (value > max && !mMax.compare_exchange_weak(max, value, memory_order_relaxed))
+	{
+	}
+	// This is last so that the buckets add up to at least the count.
+	mCount.fetch_add(1, memory_order_release);
+}
+
+uint64_t Histogram::count() const
+{
+	return mCount.load(memory_order_acquire);
+}
+
+uint64_t Histogram::sum() const
+{
+	return mSum.load(memory_order_relaxed);
+}
+
+uint64_t Histogram::max() const
+{
+	return mMax.load(memory_order_relaxed);
+}
+
+uint64_t Histogram::quantile(double quantile) const
+{
+	uint64_t total = count();
+	if (total == 0)
+		return 0;
+
+	// The rank of the value we want, counting from 1.
+	uint64_t rank = static_cast<uint64_t>(ceil(quantile * total));
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	uint64_t largest = max();
+	for (int i = 0; i < BucketCount; ++i)
+	{
+		seen += mBuckets[i].load(memory_order_relaxed);
+		if (seen >= rank)
+			return bucketMax(i) < largest ? bucketMax(i) : largest;
+	}
+	return largest;
+}
+
+void Metrics::addCounter(const string& name, const string& help, const Labels& labels, const atomic<uint64_t>& counter)
+{
+	add(Metric{Type_Counter, name, help, labels, &counter, nullptr, nullptr, 1.0});
+}
+
+void Metrics::addGauge(const string& name, const string& help, const Labels& labels, function<double()> gauge)
+{
+	add(Metric{Type_Gauge, name, help, labels, nullptr, gauge, nullptr, 1.0});
+}
+
+void Metrics::addHistogram(const string& name, const string& help, const Labels& labels, const Histogram& histogram, double scale)
+{
+	add(Metric{Type_Histogram, name, help, labels, nullptr, nullptr, &histogram, scale});
+}
+
+void Metrics::add(const Metric& metric)
+{
+	// Put it after the last one with the same name.
+	for (size_t i = mMetrics.size(); i > 0; --i)
+	{
+		if (mMetrics[i - 1].name == metric.name)
+		{
+			mMetrics.insert(mMetrics.begin() + i, metric);
+			return;
+		}
+	}
+	mMetrics.push_back(metric);
+}
+
+void Metrics::writePrometheus(ostream& os) const
+{
+	streamsize precision = os.precision(15);
+
+	auto writeLabels = [&](const Labels& labels, const char* extraName, double extraValue) {
+		if (labels.empty() && extraName == nullptr)
+			return;
+		os << '{';
+		const char* separator = "";
+		for (const pair<string, string>& label : labels)
+		{
+			os << separator << label.first << "=\"";
+			writeEscaped(os, label.second);
+			os << '"';
+			separator = ",";
+		}
+		if (extraName != nullptr)
+			os << separator << extraName << "=\"" << extraValue << '"';
+		os << '}';
+	};
+
+	for (size_t i = 0; i < mMetrics.size(); ++i)
+	{
+		const Metric& metric = mMetrics[i];
+		if (i == 0 || mMetrics[i - 1].name != metric.name)
+		{
+			static const char* const types[] = {"counter", "gauge", "summary"};
+			os << "# HELP " << metric.name << ' ' << metric.help << '\n';
+			os << "# TYPE " << metric.name << ' ' << types[metric.type] << '\n';
+		}
+
+		switch (metric.type)
+		{
+		case Type_Counter:
+			os << metric.name;
+			writeLabels(metric.labels, nullptr, 0.0);
+			os << ' ' << metric.counter->load(memory_order_relaxed) << '\n';
+			break;
+		case Type_Gauge:
+			os << metric.name;
+			writeLabels(metric.labels, nullptr, 0.0);
+			os << ' ' << metric.gauge() << '\n';
+			break;
+		case Type_Histogram:
+			for (double q : Quantiles)
+			{
+				os << metric.name;
+				writeLabels(metric.labels, "quantile", q);
+				os << ' ' << metric.histogram->quantile(q) * metric.scale << '\n';
+			}
+			os << metric.name << "_sum";
+			writeLabels(metric.labels, nullptr, 0.0);
+			os << ' ' << metric.histogram->sum() * metric.scale << '\n';
+			os << metric.name << "_count";
+			writeLabels(metric.labels, nullptr, 0.0);
+			os << ' ' << metric.histogram->count() << '\n';
+			break;
+		}
+	}
+
+	os.precision(precision);
+}
+
+void Metrics::writeJson(ostream& os) const
+{
+	streamsize precision = os.precision(15);
+
+	os << "{\"metrics\": [";
+	for (size_t i = 0; i < mMetrics.size(); ++i)
+	{
+		const Metric& metric = mMetrics[i];
+		os << (i == 0 ? "\n" : ",\n") << "  {\"name\": \"";
+		writeEscaped(os, metric.name);
+		os << "\", \"labels\": {";
+		const char* separator = "";
+		for (const pair<string, string>& label : metric.labels)
+		{
+			os << separator << '"';
+			writeEscaped(os, label.first);
+			os << "\": \"";
+			writeEscaped(os, label.second);
+			os << '"';
+			separator = ", ";
+		}
+		os << "}, ";
+
+		switch (metric.type)
+		{
+		case Type_Counter:
+			os << "\"value\": " << metric.counter->load(memory_order_relaxed);
+			break;
+		case Type_Gauge:
+			os << "\"value\": ";
+			writeJsonNumber(os, metric.gauge());
+			break;
+		case Type_Histogram:
+			os << "\"count\": " << metric.histogram->count()
+			   << ", \"sum\": " << metric.histogram->sum() * metric.scale
+			   << ", \"max\": " << metric.histogram->max() * metric.scale
+			   << ", \"quantiles\": {";
+			for (size_t q = 0; q < sizeof(Quantiles) / sizeof(Quantiles[0]); ++q)
+				os << (q == 0 ? "\"" : ", \"") << Quantiles[q] << "\": " << metric.histogram->quantile(Quantiles[q]) * metric.scale;
+			os << '}';
+			break;
+		}
+		os << '}';
+	}
+	os << "\n]}\n";
+
+	os.precision(precision);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A histogram of non-negative integers that can be recorded from any thread,
+// including realtime ones: recording is a few relaxed atomic adds and never
+// locks or allocates.
+//
+// Like HdrHistogram the buckets are log-linear: every power of two is split
+// into SubBuckets equal buckets, so any value is placed to within 1/SubBuckets
+// (12.5%) of itself, and small values exactly. That covers nanoseconds to
+// hours in a few kilobytes.
+class Histogram
+{
+public:
+	Histogram();
+
+	void record(uint64_t value);
+
+	uint64_t count() const;
+	uint64_t sum() const;
+	uint64_t max() const;
+
+	// The value that `quantile` (0-1) of the recorded values are at or below,
+	// to within the bucket size. 0 if nothing has been recorded.
+	uint64_t quantile(double quantile) const;
+
+private:
+	Histogram(const Histogram&) = delete;
+	Histogram& operator=(const Histogram&) = delete;
+
+	static const int SubBuckets = 8;
+	static const int SubBucketBits = 3;
+	static const int BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+	static int bucketIndex(uint64_t value);
+	// The largest value that goes in a bucket.
+	static uint64_t bucketMax(int index);
+
+	std::atomic<uint64_t> mBuckets[BucketCount];
+	std::atomic<uint64_t> mCount{0};
+	std::atomic<uint64_t> mSum{0};
+	std::atomic<uint64_t> mMax{0};
+};
+
+// A set of named metrics that can be printed as Prometheus text or JSON. They
+// are added while setting up, before anything reads them, and after that the
+// values are read from wherever they are kept, so whatever updates them
+// doesn't need to know about this.
+class Metrics
+{
+public:
+	// Label names and values, e.g. {"input", "0"}.
+	typedef std::vector<std::pair<std::string, std::string>> Labels;
+
+	// A count that only goes up.
+	void addCounter(const std::string& name, const std::string& help, const Labels& labels, const std::atomic<uint64_t>& counter);
+	// A value that goes up and down, worked out when it is printed.
+	void addGauge(const std::string& name, const std::string& help, const Labels& labels, std::function<double()> gauge);
+	// Printed as a summary of quantiles, with the recorded values multiplied
+	// by `scale` (e.g. 1e-9 for nanoseconds in seconds).
+	void addHistogram(const std::string& name, const std::string& help, const Labels& labels, const Histogram& histogram, double scale);
+
+	// The Prometheus text exposition format.
+	void writePrometheus(std::ostream& os) const;
+	// {"metrics": [{"name": ..., "labels": {...}, "value": ...}, ...]},
+	// where histograms have "count", "sum", "max" and "quantiles" instead of
+	// "value".
+	void writeJson(std::ostream& os) const;
+
+private:
+	enum Type
+	{
+		Type_Counter,
+		Type_Gauge,
+		Type_Histogram,
+	};
+
+	struct Metric
+	{
+		Type type;
+		std::string name;
+		std::string help;
+		Labels labels;
+		const std::atomic<uint64_t>* counter;
+		std::function<double()> gauge;
+		const Histogram* histogram;
+		double scale;
+	};
+
+	void add(const Metric& metric);
+
+	// Metrics with the same name are kept together, since Prometheus wants
+	// them grouped under one HELP and TYPE.
+	std::vector<Metric> mMetrics;
+};
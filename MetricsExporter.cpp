@@ -0,0 +1,187 @@
+#include "MetricsExporter.h"
+
+#include "Metrics.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// How often the socket thread checks whether it should stop.
+static const int PollMilliseconds = 250;
+
+// How long to wait for a connection to send its request before replying
+// anyway. Something like `socat` doesn't send anything.
+static const int RequestTimeoutMilliseconds = 100;
+
+MetricsExporter::MetricsExporter(const Metrics& metrics) : mMetrics(metrics)
+{
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	stop();
+}
+
+bool MetricsExporter::start(const string& target, int intervalMilliseconds)
+{
+	mInterval = intervalMilliseconds;
+
+	if (target.compare(0, 5, "unix:") != 0)
+	{
+		mPath = target;
+		if (!writeFile())
+		{
+			cerr << "Unable to write metrics to " << mPath << endl;
+			return false;
+		}
+		mThread = thread(&MetricsExporter::writeFiles, this);
+		return true;
+	}
+
+#if defined(_WIN32)
+	cerr << "Unix domain sockets aren't supported on Windows." << endl;
+	return false;
+#else
+	string path = target.substr(5);
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		cerr << "Socket path too long: " << path << endl;
+		return false;
+	}
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	mSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (mSocket < 0)
+	{
+		cerr << "Unable to create socket: " << strerror(errno) << endl;
+		return false;
+	}
+
+	// A socket left over from last time would stop it binding.
+	unlink(path.c_str());
+	if (bind(mSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(mSocket, 8) != 0)
+	{
+		cerr << "Unable to listen on " << path << ": " << strerror(errno) << endl;
+		::close(mSocket);
+		mSocket = -1;
+		return false;
+	}
+
+	mPath = path;
+	mThread = thread(&MetricsExporter::serveSocket, this);
+	return true;
+#endif
+}
+
+void MetricsExporter::stop()
+{
+	if (!mThread.joinable())
+		return;
+
+	mStopping = true;
+	mWakeup.post();
+	mThread.join();
+
+#if !defined(_WIN32)
+	if (mSocket >= 0)
+	{
+		::close(mSocket);
+		unlink(mPath.c_str());
+		mSocket = -1;
+		return;
+	}
+#endif
+	if (!writeFile())
+		cerr << "Unable to write metrics to " << mPath << endl;
+}
+
+void MetricsExporter::serveSocket()
+{
+#if !defined(_WIN32)
+	while (!mStopping)
+	{
+		pollfd listening = {mSocket, POLLIN, 0};
+		if (poll(&listening, 1, PollMilliseconds) <= 0)
+			continue;
+
+		int connection = accept(mSocket, nullptr, nullptr);
+		if (connection >= 0)
+			reply(connection);
+	}
+#endif
+}
+
+void MetricsExporter::reply(int connection)
+{
+#if !defined(_WIN32)
+	timeval timeout = {0, RequestTimeoutMilliseconds * 1000};
+	setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	char request[1024];
+	ssize_t received = recv(connection, request, sizeof(request), 0);
+	bool http = received >= 4 && memcmp(request, "GET ", 4) == 0;
+
+	ostringstream text;
+	if (http)
+		text << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+	mMetrics.writePrometheus(text);
+
+	string response = text.str();
+	size_t sent = 0;
+	while (sent < response.size())
+	{
+		ssize_t n = send(connection, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+	::close(connection);
+#endif
+}
+
+void MetricsExporter::writeFiles()
+{
+	while (!mStopping)
+	{
+		mWakeup.waitFor(chrono::milliseconds(mInterval));
+		if (!mStopping && !writeFile())
+			cerr << "Unable to write metrics to " << mPath << endl;
+	}
+}
+
+bool MetricsExporter::writeFile()
+{
+	string temporary = mPath + ".tmp";
+	{
+		ofstream file(temporary.c_str(), ios::binary | ios::trunc);
+		if (!file)
+			return false;
+		mMetrics.writeJson(file);
+		file.close();
+		if (!file)
+			return false;
+	}
+
+#if defined(_WIN32)
+	// Windows won't rename over an existing file.
+	remove(mPath.c_str());
+#endif
+	return rename(temporary.c_str(), mPath.c_str()) == 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "Semaphore.h"
+
+class Metrics;
+
+// Makes a set of Metrics available to other programs, on a thread of its own
+// so that a slow reader never holds up recording.
+class MetricsExporter
+{
+public:
+	explicit MetricsExporter(const Metrics& metrics);
+	~MetricsExporter();
+
+	// `target` is "unix:<path>" to listen on a Unix domain socket and send
+	// the metrics in the Prometheus text format to every connection (as an
+	// HTTP response if it sends a GET, so `curl --unix-socket` works), or the
+	// name of a JSON file that is rewritten every `intervalMilliseconds`.
+	// Prints an error and returns false on failure.
+	bool start(const std::string& target, int intervalMilliseconds);
+
+	// Stop the thread. A file is written one last time so that it has the
+	// final values.
+	void stop();
+
+private:
+	MetricsExporter(const MetricsExporter&) = delete;
+	MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+	void serveSocket();
+	void writeFiles();
+
+	// Send the metrics to one connection and close it.
+	void reply(int connection);
+	// Write the file under a temporary name and rename it, so that readers
+	// never see half of it.
+	bool writeFile();
+
+	const Metrics& mMetrics;
+	std::string mPath;
+	// The listening socket, or -1 if writing a file.
+	int mSocket = -1;
+	int mInterval = 1000;
+
+	std::thread mThread;
+	Semaphore mWakeup;
+	std::atomic<bool> mStopping{false};
+};
@@ -0,0 +1,607 @@
+// Microbenchmarks of the parts of OpusRec that run for every sample or packet,
+// and of starting and finishing a file. The results can be saved as JSON and
+// compared with a saved baseline, so that a change that makes one of them
+// slower is noticed before it is committed. `OpusRec benchmark` measures the
+// whole pipeline instead.
+
+#include <soundio/soundio.h>
+
+#include <docopt.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "OpusWriter.h"
+#include "RingBuffer.h"
+#include "SampleConvert.h"
+#include "WebmMuxer.h"
+
+using namespace std;
+
+static const char USAGE[] =
+R"(OpusRec microbenchmarks
+
+    Usage:
+      opusrec-microbench [--filter=<text>] [--min-ms=<ms>] [--repetitions=<n>] [--json=<file>] [--baseline=<file>] [--tolerance=<percent>] [--temp-dir=<dir>]
+      opusrec-microbench (-h | --help)
+
+    Options:
+      -h --help              Show this screen.
+      --filter=<text>        Only run the benchmarks whose names contain this.
+      --min-ms=<ms>          Run each benchmark for at least this long each time. Default 100.
+      --repetitions=<n>      Run each benchmark this many times and report the fastest. Default 5.
+      --json=<file>          Write the results to a JSON file, which can be used as a baseline.
+      --baseline=<file>      Compare the results with a JSON file written by --json, and fail if any benchmark is more than --tolerance slower. Benchmarks that aren't in the baseline are just reported, and if it has no results at all nothing is run and the exit code is 77 (skipped).
+      --tolerance=<percent>  How much slower than the baseline a benchmark can be. Default 25.
+      --temp-dir=<dir>       Where to write the files that the container benchmarks need. Default the current directory.
+)";
+
+// Runs something `iterations` times and returns how long that took in
+// nanoseconds, leaving out any setup, or a negative number if it failed.
+typedef function<double(uint64_t iterations)> Body;
+
+struct Microbenchmark
+{
+	string name;
+	// Bytes that each iteration processes, for the throughput, or 0.
+	double bytes;
+	// Most iterations to run each time, or 0 for no limit. This is for
+	// benchmarks with a lot of setup for each iteration.
+	uint64_t maxIterations;
+	Body body;
+};
+
+struct MicrobenchmarkResult
+{
+	string name;
+	// From the fastest repetition, since anything else running on the
+	// machine only ever makes it slower.
+	double nanosecondsPerIteration;
+	uint64_t iterations;
+	double bytes;
+};
+
+// Results are added to this so that the compiler can't leave out the work.
+static atomic<uint64_t> sink{0};
+
+static double nowNanoseconds()
+{
+	return static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Samples that look a bit like audio: a tone plus some noise, different in
+// each channel.
+static vector<int16_t> testSignal(int rate, int channels, int frames)
+{
+	vector<int16_t> samples(static_cast<size_t>(frames) * channels);
+	uint32_t noise = 12345;
+	for (int i = 0; i < frames; ++i)
+	{
+		for (int c = 0; c < channels; ++c)
+		{
+			noise = noise * 1664525 + 1013904223;
+			double tone = sin(2.0 * 3.14159265358979323846 * (220.0 * (c + 1)) * i / rate);
+			double value = 0.3 * tone + 0.05 * (static_cast<int32_t>(noise) / 2147483648.0);
+			samples[static_cast<size_t>(i) * channels + c] = static_cast<int16_t>(lrint(value * 32767.0));
+		}
+	}
+	return samples;
+}
+
+static double ringBufferPushPop(uint64_t iterations)
+{
+	RingBuffer<uint8_t> ring(4096);
+	uint8_t x = 0;
+	uint64_t sum = 0;
+	double start = nowNanoseconds();
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		ring.push(static_cast<uint8_t>(i));
+		ring.pop(x);
+		sum += x;
+	}
+	double elapsed = nowNanoseconds() - start;
+	sink += sum;
+	return elapsed;
+}
+
+static double ringBufferPushPopN(uint64_t iterations, size_t chunk)
+{
+	RingBuffer<uint8_t> ring(64 * 1024);
+	vector<uint8_t> input(chunk, 1);
+	vector<uint8_t> output(chunk);
+	// Keep a little in it so that the chunks wrap around the end.
+	ring.push_n(input.data(), 100);
+	double start = nowNanoseconds();
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		ring.push_n(input.data(), chunk);
+		ring.pop_n(output.data(), chunk);
+	}
+	double elapsed = nowNanoseconds() - start;
+	sink += output[0];
+	return elapsed;
+}
+
+// Pushes `iterations` runs of `chunk` bytes through a ring buffer from
+// another thread and pops them on this one. Single bytes use push() and
+// pop(), anything bigger push_n() and pop_n().
+static double ringBufferCrossThread(uint64_t iterations, size_t chunk)
+{
+	RingBuffer<uint8_t> ring(64 * 1024);
+	vector<uint8_t> input(chunk, 1);
+	vector<uint8_t> output(chunk);
+	const uint64_t total = iterations * chunk;
+
+	double start = nowNanoseconds();
+	thread producer([&] {
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			size_t done = 0;
+			while (done < chunk)
+			{
+				size_t n = chunk == 1 ? (ring.push(input[0]) ? 1 : 0) : ring.push_n(input.data() + done, chunk - done);
+				if (n == 0)
+					this_thread::yield();
+				done += n;
+			}
+		}
+	});
+
+	uint64_t received = 0;
+	uint64_t sum = 0;
+	while (received < total)
+	{
+		size_t wanted = static_cast<size_t>(min<uint64_t>(chunk, total - received));
+		size_t n = chunk == 1 ? (ring.pop(output[0]) ? 1 : 0) : ring.pop_n(output.data(), wanted);
+		if (n == 0)
+			this_thread::yield();
+		received += n;
+		sum += output[0];
+	}
+	producer.join();
+	double elapsed = nowNanoseconds() - start;
+
+	sink += sum;
+	return elapsed;
+}
+
+// Samples converted at a time, which is about what the capture callback
+// gets each time.
+static const size_t ConvertSamplesCount = 4096;
+
+// Converts random full-scale samples in `format`, like the capture callback
+// does.
+template <typename T>
+static double convertSamples(SoundIoFormat format, uint64_t iterations)
+{
+	vector<int32_t> input(ConvertSamplesCount);
+	uint32_t noise = 1;
+	for (size_t i = 0; i < input.size(); ++i)
+	{
+		noise = noise * 1664525 + 1013904223;
+		int32_t value = static_cast<int32_t>(noise);
+		if (format == SoundIoFormatS24NE)
+		{
+			// libsoundio gives 24 bit samples in the low bytes of 32.
+			input[i] = value >> 8;
+		}
+		else if (format == SoundIoFormatFloat32NE)
+		{
+			float f = value / 2147483648.0f;
+			memcpy(&input[i], &f, sizeof(f));
+		}
+		else
+		{
+			input[i] = value;
+		}
+	}
+	vector<T> output(ConvertSamplesCount);
+
+	double start = nowNanoseconds();
+	for (uint64_t i = 0; i < iterations; ++i)
+		ConvertSamples(format, input.data(), output.data(), output.size());
+	double elapsed = nowNanoseconds() - start;
+	sink += static_cast<uint64_t>(output[output.size() / 2] != 0);
+	return elapsed;
+}
+
+// What the capture callback does for a 5.1 device whose channels aren't in
+// Vorbis order.
+static const int AreasChannels = 6;
+static const int AreasFrames = 1024;
+
+static double convertAreas(uint64_t iterations)
+{
+	const int order[AreasChannels] = {0, 2, 1, 4, 5, 3};
+	vector<int32_t> input(AreasFrames * AreasChannels);
+	for (size_t i = 0; i < input.size(); ++i)
+		input[i] = static_cast<int32_t>(i * 2654435761u);
+	SoundIoChannelArea areas[AreasChannels];
+	for (int c = 0; c < AreasChannels; ++c)
+	{
+		areas[c].ptr = reinterpret_cast<char*>(input.data() + c);
+		areas[c].step = AreasChannels * sizeof(int32_t);
+	}
+	vector<float> output(AreasFrames * AreasChannels);
+
+	double start = nowNanoseconds();
+	for (uint64_t i = 0; i < iterations; ++i)
+		ConvertAreas(SoundIoFormatS32NE, areas, order, AreasChannels, 0, AreasFrames, output.data());
+	double elapsed = nowNanoseconds() - start;
+	sink += static_cast<uint64_t>(output[AreasFrames] != 0.0f);
+	return elapsed;
+}
+
+// Makes an OpusWriter that writes its own file, which is everything that
+// happens before the first sample is captured: making the encoder and the
+// OpusHead and setting up the container. Closing it isn't counted.
+static double startup(const string& filename, OpusWriter::Channels channels, Container::Format format, uint64_t iterations)
+{
+	double elapsed = 0.0;
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		double start = nowNanoseconds();
+		unique_ptr<OpusWriter> writer(new OpusWriter(filename,
+		                                             OpusWriter::Rate_48000,
+		                                             channels,
+		                                             OpusWriter::Frame_20ms,
+		                                             32000 * channels,
+		                                             OpusWriter::Complexity_10,
+		                                             OpusWriter::Mapping_Surround,
+		                                             format));
+		elapsed += nowNanoseconds() - start;
+		if (writer->status() != OpusWriter::Status_Ok)
+			return -1.0;
+	}
+	remove(filename.c_str());
+	return elapsed;
+}
+
+// Encodes one frame of 48 kHz stereo per iteration through
+// OpusWriter::write(), with the `record` defaults.
+static double opusWrite(OpusWriter::FrameLength frameLength, uint64_t iterations)
+{
+	uint64_t bytes = 0;
+	OpusWriter writer([&bytes](const uint8_t*, int length) {
+		                  bytes += length;
+		                  return true;
+	                  },
+	                  OpusWriter::Rate_48000,
+	                  OpusWriter::Channels_Stereo,
+	                  frameLength,
+	                  64000,
+	                  OpusWriter::Complexity_10);
+	if (writer.status() != OpusWriter::Status_Ok)
+		return -1.0;
+
+	// A second of audio, which is a whole number of frames at any frame length.
+	vector<int16_t> signal = testSignal(48000, 2, 48000);
+	const size_t frameSamples = writer.samplesPerFrame();
+	const size_t frames = signal.size() / frameSamples;
+
+	double start = nowNanoseconds();
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		if (!writer.write(signal.data() + (i % frames) * frameSamples, static_cast<int>(frameSamples)))
+			return -1.0;
+	}
+	double elapsed = nowNanoseconds() - start;
+	sink += bytes;
+	return elapsed;
+}
+
+// Writes `minutes` of 20 ms packets at 64 kb/s to a WebM file, and times
+// closing it, which is mostly mkvmuxer's Segment::Finalize() writing the cues
+// and going back to fill in the sizes and duration.
+static double finalize(const string& filename, int minutes, uint64_t iterations)
+{
+	const vector<uint8_t> packet(160, 0x55);
+	const int packets = minutes * 60 * 50;
+	double elapsed = 0.0;
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		WebmMuxer muxer;
+		if (!muxer.open(filename))
+			return -1.0;
+		OpusWriter writer(muxer,
+		                  OpusWriter::Rate_48000,
+		                  OpusWriter::Channels_Stereo,
+		                  OpusWriter::Frame_20ms,
+		                  64000,
+		                  OpusWriter::Complexity_10);
+		if (writer.status() != OpusWriter::Status_Ok)
+			return -1.0;
+		for (int p = 0; p < packets; ++p)
+		{
+			if (!writer.writePacket(packet.data(), static_cast<int>(packet.size())))
+				return -1.0;
+		}
+
+		double start = nowNanoseconds();
+		bool closed = muxer.close();
+		elapsed += nowNanoseconds() - start;
+		if (!closed)
+			return -1.0;
+	}
+	remove(filename.c_str());
+	return elapsed;
+}
+
+static vector<Microbenchmark> microbenchmarks(const string& tempDir)
+{
+	using namespace std::placeholders;
+
+	const string webm = tempDir + "/opusrec-microbench.webm";
+	const string ogg = tempDir + "/opusrec-microbench.ogg";
+	const double convertBytes16 = ConvertSamplesCount * sizeof(int16_t);
+	const double convertBytesFloat = ConvertSamplesCount * sizeof(float);
+
+	// Writing an hour of packets takes a while, so the finalize benchmarks
+	// are only run a few times each.
+	return vector<Microbenchmark>{
+	    {"ring_buffer/push_pop", 1.0, 0, ringBufferPushPop},
+	    {"ring_buffer/push_n_pop_n_4k", 4096.0, 0, bind(ringBufferPushPopN, _1, 4096)},
+	    {"ring_buffer/cross_thread_push_pop", 1.0, 0, bind(ringBufferCrossThread, _1, 1)},
+	    {"ring_buffer/cross_thread_4k", 4096.0, 0, bind(ringBufferCrossThread, _1, 4096)},
+
+	    {"convert/s16_to_s16", convertBytes16, 0, bind(convertSamples<int16_t>, SoundIoFormatS16NE, _1)},
+	    {"convert/s24_to_float", convertBytesFloat, 0, bind(convertSamples<float>, SoundIoFormatS24NE, _1)},
+	    {"convert/s32_to_s16", convertBytes16, 0, bind(convertSamples<int16_t>, SoundIoFormatS32NE, _1)},
+	    {"convert/s32_to_float", convertBytesFloat, 0, bind(convertSamples<float>, SoundIoFormatS32NE, _1)},
+	    {"convert/f32_to_s16", convertBytes16, 0, bind(convertSamples<int16_t>, SoundIoFormatFloat32NE, _1)},
+	    {"convert/f32_to_float", convertBytesFloat, 0, bind(convertSamples<float>, SoundIoFormatFloat32NE, _1)},
+	    {"convert/areas_s32_to_float_6ch_reordered", AreasFrames * AreasChannels * sizeof(float), 0, convertAreas},
+
+	    {"startup/webm_stereo", 0.0, 0, bind(startup, webm, OpusWriter::Channels_Stereo, Container::Format_WebM, _1)},
+	    {"startup/webm_5.1", 0.0, 0, bind(startup, webm, OpusWriter::Channels_5point1, Container::Format_WebM, _1)},
+	    {"startup/ogg_stereo", 0.0, 0, bind(startup, ogg, OpusWriter::Channels_Stereo, Container::Format_Ogg, _1)},
+
+	    {"opus_writer/write_2.5ms", 0.0, 0, bind(opusWrite, OpusWriter::Frame_2point5ms, _1)},
+	    {"opus_writer/write_5ms", 0.0, 0, bind(opusWrite, OpusWriter::Frame_5ms, _1)},
+	    {"opus_writer/write_10ms", 0.0, 0, bind(opusWrite, OpusWriter::Frame_10ms, _1)},
+	    {"opus_writer/write_20ms", 0.0, 0, bind(opusWrite, OpusWriter::Frame_20ms, _1)},
+	    {"opus_writer/write_40ms", 0.0, 0, bind(opusWrite, OpusWriter::Frame_40ms, _1)},
+	    {"opus_writer/write_60ms", 0.0, 0, bind(opusWrite, OpusWriter::Frame_60ms, _1)},
+
+	    {"webm/finalize_1min", 0.0, 3, bind(finalize, webm, 1, _1)},
+	    {"webm/finalize_10min", 0.0, 3, bind(finalize, webm, 10, _1)},
+	    {"webm/finalize_60min", 0.0, 3, bind(finalize, webm, 60, _1)},
+	};
+}
+
+// Run `benchmark` enough times to take at least `minNanoseconds`, and then
+// that many times again for each repetition. Returns false if it failed.
+static bool measure(const Microbenchmark& benchmark, double minNanoseconds, int repetitions, MicrobenchmarkResult& result)
+{
+	uint64_t limit = benchmark.maxIterations > 0 ? benchmark.maxIterations : ~0ULL;
+	uint64_t iterations = 1;
+	double elapsed = benchmark.body(iterations);
+	while (elapsed >= 0.0 && elapsed < minNanoseconds && iterations < limit)
+	{
+		// Aim a little over, growing by at least 2 and at most 100 times.
+		double estimate = elapsed > 0.0 ? 1.2 * minNanoseconds / elapsed * iterations : 100.0 * iterations;
+		estimate = min(max(estimate, 2.0 * iterations), 100.0 * iterations);
+		iterations = min(static_cast<uint64_t>(estimate), limit);
+		elapsed = benchmark.body(iterations);
+	}
+	if (elapsed < 0.0)
+		return false;
+
+	vector<double> times(1, elapsed / iterations);
+	for (int i = 1; i < repetitions; ++i)
+	{
+		elapsed = benchmark.body(iterations);
+		if (elapsed < 0.0)
+			return false;
+		times.push_back(elapsed / iterations);
+	}
+
+	result.name = benchmark.name;
+	result.nanosecondsPerIteration = *min_element(times.begin(), times.end());
+	result.iterations = iterations;
+	result.bytes = benchmark.bytes;
+	return true;
+}
+
+static string formatTime(double nanoseconds)
+{
+	ostringstream text;
+	text << fixed << setprecision(nanoseconds < 10.0 ? 2 : 1);
+	if (nanoseconds < 1e3)
+		text << nanoseconds << " ns";
+	else if (nanoseconds < 1e6)
+		text << nanoseconds / 1e3 << " us";
+	else if (nanoseconds < 1e9)
+		text << nanoseconds / 1e6 << " ms";
+	else
+		text << nanoseconds / 1e9 << " s";
+	return text.str();
+}
+
+static bool writeJson(const string& filename, const vector<MicrobenchmarkResult>& results)
+{
+	ofstream file(filename.c_str(), ios::trunc);
+	if (!file)
+		return false;
+
+	file << setprecision(6);
+	file << "{\"convert_isa\": \"" << ConvertIsa() << "\", \"benchmarks\": [";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const MicrobenchmarkResult& result = results[i];
+		file << (i == 0 ? "\n" : ",\n") << "  {\"name\": \"" << result.name << "\", \"ns_per_op\": " << result.nanosecondsPerIteration
+		     << ", \"iterations\": " << result.iterations;
+		if (result.bytes > 0.0)
+			file << ", \"bytes_per_second\": " << result.bytes * 1e9 / result.nanosecondsPerIteration;
+		file << '}';
+	}
+	file << "\n]}\n";
+	file.close();
+	return static_cast<bool>(file);
+}
+
+// Read the times from a file written by writeJson(). This isn't a general
+// JSON parser; it just finds each name and the ns_per_op after it.
+static bool readBaseline(const string& filename, map<string, double>& baseline)
+{
+	ifstream file(filename.c_str());
+	if (!file)
+		return false;
+	stringstream buffer;
+	buffer << file.rdbuf();
+	const string text = buffer.str();
+
+	static const string NameKey = "\"name\": \"";
+	static const string TimeKey = "\"ns_per_op\": ";
+	size_t position = 0;
+	for (;;)
+	{
+		size_t name = text.find(NameKey, position);
+		if (name == string::npos)
+			break;
+		name += NameKey.size();
+		size_t nameEnd = text.find('"', name);
+		size_t time = text.find(TimeKey, nameEnd);
+		if (nameEnd == string::npos || time == string::npos)
+			return false;
+		time += TimeKey.size();
+		baseline[text.substr(name, nameEnd - name)] = strtod(text.c_str() + time, nullptr);
+		position = time;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	std::map<std::string, docopt::value> args = docopt::docopt(USAGE, {argv + 1, argv + argc}, true);
+
+	auto stringOpt = [&](string key, string def) -> string {
+		if (args.count(key) != 1 || !args[key].isString())
+			return def;
+		return args[key].asString();
+	};
+	auto doubleOpt = [&](string key, double def) -> double {
+		string val = stringOpt(key, "");
+		if (val.empty())
+			return def;
+		try
+		{
+			size_t processed = 0;
+			double x = std::stod(val, &processed);
+			if (processed != val.size())
+				return def;
+			return x;
+		}
+		catch (std::exception& e)
+		{
+		}
+		return def;
+	};
+
+	const string filter = stringOpt("--filter", "");
+	const double minNanoseconds = doubleOpt("--min-ms", 100.0) * 1e6;
+	const int repetitions = max(1, static_cast<int>(doubleOpt("--repetitions", 5)));
+	const double tolerance = doubleOpt("--tolerance", 25.0) / 100.0;
+	const string baselineFile = stringOpt("--baseline", "");
+	const string jsonFile = stringOpt("--json", "");
+
+	map<string, double> baseline;
+	if (!baselineFile.empty() && !readBaseline(baselineFile, baseline))
+	{
+		cerr << "Unable to read the baseline from " << baselineFile << endl;
+		return 1;
+	}
+	if (!baselineFile.empty() && baseline.empty())
+	{
+		// Passing would say nothing had got slower when nothing was compared.
+		cerr << "SKIPPED: " << baselineFile << " has no results to compare with. Record them on this machine with "
+		     << "`ninja microbench-baseline` and copy the file it writes in the build directory over it." << endl;
+		// Meson counts this as skipped.
+		return 77;
+	}
+
+	cout << "Sample conversion is using " << ConvertIsa() << "." << endl;
+	cout << left << setw(44) << "benchmark" << right << setw(12) << "time" << setw(14) << "throughput";
+	if (!baseline.empty())
+		cout << setw(12) << "baseline";
+	cout << endl;
+
+	vector<MicrobenchmarkResult> results;
+	vector<string> slower;
+	bool failed = false;
+	for (const Microbenchmark& benchmark : microbenchmarks(stringOpt("--temp-dir", ".")))
+	{
+		if (benchmark.name.find(filter) == string::npos)
+			continue;
+
+		MicrobenchmarkResult result;
+		if (!measure(benchmark, minNanoseconds, repetitions, result))
+		{
+			cerr << benchmark.name << " failed." << endl;
+			failed = true;
+			continue;
+		}
+		results.push_back(result);
+
+		cout << left << setw(44) << result.name << right << setw(12) << formatTime(result.nanosecondsPerIteration);
+		ostringstream throughput;
+		if (result.bytes > 0.0)
+			throughput << fixed << setprecision(1) << result.bytes * 1e3 / result.nanosecondsPerIteration << " MB/s";
+		cout << setw(14) << throughput.str();
+
+		map<string, double>::const_iterator reference = baseline.find(result.name);
+		if (reference != baseline.end() && reference->second > 0.0)
+		{
+			double change = result.nanosecondsPerIteration / reference->second - 1.0;
+			ostringstream text;
+			text << fixed << setprecision(1) << showpos << change * 100.0 << "%";
+			cout << setw(12) << text.str();
+			if (change > tolerance)
+			{
+				cout << "  SLOWER";
+				slower.push_back(result.name);
+			}
+		}
+		else if (!baseline.empty())
+		{
+			cout << setw(12) << "new";
+		}
+		cout << endl;
+	}
+
+	if (!jsonFile.empty())
+	{
+		if (writeJson(jsonFile, results))
+			cout << "Wrote " << jsonFile << endl;
+		else
+		{
+			cerr << "Unable to write " << jsonFile << endl;
+			failed = true;
+		}
+	}
+
+	if (!slower.empty())
+	{
+		cerr << slower.size() << " benchmark(s) more than " << tolerance * 100.0 << "% slower than the baseline:" << endl;
+		for (const string& name : slower)
+			cerr << "  " << name << endl;
+	}
+	return failed || !slower.empty() ? 1 : 0;
+}
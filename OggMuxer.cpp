@@ -0,0 +1,344 @@
+#include "OggMuxer.h"
+
+#include "Trace.h"
+
+#include <opus.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+
+using namespace std;
+
+// Ogg page header type flags. See https://tools.ietf.org/html/rfc3533 Section 6
+static const uint8_t FlagContinued = 0x01;
+static const uint8_t FlagFirstPage = 0x02;
+static const uint8_t FlagLastPage = 0x04;
+
+static const size_t HeaderSize = 27;
+static const size_t MaxSegments = 255;
+
+// Pages are finished when they have this much data, or a second of audio
+// (RFC 7845 recommends no more than that, for seeking).
+static const size_t PageBytes = 8192;
+static const uint64_t FilePageDuration = 1000000000;
+
+// Granule positions always count 48 kHz samples, whatever the input rate.
+static const int GranuleRate = 48000;
+
+// The CRC-32 used by Ogg: polynomial 0x04c11db7, MSB first, starting from 0
+// with no final xor.
+struct CrcTable
+{
+	uint32_t entries[256];
+
+	CrcTable()
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t crc = i << 24;
+			for (int bit = 0; bit < 8; ++bit)
+				crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+			entries[i] = crc;
+		}
+	}
+};
+
+static uint32_t updateCrc(uint32_t crc, const uint8_t* data, size_t length)
+{
+	static const CrcTable table;
+	for (size_t i = 0; i < length; ++i)
+		crc = (crc << 8) ^ table.entries[((crc >> 24) ^ data[i]) & 0xFF];
+	return crc;
+}
+
+static void writeLE32(uint8_t* p, uint32_t x)
+{
+	p[0] = x & 0xFF;
+	p[1] = (x >> 8) & 0xFF;
+	p[2] = (x >> 16) & 0xFF;
+	p[3] = (x >> 24) & 0xFF;
+}
+
+static void appendLE32(vector<uint8_t>& v, uint32_t x)
+{
+	uint8_t bytes[4];
+	writeLE32(bytes, x);
+	v.insert(v.end(), bytes, bytes + 4);
+}
+
+static void appendString(vector<uint8_t>& v, const string& s)
+{
+	appendLE32(v, static_cast<uint32_t>(s.size()));
+	v.insert(v.end(), s.begin(), s.end());
+}
+
+// See https://tools.ietf.org/html/rfc7845 Section 5.2
+static vector<uint8_t> OpusTags()
+{
+	vector<uint8_t> tags = {'O', 'p', 'u', 's', 'T', 'a', 'g', 's'};
+	appendString(tags, opus_get_version_string());
+	appendLE32(tags, 1);
+	appendString(tags, "ENCODER=OpusRec");
+	return tags;
+}
+
+// The number of Opus streams in each packet, from the OpusHead.
+static int streamCount(const vector<uint8_t>& opusHead)
+{
+	if (opusHead.size() > 19 && opusHead[18] != 0)
+		return max<int>(opusHead[19], 1);
+	return 1;
+}
+
+OggMuxer::OggMuxer()
+{
+}
+
+OggMuxer::~OggMuxer()
+{
+	close();
+}
+
+bool OggMuxer::open(const string& filename)
+{
+	if (!mWriter.open(filename))
+		return false;
+
+	mLive = false;
+	mPageDuration = FilePageDuration;
+	mNextCheckpoint = 0;
+	mOpen = true;
+	return true;
+}
+
+bool OggMuxer::openLive(const string& output, int flushMilliseconds)
+{
+	if (!mWriter.open(output))
+		return false;
+
+	mLive = true;
+	mPageDuration = static_cast<uint64_t>(flushMilliseconds) * 1000000;
+	mNextCheckpoint = 0;
+	mOpen = true;
+	return true;
+}
+
+uint64_t OggMuxer::addOpusTrack(int samplingRate, int channels, const vector<uint8_t>& opusHead, int maxPacketLength)
+{
+	if (!mOpen || mHeadersWritten)
+		return 0;
+
+	// Serial numbers should be random so that streams can be chained, and
+	// must be different within a file.
+	mt19937 random(static_cast<uint32_t>(chrono::steady_clock::now().time_since_epoch().count()) ^ random_device()());
+
+	Stream stream;
+	do
+	{
+		stream.serial = random();
+	} while (any_of(mStreams.begin(), mStreams.end(), [&](const Stream& s) { return s.serial == stream.serial; }));
+
+	stream.opusHead = opusHead;
+	stream.gapPacket.resize(streamCount(opusHead) * 2 - 1);
+
+	// A page can't be bigger than this, so it is never reallocated.
+	stream.lacing.reserve(MaxSegments);
+	stream.body.reserve(MaxSegments * 255);
+
+	mStreams.push_back(move(stream));
+	return mStreams.size();
+}
+
+bool OggMuxer::writeHeaders()
+{
+	mHeadersWritten = true;
+
+	for (Stream& stream : mStreams)
+	{
+		if (!addPacket(stream, stream.opusHead.data(), stream.opusHead.size(), 0) || !writePage(stream, FlagFirstPage))
+			return false;
+	}
+
+	vector<uint8_t> tags = OpusTags();
+	for (Stream& stream : mStreams)
+	{
+		if (!addPacket(stream, tags.data(), tags.size(), 0) || !writePage(stream, 0))
+			return false;
+	}
+	return true;
+}
+
+bool OggMuxer::writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp)
+{
+	TRACE_SCOPE("ogg_write_frame");
+	if (!mOpen || trackNumber == 0 || trackNumber > mStreams.size() || length <= 0)
+		return false;
+
+	if (!mHeadersWritten && !writeHeaders())
+		return false;
+
+	Stream& stream = mStreams[trackNumber - 1];
+
+	int samples = opus_packet_get_nb_samples(data, length, GranuleRate);
+	if (samples <= 0)
+		return false;
+
+	// Go via microseconds so that it doesn't overflow.
+	int64_t start = static_cast<int64_t>(timestamp / 1000 * GranuleRate / 1000000);
+	if (stream.granule < 0)
+	{
+		// The stream starts part way in. RFC 7845 section 4.5 says that the
+		// granule position of the first page can be more than the number of
+		// samples on it to say so.
+		stream.granule = start;
+		stream.pageStart = timestamp;
+	}
+
+	// Fill in any packets that are missing.
+	while (stream.gapSamples > 0 && (start - stream.granule) * 2 >= stream.gapSamples)
+	{
+		stream.granule += stream.gapSamples;
+		if (!addPacket(stream, stream.gapPacket.data(), stream.gapPacket.size(), stream.granule))
+			return false;
+	}
+
+	stream.granule += samples;
+	if (!addPacket(stream, data, length, stream.granule))
+		return false;
+
+	// An empty packet is just a TOC byte with one frame (code 0). In a
+	// multistream packet all but the last stream are self-delimited, so they
+	// have a length byte too.
+	uint8_t toc = data[0] & 0xFC;
+	for (size_t i = 0; i < stream.gapPacket.size(); i += 2)
+	{
+		stream.gapPacket[i] = toc;
+		if (i + 1 < stream.gapPacket.size())
+			stream.gapPacket[i + 1] = 0;
+	}
+	stream.gapSamples = opus_packet_get_nb_samples(&toc, 1, GranuleRate);
+
+	uint64_t end = timestamp + static_cast<uint64_t>(samples) * 1000000000 / GranuleRate;
+	if (stream.body.size() >= PageBytes || end - stream.pageStart >= mPageDuration)
+	{
+		if (!writePage(stream, 0))
+			return false;
+	}
+
+	// Don't start another checkpoint while the disk is still busy with the
+	// last one; it is done on a later frame instead.
+	if (mCheckpointInterval > 0 && timestamp >= mNextCheckpoint && !mWriter.syncPending())
+		return checkpoint(timestamp);
+	return true;
+}
+
+bool OggMuxer::checkpoint(uint64_t timestamp)
+{
+	mNextCheckpoint = timestamp + mCheckpointInterval;
+
+	for (Stream& stream : mStreams)
+	{
+		if (!stream.lacing.empty() && !writePage(stream, 0))
+			return false;
+	}
+
+	mWriter.sync();
+	return true;
+}
+
+bool OggMuxer::addPacket(Stream& stream, const uint8_t* data, size_t length, int64_t granule)
+{
+	// Packets are split into 255 byte segments, and end with a shorter one,
+	// which may be empty.
+	size_t offset = 0;
+	for (;;)
+	{
+		if (stream.lacing.size() == MaxSegments)
+		{
+			if (!writePage(stream, 0))
+				return false;
+			stream.continued = offset > 0;
+		}
+
+		size_t segment = min<size_t>(length - offset, 255);
+		stream.lacing.push_back(static_cast<uint8_t>(segment));
+		stream.body.insert(stream.body.end(), data + offset, data + offset + segment);
+		offset += segment;
+		if (segment < 255)
+			break;
+	}
+	stream.pageGranule = granule;
+	return true;
+}
+
+bool OggMuxer::writePage(Stream& stream, uint8_t flags)
+{
+	uint8_t header[HeaderSize + MaxSegments];
+	memcpy(header, "OggS", 4);
+	header[4] = 0; // Version
+	header[5] = flags | (stream.continued ? FlagContinued : 0);
+
+	uint64_t granule = static_cast<uint64_t>(stream.pageGranule);
+	writeLE32(header + 6, static_cast<uint32_t>(granule));
+	writeLE32(header + 10, static_cast<uint32_t>(granule >> 32));
+	writeLE32(header + 14, stream.serial);
+	writeLE32(header + 18, stream.sequence);
+	writeLE32(header + 22, 0); // CRC
+	header[26] = static_cast<uint8_t>(stream.lacing.size());
+	copy(stream.lacing.begin(), stream.lacing.end(), header + HeaderSize);
+
+	size_t headerLength = HeaderSize + stream.lacing.size();
+	uint32_t crc = updateCrc(0, header, headerLength);
+	crc = updateCrc(crc, stream.body.data(), stream.body.size());
+	writeLE32(header + 22, crc);
+
+	if (mWriter.Write(header, static_cast<mkvmuxer::uint32>(headerLength)) != 0)
+		return false;
+	if (!stream.body.empty() && mWriter.Write(stream.body.data(), static_cast<mkvmuxer::uint32>(stream.body.size())) != 0)
+		return false;
+
+	++stream.sequence;
+	stream.lacing.clear();
+	stream.body.clear();
+	stream.pageGranule = -1;
+	stream.continued = false;
+	stream.pageStart = stream.granule >= 0 ? static_cast<uint64_t>(stream.granule) * 1000000000 / GranuleRate : 0;
+
+	// Don't wait for a buffer to fill up before whoever is listening gets it.
+	if (mLive)
+		mWriter.flush();
+	return true;
+}
+
+void OggMuxer::setCheckpointInterval(int milliseconds)
+{
+	mCheckpointInterval = milliseconds > 0 ? static_cast<uint64_t>(milliseconds) * 1000000 : 0;
+}
+
+uint64_t OggMuxer::bytesWritten() const
+{
+	return mWriter.Position();
+}
+
+bool OggMuxer::close()
+{
+	if (!mOpen)
+		return true;
+
+	bool success = mHeadersWritten || writeHeaders();
+
+	// Finish every stream with a page that says it is the last one. It has
+	// to have a granule position even if there are no packets on it.
+	for (Stream& stream : mStreams)
+	{
+		if (stream.pageGranule < 0)
+			stream.pageGranule = max<int64_t>(stream.granule, 0);
+		success = writePage(stream, FlagLastPage) && success;
+	}
+
+	success = mWriter.close() && success;
+	mOpen = false;
+	return success;
+}
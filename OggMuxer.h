@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "AsyncFileWriter.h"
+#include "Container.h"
+
+// Writes Opus tracks to an Ogg file, as described in RFC 7845. This has a lot
+// less overhead than WebM for small packets: about one byte per packet plus
+// a 27 byte header per page, and nothing is kept in memory for an index.
+//
+// Each track is a logical Ogg stream; several of them are multiplexed page
+// by page. Ogg has no timestamps, only a running count of samples (the
+// granule position), so a gap in the timestamps is filled with empty
+// packets, which decoders treat as lost. The first packet's timestamp
+// becomes the start offset of the stream.
+class OggMuxer : public Container
+{
+public:
+	OggMuxer();
+	virtual ~OggMuxer();
+
+	virtual bool open(const std::string& filename) override;
+	// Ogg can always be played while it is being written. In live mode each
+	// page is passed on as soon as it is finished, and they are finished at
+	// least every `flushMilliseconds`.
+	virtual bool openLive(const std::string& output, int flushMilliseconds) override;
+	virtual uint64_t addOpusTrack(int samplingRate, int channels, const std::vector<uint8_t>& opusHead, int maxPacketLength) override;
+	virtual bool writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp) override;
+	// A checkpoint finishes the current pages. Ogg needs nothing else to be
+	// played after being cut off.
+	virtual void setCheckpointInterval(int milliseconds) override;
+	virtual uint64_t bytesWritten() const override;
+	virtual bool close() override;
+
+private:
+	OggMuxer(const OggMuxer&) = delete;
+	OggMuxer& operator=(const OggMuxer&) = delete;
+
+	struct Stream
+	{
+		uint32_t serial = 0;
+		uint32_t sequence = 0;
+		std::vector<uint8_t> opusHead;
+
+		// Granule position (in 48 kHz samples) at the end of the last packet,
+		// or -1 before the first one.
+		int64_t granule = -1;
+		// The granule position of the last packet that ends on the current
+		// page, or -1 if none do.
+		int64_t pageGranule = -1;
+		// Timestamp of the first packet on the current page.
+		uint64_t pageStart = 0;
+		// True if the current page starts with the end of a packet.
+		bool continued = false;
+
+		// The current page's segment table and data.
+		std::vector<uint8_t> lacing;
+		std::vector<uint8_t> body;
+
+		// An empty packet for filling gaps, with the last packet's mode and
+		// bandwidth, and how many samples it lasts for.
+		std::vector<uint8_t> gapPacket;
+		int gapSamples = 0;
+	};
+
+	// Write the OpusHead and OpusTags pages for all the tracks. Ogg wants the
+	// first page of every stream before anything else, so this is done when
+	// the first frame is written.
+	bool writeHeaders();
+
+	// Add a packet to the stream's current page, writing pages as they fill
+	// up. `granule` is the granule position at its end.
+	bool addPacket(Stream& stream, const uint8_t* data, size_t length, int64_t granule);
+
+	// Write the current page. `flags` are the Ogg header type flags for the
+	// beginning or end of the stream.
+	bool writePage(Stream& stream, uint8_t flags);
+
+	// Finish every stream's page and sync the file.
+	bool checkpoint(uint64_t timestamp);
+
+	AsyncFileWriter mWriter;
+	std::vector<Stream> mStreams;
+	bool mOpen = false;
+	bool mLive = false;
+	bool mHeadersWritten = false;
+	// Pages are finished when they have this much audio, in nanoseconds.
+	uint64_t mPageDuration = 0;
+	// In nanoseconds, or 0 for no checkpoints.
+	uint64_t mCheckpointInterval = 0;
+	uint64_t mNextCheckpoint = 0;
+};
@@ -1,9 +1,25 @@
 #include "OpusWriter.h"
 
+#include "Trace.h"
+
+#include <algorithm>
+#include <stdlib.h>
+
 // See https://tools.ietf.org/html/rfc7845 Section 5.1
 //
 // outputGain is Q7.8 in dB, recommended to be 0.
-static std::vector<uint8_t> OpusHeader(uint8_t channelCount, uint16_t preSkipSamples, uint32_t inputSampleRate, uint16_t outputGain)
+//
+// For mapping family 0 the stream counts and mapping are implied and aren't
+// written. Otherwise `mapping` has an entry for each channel giving the
+// decoded stream channel it comes from.
+static std::vector<uint8_t> OpusHeader(uint8_t channelCount,
+                                       uint16_t preSkipSamples,
+                                       uint32_t inputSampleRate,
+                                       uint16_t outputGain,
+                                       uint8_t mappingFamily,
+                                       uint8_t streamCount,
+                                       uint8_t coupledCount,
+                                       const std::vector<uint8_t>& mapping)
 {
 	std::vector<uint8_t> head(19);
 
@@ -25,7 +41,15 @@ static std::vector<uint8_t> OpusHeader(uint8_t channelCount, uint16_t preSkipSam
 	head[15] = (inputSampleRate >> 24) & 0xFF;
 	head[16] = (outputGain >> 0) & 0xFF;
 	head[17] = (outputGain >> 8) & 0xFF;
-	head[18] = 0; // Mapping family - none.
+	head[18] = mappingFamily;
+
+	if (mappingFamily != 0)
+	{
+		// Channel mapping table.
+		head.push_back(streamCount);
+		head.push_back(coupledCount);
+		head.insert(head.end(), mapping.begin(), mapping.end());
+	}
 
 	return head;
 }
@@ -33,8 +57,7 @@ static std::vector<uint8_t> OpusHeader(uint8_t channelCount, uint16_t preSkipSam
 OpusWriter::~OpusWriter()
 {
 	close();
-	if (mEncoder != nullptr)
-		opus_encoder_destroy(mEncoder);
+	free(mEncoderMemory);
 }
 
 OpusWriter::OpusWriter(std::string filename,
@@ -42,7 +65,92 @@ OpusWriter::OpusWriter(std::string filename,
                        OpusWriter::Channels channels,
                        OpusWriter::FrameLength frameLength,
                        int bitrate,
-                       OpusWriter::ComputationalComplexity complexity)
+                       OpusWriter::ComputationalComplexity complexity,
+                       OpusWriter::ChannelMapping mapping,
+                       Container::Format format)
+    : mOwnedMuxer(Container::create(format, filename))
+{
+	if (!initEncoder(samplingRate, channels, frameLength, bitrate, complexity, mapping))
+		return;
+
+	// Now initialise the container.
+	if (!mOwnedMuxer->open(filename))
+	{
+		mStatus = Status_OutputFileError;
+		return;
+	}
+
+	initTrack(*mOwnedMuxer, samplingRate, channels);
+}
+
+OpusWriter::OpusWriter(Container& muxer,
+                       OpusWriter::SamplingRate samplingRate,
+                       OpusWriter::Channels channels,
+                       OpusWriter::FrameLength frameLength,
+                       int bitrate,
+                       OpusWriter::ComputationalComplexity complexity,
+                       OpusWriter::ChannelMapping mapping)
+{
+	if (!initEncoder(samplingRate, channels, frameLength, bitrate, complexity, mapping))
+		return;
+
+	initTrack(muxer, samplingRate, channels);
+}
+
+OpusWriter::OpusWriter(PacketCallback callback,
+                       OpusWriter::SamplingRate samplingRate,
+                       OpusWriter::Channels channels,
+                       OpusWriter::FrameLength frameLength,
+                       int bitrate,
+                       OpusWriter::ComputationalComplexity complexity,
+                       OpusWriter::ChannelMapping mapping)
+    : mCallback(callback)
+{
+	if (!initEncoder(samplingRate, channels, frameLength, bitrate, complexity, mapping))
+		return;
+
+	mStatus = Status_Ok;
+}
+
+bool OpusWriter::reopen(std::string filename,
+                        OpusWriter::SamplingRate samplingRate,
+                        OpusWriter::Channels channels,
+                        OpusWriter::FrameLength frameLength,
+                        int bitrate,
+                        OpusWriter::ComputationalComplexity complexity,
+                        OpusWriter::ChannelMapping mapping,
+                        Container::Format format)
+{
+	if (!mOwnedMuxer)
+		return false;
+
+	close();
+	mBufferFill = 0;
+	mFloatBufferFill = 0;
+	mTimeCode = 0;
+	mStatus = Status_Error;
+
+	if (!initEncoder(samplingRate, channels, frameLength, bitrate, complexity, mapping))
+		return false;
+
+	// An mkvmuxer::Segment can't be started again, so this part is new.
+	mOwnedMuxer.reset(Container::create(format, filename));
+	if (!mOwnedMuxer->open(filename))
+	{
+		mStatus = Status_OutputFileError;
+		return false;
+	}
+
+	initTrack(*mOwnedMuxer, samplingRate, channels);
+	return mStatus == Status_Ok;
+}
+
+bool OpusWriter::initEncoder(OpusWriter::SamplingRate samplingRate,
+                             OpusWriter::Channels channels,
+                             OpusWriter::FrameLength frameLength,
+                             int bitrate,
+                             OpusWriter::ComputationalComplexity complexity,
+                             OpusWriter::ChannelMapping mapping)
 {
 	// samplingRate must be one of 8000, 12000, 16000, 24000, or 48000.
 	if (samplingRate != Rate_8000 &&
@@ -52,13 +160,13 @@ OpusWriter::OpusWriter(std::string filename,
 	    samplingRate != Rate_48000)
 	{
 		mStatus = Status_OpusInvalidSamplingRate;
-		return;
+		return false;
 	}
 	
-	if (channels != 1 && channels != 2)
+	if (channels < 1 || channels > Channels_Max || (mapping == Mapping_Surround && channels > 8))
 	{
 		mStatus = Status_OpusInvalidChannelCount;
-		return;
+		return false;
 	}
 	
 	if (frameLength != Frame_2point5ms &&
@@ -72,9 +180,10 @@ OpusWriter::OpusWriter(std::string filename,
 	    frameLength != Frame_120ms)
 	{
 		mStatus = Status_OpusInvalidFrameLength;
-		return;
+		return false;
 	}
 
+	mSamplingRate = samplingRate;
 	mChannels = channels;
 	// This always works out to an integer:
 	//
@@ -87,164 +196,298 @@ OpusWriter::OpusWriter(std::string filename,
 	// 40000                                    320     480     640     960    1920
 	// 60000                                    480     720     960    1440    2880
 	//
-	mSamplesPerFramePerChannel = frameLength * samplingRate / 1000000;
+	// 60 ms at 48 kHz overflows an int before the division.
+	mSamplesPerFramePerChannel = static_cast<int>(static_cast<int64_t>(frameLength) * samplingRate / 1000000);
 	mFrameLength = frameLength;
 	
-	// Opus initialisation.
+	// Mono and stereo are a single stream, which is the normal Opus mapping
+	// family 0. More channels are a surround layout (family 1) or independent
+	// mono streams (family 255). Either way the multistream encoder works out
+	// the streams; for family 0 it is the same as a plain encoder.
+	if (channels <= 2)
+		mMappingFamily = 0;
+	else if (mapping == Mapping_Surround)
+		mMappingFamily = 1;
+	else
+		mMappingFamily = 255;
+	
+	// Opus initialisation. If the encoder is being reused with the same
+	// layout it only needs resetting; otherwise it is initialised in the
+	// memory from last time if that is big enough.
 	int error = OPUS_INTERNAL_ERROR;
-	mEncoder = opus_encoder_create(samplingRate, channels, OPUS_APPLICATION_AUDIO, &error);
+	if (mEncoder != nullptr && samplingRate == mEncoderRate && channels == mEncoderChannels && mMappingFamily == mEncoderFamily)
+	{
+		error = opus_multistream_encoder_ctl(mEncoder, OPUS_RESET_STATE);
+	}
+	else
+	{
+		mEncoder = nullptr;
+		opus_int32 size = opus_multistream_surround_encoder_get_size(channels, mMappingFamily);
+		if (size > 0 && static_cast<size_t>(size) > mEncoderSize)
+		{
+			free(mEncoderMemory);
+			mEncoderMemory = malloc(size);
+			mEncoderSize = mEncoderMemory != nullptr ? size : 0;
+		}
+		if (size > 0 && mEncoderMemory != nullptr)
+		{
+			mMapping.resize(channels);
+			error = opus_multistream_surround_encoder_init(static_cast<OpusMSEncoder*>(mEncoderMemory),
+			                                               samplingRate,
+			                                               channels,
+			                                               mMappingFamily,
+			                                               &mStreams,
+			                                               &mCoupledStreams,
+			                                               mMapping.data(),
+			                                               OPUS_APPLICATION_AUDIO);
+		}
+		if (error == OPUS_OK)
+		{
+			mEncoder = static_cast<OpusMSEncoder*>(mEncoderMemory);
+			mEncoderRate = samplingRate;
+			mEncoderChannels = channels;
+			mEncoderFamily = mMappingFamily;
+		}
+	}
 	
 	if (error != OPUS_OK || mEncoder == nullptr)
 	{
+		mEncoder = nullptr;
 		mStatus = Status_OpusInitialisationFailed;
-		return;
+		return false;
 	}
+	
+	// Everything that `write()` needs is allocated up front so that it doesn't
+	// allocate while recording.
+	mPacket.resize(maxPacketLength());
+	mBuffer.resize(samplesPerFrame());
+	mFloatBuffer.resize(samplesPerFrame());
 
 	// Set bitrate.
-	error = opus_encoder_ctl(mEncoder, OPUS_SET_BITRATE(bitrate));
+	error = opus_multistream_encoder_ctl(mEncoder, OPUS_SET_BITRATE(bitrate));
 	if (error != OPUS_OK)
 	{
 		mStatus = Status_OpusInitialisationFailed;
-		return;
+		return false;
 	}
 	
 	// Set the computational complexity.
-	error = opus_encoder_ctl(mEncoder, OPUS_SET_COMPLEXITY(complexity));
+	error = opus_multistream_encoder_ctl(mEncoder, OPUS_SET_COMPLEXITY(complexity));
 	if (error != OPUS_OK)
 	{
 		mStatus = Status_OpusInitialisationFailed;
-		return;
+		return false;
 	}
 	
 	// Set it to automatically switch between voice and music modes.
-	error = opus_encoder_ctl(mEncoder, OPUS_SET_SIGNAL(OPUS_AUTO));
+	error = opus_multistream_encoder_ctl(mEncoder, OPUS_SET_SIGNAL(OPUS_AUTO));
 	if (error != OPUS_OK)
 	{
 		mStatus = Status_OpusInitialisationFailed;
-		return;
+		return false;
 	}
 	
-	// Now initialise WebM.
-	if (!mMuxer.Open(filename.c_str()))
-	{
-		mStatus = Status_OutputFileError;
-		return;
-	}
+	return true;
+}
 
-	// WebM files have one segment.
-	if (!mMuxerSegment.Init(&mMuxer))
-	{
-		mStatus = Status_MuxerSegmentInitialisationFailed;
-		return;
-	}
-	
-	mkvmuxer::SegmentInfo* info = mMuxerSegment.GetSegmentInfo();
-	if (info == nullptr)
-	{
-		mStatus = Status_MuxerSegmentInitialisationFailed;
-		return;
-	}
-	
-	info->set_writing_app("OpusRec");
-	
-	// Add an audio track.
-	mTrackNumber = mMuxerSegment.AddAudioTrack(samplingRate, channels, 0); // 0 allows the muxer to device on track number.
+void OpusWriter::initTrack(Container& muxer, OpusWriter::SamplingRate samplingRate, OpusWriter::Channels channels)
+{
+	// Decoders drop the encoder's lookahead from the start, counted in 48 kHz
+	// samples. Ogg depends on this; WebM also has its own codec delay.
+	opus_int32 lookahead = 0;
+	opus_multistream_encoder_ctl(mEncoder, OPUS_GET_LOOKAHEAD(&lookahead));
+	uint16_t preSkip = static_cast<uint16_t>(lookahead * 48000 / samplingRate);
+
+	std::vector<uint8_t> opushead = OpusHeader(channels, preSkip, samplingRate, 0, mMappingFamily, mStreams, mCoupledStreams, mMapping);
+	mTrackNumber = muxer.addOpusTrack(samplingRate, channels, opushead, maxPacketLength());
 	if (mTrackNumber == 0)
 	{
 		mStatus = Status_MuxerError;
 		return;
 	}
 	
-	mkvmuxer::AudioTrack* audio = static_cast<mkvmuxer::AudioTrack*>(mMuxerSegment.GetTrackByNumber(mTrackNumber));
-	if (audio == nullptr)
-	{
-		mStatus = Status_MuxerError;
-		return;
-	}
+	mMuxer = &muxer;
+	mStatus = Status_Ok;
+}
 
-	audio->set_codec_id(mkvmuxer::Tracks::kOpusCodecId);
-	audio->set_bit_depth(16);
+OpusWriter::Status OpusWriter::status() const
+{
+	return mStatus;
+}
 
-	// Delay built into the code during decoding in nanoseconds.
-	audio->set_codec_delay(6500000); // TODO: How do I know this?
+bool OpusWriter::write(const int16_t *samples, int sampleCount)
+{
+	return writeSamples(mBuffer, mBufferFill, samples, sampleCount);
+}
 
-	// Amount of audio to discard after a seek, or something like that.
-	audio->set_seek_pre_roll(80000000); // TODO: How do I know this?
+bool OpusWriter::write(const float* samples, int sampleCount)
+{
+	return writeSamples(mFloatBuffer, mFloatBufferFill, samples, sampleCount);
+}
 
-	std::vector<uint8_t> opushead = OpusHeader(channels, 0, samplingRate, 0);
-	if (!audio->SetCodecPrivate(opushead.data(), opushead.size()))
+template <typename T>
+bool OpusWriter::writeSamples(std::vector<T>& buffer, size_t& fill, const T* samples, int sampleCount)
+{
+	if (mEncoder == nullptr)
+		return false;
+	
+	const size_t frameSamples = buffer.size();
+	size_t remaining = sampleCount;
+	
+	// We can only encode an entire frame. If there's a partial frame left
+	// over from last time, complete it first.
+	if (fill > 0)
 	{
-		mStatus = Status_MuxerError;
-		return;
+		size_t count = std::min(frameSamples - fill, remaining);
+		std::copy(samples, samples + count, buffer.data() + fill);
+		samples += count;
+		remaining -= count;
+		fill += count;
+		
+		if (fill < frameSamples)
+			return true;
+		fill = 0;
+		
+		if (!encodeAndWrite(buffer.data()))
+			return false;
 	}
 	
-	mFinalize = true;
-	mStatus = Status_Ok;
+	// Then encode whole frames straight from the caller's samples.
+	while (remaining >= frameSamples)
+	{
+		if (!encodeAndWrite(samples))
+			return false;
+		samples += frameSamples;
+		remaining -= frameSamples;
+	}
+	
+	// And keep the rest for next time.
+	std::copy(samples, samples + remaining, buffer.data());
+	fill = remaining;
+	return true;
 }
 
-OpusWriter::Status OpusWriter::status() const
+template <typename T>
+bool OpusWriter::encodeAndWrite(const T* frame)
 {
-	return mStatus;
+	int len = encode(frame, mPacket.data(), mPacket.size());
+	if (len < 0)
+		return false;
+	return writePacket(mPacket.data(), len);
 }
 
-bool OpusWriter::write(const int16_t *samples, int sampleCount)
+int OpusWriter::encode(const int16_t* frame, uint8_t* packet, int maxPacketLength)
 {
 	if (mEncoder == nullptr)
-		return false;
+		return -1;
 	
-	// We can only encode an entire frame, so store it in an internal buffer.
-	mBuffer.insert(mBuffer.end(), samples, samples + sampleCount);
+	TRACE_SCOPE("opus_encode");
+	opus_int32 len = opus_multistream_encode(mEncoder, frame, mSamplesPerFramePerChannel, packet, maxPacketLength);
+	if (len < 0)
+	{
+		mStatus = Status_OpusEncoderError;
+		return -1;
+	}
+	return len;
+}
+
+int OpusWriter::encode(const float* frame, uint8_t* packet, int maxPacketLength)
+{
+	if (mEncoder == nullptr)
+		return -1;
 	
-	// Now encode as many frames as we can.
-	while (mBuffer.size() >= mSamplesPerFramePerChannel * mChannels)
+	TRACE_SCOPE("opus_encode");
+	opus_int32 len = opus_multistream_encode_float(mEncoder, frame, mSamplesPerFramePerChannel, packet, maxPacketLength);
+	if (len < 0)
 	{
-		// Encode to Opus.
-		const int maxPacketLength = 1024 * 64;
-		uint8_t packet[maxPacketLength];
+		mStatus = Status_OpusEncoderError;
+		return -1;
+	}
+	return len;
+}
 
-		opus_int32 len = opus_encode(mEncoder, mBuffer.data(), mSamplesPerFramePerChannel, packet, maxPacketLength);
-		if (len < 0)
+bool OpusWriter::writePacket(const uint8_t* packet, int length)
+{
+	if (mCallback)
+	{
+		if (!mCallback(packet, length))
 		{
-			mStatus = Status_OpusEncoderError;
+			mStatus = Status_Error;
 			return false;
 		}
-		
-		// We are allowed to ignore packets shorter than or equal to 2 bytes.
-		if (len > 2)
-		{
-			mkvmuxer::Frame frame;
-			if (!frame.Init(packet, len))
-			{
-				mStatus = Status_MuxerError;
-				return false;
-			}
-	
-			frame.set_track_number(mTrackNumber);
-			frame.set_timestamp(mTimeCode); // In nanoseconds.
-	
-			frame.set_is_key(true); // Does this do anything for audio?
-	
-			if (!mMuxerSegment.AddGenericFrame(&frame))
-			{
-				mStatus = Status_MuxerError;
-				return false;
-			}
-		}
-		
 		mTimeCode += mFrameLength * 1000;
+		return true;
+	}
+
+	if (mMuxer == nullptr)
+		return false;
+	
+	if (!mMuxer->writeFrame(mTrackNumber, packet, length, mTimeCode))
+	{
+		mStatus = Status_MuxerError;
+		return false;
 	}
+	
+	mTimeCode += mFrameLength * 1000;
 	return true;
 }
 
-bool OpusWriter::close()
+void OpusWriter::skipFrame()
 {
-	bool success = true;
-	if (mFinalize)
-	{
-		success = mMuxerSegment.Finalize();
-		mMuxer.Close();
-		mFinalize = false;
-	}
-	return success;
+	mTimeCode += mFrameLength * 1000;
+}
+
+bool OpusWriter::setDtx(bool enabled)
+{
+	if (mEncoder == nullptr)
+		return false;
+	return opus_multistream_encoder_ctl(mEncoder, OPUS_SET_DTX(enabled ? 1 : 0)) == OPUS_OK;
+}
+
+void OpusWriter::setStartTime(uint64_t timestamp)
+{
+	mTimeCode = timestamp;
+}
+
+uint64_t OpusWriter::nextTimestamp() const
+{
+	return mTimeCode;
+}
+
+uint64_t OpusWriter::bytesWritten() const
+{
+	return mMuxer != nullptr ? mMuxer->bytesWritten() : 0;
+}
+
+int OpusWriter::maxPacketLength() const
+{
+	return MaxPacketLength * mStreams;
+}
+
+int OpusWriter::samplesPerFrame() const
+{
+	return mSamplesPerFramePerChannel * mChannels;
 }
 
+int OpusWriter::samplingRate() const
+{
+	return mSamplingRate;
+}
+
+int OpusWriter::channels() const
+{
+	return mChannels;
+}
+
+OpusWriter::FrameLength OpusWriter::frameLength() const
+{
+	return mFrameLength;
+}
+
+bool OpusWriter::close()
+{
+	// If the muxer is shared, whoever owns it closes it.
+	if (mOwnedMuxer)
+		return mOwnedMuxer->close();
+	return true;
+}
@@ -3,15 +3,21 @@
 #include <string>
 
 #include <opus.h>
+#include <opus_multistream.h>
 
-#include <mkvmuxer/mkvwriter.h>
+#include "Container.h"
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <vector>
 
-// Simple class to write audio to a WebM file (basically Matroska)
-// encoded in Opus. It always uses 16-bit samples and supports mono
-// and stereo.
+// Simple class to write audio to a WebM or Ogg file encoded in Opus. It
+// takes 16-bit or float samples. Mono and stereo are encoded as a single
+// Opus stream; more channels use the multistream encoder, which splits them
+// into several mono and stereo streams. It can either write its own file,
+// add a track to a Container that is shared with other OpusWriters, or just
+// pass the packets to a callback.
 class OpusWriter
 {
 public:
@@ -40,10 +46,28 @@ public:
 		Rate_48000 = 48000,
 	};
 	
+	// Any number of channels from 1 to Channels_Max can be used.
 	enum Channels
 	{
 		Channels_Mono = 1,
 		Channels_Stereo = 2,
+		Channels_Quad = 4,
+		Channels_5point1 = 6,
+		Channels_7point1 = 8,
+		Channels_Max = 255,
+	};
+	
+	// How more than two channels are encoded. It makes no difference for
+	// mono and stereo.
+	enum ChannelMapping
+	{
+		// The channels are a surround layout in Vorbis order (see RFC 7845
+		// section 5.1.1.2), e.g. for 5.1: FL, C, FR, RL, RR, LFE. Pairs are
+		// coupled into stereo streams. Only up to 8 channels (mapping family 1).
+		Mapping_Surround,
+		// The channels are unrelated, e.g. separate microphones, and each one
+		// is encoded as its own mono stream (mapping family 255).
+		Mapping_Discrete,
 	};
 	
 	enum ComputationalComplexity
@@ -61,14 +85,52 @@ public:
 		Complexity_10 = 10,
 	};
 	
+	// The container is chosen from the file extension unless `format` says.
 	OpusWriter(std::string filename,
 	           SamplingRate samplingRate,
 	           Channels channels,
 	           FrameLength frameLength,
 	           int bitrate,
-	           ComputationalComplexity complexity);
+	           ComputationalComplexity complexity,
+	           ChannelMapping mapping = Mapping_Surround,
+	           Container::Format format = Container::Format_Auto);
+	// Add a track to an existing file instead. `muxer` must outlive this, and
+	// is not closed by it.
+	OpusWriter(Container& muxer,
+	           SamplingRate samplingRate,
+	           Channels channels,
+	           FrameLength frameLength,
+	           int bitrate,
+	           ComputationalComplexity complexity,
+	           ChannelMapping mapping = Mapping_Surround);
+	// Pass the packets to `callback` instead, e.g. to encode on several
+	// threads and then write them all with one OpusWriter that has the same
+	// settings. If it returns false `writePacket()` fails.
+	typedef std::function<bool(const uint8_t* packet, int length)> PacketCallback;
+	OpusWriter(PacketCallback callback,
+	           SamplingRate samplingRate,
+	           Channels channels,
+	           FrameLength frameLength,
+	           int bitrate,
+	           ComputationalComplexity complexity,
+	           ChannelMapping mapping = Mapping_Surround);
 	~OpusWriter();
 	
+	// Close the file and start a new one, possibly with different settings.
+	// The encoder's memory and the buffers are reused, and if the sampling
+	// rate and channels are the same the encoder is just reset, which is a
+	// lot cheaper than making a new OpusWriter for each of many short files.
+	// Only for OpusWriters that were made with a filename. Returns false on
+	// failure, and then status() says why.
+	bool reopen(std::string filename,
+	            SamplingRate samplingRate,
+	            Channels channels,
+	            FrameLength frameLength,
+	            int bitrate,
+	            ComputationalComplexity complexity,
+	            ChannelMapping mapping = Mapping_Surround,
+	            Container::Format format = Container::Format_Auto);
+	
 	enum Status
 	{
 		Status_Ok,
@@ -85,8 +147,62 @@ public:
 	
 	Status status() const;
 	
-	// Add some samples! If these are stereo they should be interleaved, starting with the left channel.
+	// Add some samples! If there is more than one channel they should be interleaved, in the order
+	// given by the ChannelMapping (for stereo, starting with the left channel).
 	bool write(const int16_t* samples, int sampleCount);
+	// The same for float samples, which should be in the range [-1, 1]. Don't mix
+	// int16 and float samples in the same frame.
+	bool write(const float* samples, int sampleCount);
+	
+	// `write()` is `encode()` followed by `writePacket()` for each whole frame.
+	// They can be called separately so that encoding and muxing can run on
+	// different threads. Each of them must only be called from one thread at
+	// a time, and packets must be written in the order they were encoded.
+	
+	// The size of packet buffer that is always big enough for one stream.
+	static const int MaxPacketLength = 4000;
+	
+	// The size of packet buffer that is always big enough for `encode()`.
+	// Each Opus stream in a multistream packet can be up to MaxPacketLength.
+	int maxPacketLength() const;
+	
+	// Encode exactly one frame of `samplesPerFrame()` samples. Returns the
+	// length of the packet, or -1 on error.
+	int encode(const int16_t* frame, uint8_t* packet, int maxPacketLength);
+	int encode(const float* frame, uint8_t* packet, int maxPacketLength);
+	
+	// Write a packet returned by `encode()` to the file.
+	bool writePacket(const uint8_t* packet, int length);
+	
+	// Leave out one frame, e.g. because it was silent. The next packet is
+	// written one frame later, so the file has a gap in its timestamps.
+	void skipFrame();
+	
+	// Turn on discontinuous transmission. During silence the encoder then only
+	// produces a packet of a byte or two, with an update every 400 ms. WebM
+	// files leave those out and Ogg files keep them. Call it again after `reopen()`.
+	// Returns false on failure.
+	bool setDtx(bool enabled);
+	
+	// Set the timestamp of the first packet, in nanoseconds. This is used to
+	// line up tracks that start at slightly different times. Call it before
+	// writing anything.
+	void setStartTime(uint64_t timestamp);
+	
+	// The timestamp that the next packet will be written with, in nanoseconds.
+	uint64_t nextTimestamp() const;
+	
+	// Size of the file so far (see Container::bytesWritten()), or 0 if the
+	// packets go to a callback. Only call it from the thread that writes.
+	uint64_t bytesWritten() const;
+	
+	// Number of samples in one frame, for all channels.
+	int samplesPerFrame() const;
+	
+	int samplingRate() const;
+	int channels() const;
+	
+	FrameLength frameLength() const;
 
 	// Close is called automatically on destruction.
 	bool close();
@@ -95,17 +211,59 @@ private:
 	OpusWriter(const OpusWriter&) = delete;
 	OpusWriter& operator=(const OpusWriter&) = delete;
 	
-	Status mStatus = Status_Error;
+	bool initEncoder(SamplingRate samplingRate,
+	                 Channels channels,
+	                 FrameLength frameLength,
+	                 int bitrate,
+	                 ComputationalComplexity complexity,
+	                 ChannelMapping mapping);
+	void initTrack(Container& muxer, SamplingRate samplingRate, Channels channels);
+	
+	// The implementation of both versions of `write()`.
+	template <typename T>
+	bool writeSamples(std::vector<T>& buffer, size_t& fill, const T* samples, int sampleCount);
+	// Encode one whole frame and write the packet.
+	template <typename T>
+	bool encodeAndWrite(const T* frame);
+	
+	// This is atomic since encoding and muxing may be on different threads.
+	std::atomic<Status> mStatus{Status_Error};
 	
-	// This should be a unique_ptr but it's not as ergonomic to use a custom deleter.
-	OpusEncoder* mEncoder = nullptr;
-	mkvmuxer::MkvWriter mMuxer;
-	mkvmuxer::Segment mMuxerSegment;
-	bool mFinalize = false;
+	// The encoder is allocated here so it can be reused; mEncoder points to
+	// it once it has been initialised. This should be a unique_ptr but it's
+	// not as ergonomic to use a custom deleter.
+	void* mEncoderMemory = nullptr;
+	size_t mEncoderSize = 0;
+	OpusMSEncoder* mEncoder = nullptr;
+	// What the encoder was initialised for.
+	int mEncoderRate = 0;
+	int mEncoderChannels = 0;
+	int mEncoderFamily = -1;
+	// Only set if this writer made its own file.
+	std::unique_ptr<Container> mOwnedMuxer;
+	// The muxer that packets are written to; either mOwnedMuxer or a shared one.
+	Container* mMuxer = nullptr;
+	// Used instead of a muxer if it is set.
+	PacketCallback mCallback;
 	
+	// One frame of samples for each `write()`, and how much of it is filled
+	// by the leftover samples that weren't a whole frame yet. Whole frames
+	// are encoded straight from the samples passed to `write()`, so only
+	// these leftovers are copied.
 	std::vector<int16_t> mBuffer;
+	size_t mBufferFill = 0;
+	std::vector<float> mFloatBuffer;
+	size_t mFloatBufferFill = 0;
+	// Packet buffer for `write()`.
+	std::vector<uint8_t> mPacket;
 	
+	int mSamplingRate = Rate_48000;
 	int mChannels = 1;
+	// How the channels are split into streams, for the OpusHead.
+	int mMappingFamily = 0;
+	int mStreams = 1;
+	int mCoupledStreams = 0;
+	std::vector<uint8_t> mMapping;
 	int mSamplesPerFramePerChannel = 1;
 	FrameLength mFrameLength = Frame_10ms;
 	
@@ -0,0 +1,279 @@
+#include "PcmFile.h"
+
+#include "SampleConvert.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// WAV format tags. See https://docs.microsoft.com/en-us/windows/win32/api/mmreg/ns-mmreg-waveformatex
+static const uint16_t WaveFormatPcm = 1;
+static const uint16_t WaveFormatFloat = 3;
+static const uint16_t WaveFormatExtensible = 0xFFFE;
+
+// Samples are unpacked from 24 to 32 bits in blocks of this many on the stack.
+static const size_t UnpackBlock = 1024;
+
+static uint16_t readLE16(const uint8_t* p)
+{
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t readLE32(const uint8_t* p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+	       (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t readLE64(const uint8_t* p)
+{
+	return static_cast<uint64_t>(readLE32(p)) | (static_cast<uint64_t>(readLE32(p + 4)) << 32);
+}
+
+// The libsoundio format that the samples are converted from. Packed 24 bit
+// samples are first unpacked to 32 bits.
+static SoundIoFormat convertFormat(PcmFile::SampleFormat format)
+{
+	switch (format)
+	{
+	case PcmFile::Format_S16LE:
+		return SoundIoFormatS16LE;
+	case PcmFile::Format_S16BE:
+		return SoundIoFormatS16BE;
+	case PcmFile::Format_S24LE:
+	case PcmFile::Format_S24BE:
+		return SoundIoFormatS32NE;
+	case PcmFile::Format_S32LE:
+		return SoundIoFormatS32LE;
+	case PcmFile::Format_S32BE:
+		return SoundIoFormatS32BE;
+	case PcmFile::Format_F32LE:
+		return SoundIoFormatFloat32LE;
+	case PcmFile::Format_F32BE:
+		return SoundIoFormatFloat32BE;
+	}
+	return SoundIoFormatInvalid;
+}
+
+static size_t sampleBytes(PcmFile::SampleFormat format)
+{
+	switch (format)
+	{
+	case PcmFile::Format_S16LE:
+	case PcmFile::Format_S16BE:
+		return 2;
+	case PcmFile::Format_S24LE:
+	case PcmFile::Format_S24BE:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+// Unpack 3 byte samples into the top of native 32 bit integers.
+static void unpackS24(const uint8_t* src, bool bigEndian, int32_t* dst, size_t count)
+{
+	for (size_t i = 0; i < count; ++i, src += 3)
+	{
+		uint32_t x = bigEndian ? (static_cast<uint32_t>(src[0]) << 24) | (static_cast<uint32_t>(src[1]) << 16) | (static_cast<uint32_t>(src[2]) << 8)
+		                       : (static_cast<uint32_t>(src[2]) << 24) | (static_cast<uint32_t>(src[1]) << 16) | (static_cast<uint32_t>(src[0]) << 8);
+		dst[i] = static_cast<int32_t>(x);
+	}
+}
+
+PcmFile::PcmFile()
+{
+}
+
+PcmFile::~PcmFile()
+{
+}
+
+bool PcmFile::setFormat(SampleFormat format, int sampleRate, int channels)
+{
+	if (sampleRate <= 0 || channels <= 0)
+		return false;
+
+	mFormat = format;
+	mSampleRate = sampleRate;
+	mChannels = channels;
+	mSampleBytes = sampleBytes(format);
+	mFrameBytes = mSampleBytes * channels;
+	return true;
+}
+
+bool PcmFile::openRaw(const string& filename, SampleFormat format, int sampleRate, int channels)
+{
+	if (!setFormat(format, sampleRate, channels))
+	{
+		cerr << "Invalid raw format: " << sampleRate << " Hz, " << channels << " channels" << endl;
+		return false;
+	}
+	if (!mFile.open(filename))
+		return false;
+
+	mData = mFile.data();
+	mFrames = mFile.size() / mFrameBytes;
+	return true;
+}
+
+bool PcmFile::open(const string& filename)
+{
+	if (!mFile.open(filename))
+		return false;
+
+	const uint8_t* file = mFile.data();
+	uint64_t size = mFile.size();
+
+	// RF64 is the same as RIFF except the sizes that don't fit in 32 bits are
+	// in a ds64 chunk at the start.
+	bool rf64 = size >= 12 && memcmp(file, "RF64", 4) == 0;
+	if (size < 12 || (memcmp(file, "RIFF", 4) != 0 && !rf64) || memcmp(file + 8, "WAVE", 4) != 0)
+	{
+		cerr << filename << " is not a WAV file. Use --format for raw files." << endl;
+		return false;
+	}
+
+	uint64_t rf64DataSize = 0;
+	bool haveFormat = false;
+	uint64_t pos = 12;
+	while (pos + 8 <= size)
+	{
+		const uint8_t* chunk = file + pos;
+		uint64_t chunkSize = readLE32(chunk + 4);
+		const uint8_t* body = chunk + 8;
+		uint64_t remaining = size - pos - 8;
+
+		if (memcmp(chunk, "ds64", 4) == 0 && chunkSize >= 16 && remaining >= 16)
+		{
+			rf64DataSize = readLE64(body + 8);
+		}
+		else if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16 && remaining >= 16)
+		{
+			uint16_t tag = readLE16(body);
+			int channels = readLE16(body + 2);
+			int sampleRate = static_cast<int>(readLE32(body + 4));
+			int bits = readLE16(body + 14);
+
+			if (tag == WaveFormatExtensible && chunkSize >= 40 && remaining >= 40)
+			{
+				mChannelMask = readLE32(body + 20);
+				// The first two bytes of the sub-format GUID are the real tag.
+				tag = readLE16(body + 24);
+			}
+
+			SampleFormat format;
+			if (tag == WaveFormatPcm && bits == 16)
+				format = Format_S16LE;
+			else if (tag == WaveFormatPcm && bits == 24)
+				format = Format_S24LE;
+			else if (tag == WaveFormatPcm && bits == 32)
+				format = Format_S32LE;
+			else if (tag == WaveFormatFloat && bits == 32)
+				format = Format_F32LE;
+			else
+			{
+				cerr << filename << ": unsupported WAV format " << tag << " with " << bits << " bits per sample" << endl;
+				return false;
+			}
+
+			if (!setFormat(format, sampleRate, channels) || readLE16(body + 12) != mFrameBytes)
+			{
+				cerr << filename << ": invalid WAV format chunk" << endl;
+				return false;
+			}
+			haveFormat = true;
+		}
+		else if (memcmp(chunk, "data", 4) == 0)
+		{
+			if (!haveFormat)
+			{
+				cerr << filename << ": WAV data before format chunk" << endl;
+				return false;
+			}
+			if (rf64 && chunkSize == 0xFFFFFFFF)
+				chunkSize = rf64DataSize;
+
+			// Recordings that were cut off often have the wrong size, so
+			// just take whatever is there.
+			mData = body;
+			mFrames = min(chunkSize, remaining) / mFrameBytes;
+			return true;
+		}
+
+		// Chunks are padded to an even length.
+		pos += 8 + chunkSize + (chunkSize & 1);
+	}
+
+	cerr << filename << ": no WAV data chunk" << endl;
+	return false;
+}
+
+PcmFile::SampleFormat PcmFile::format() const
+{
+	return mFormat;
+}
+
+int PcmFile::sampleRate() const
+{
+	return mSampleRate;
+}
+
+int PcmFile::channels() const
+{
+	return mChannels;
+}
+
+uint32_t PcmFile::channelMask() const
+{
+	return mChannelMask;
+}
+
+uint64_t PcmFile::frames() const
+{
+	return mFrames;
+}
+
+uint64_t PcmFile::dataBytes() const
+{
+	return mFrames * mFrameBytes;
+}
+
+bool PcmFile::isFloat() const
+{
+	return mSampleBytes > 2;
+}
+
+template <typename Out>
+void PcmFile::convertSamples(uint64_t startFrame, size_t frames, Out* dst) const
+{
+	const uint8_t* src = mData + startFrame * mFrameBytes;
+	size_t count = frames * mChannels;
+
+	if (mSampleBytes != 3)
+	{
+		ConvertSamples(convertFormat(mFormat), src, dst, count);
+		return;
+	}
+
+	bool bigEndian = mFormat == Format_S24BE;
+	int32_t unpacked[UnpackBlock];
+	for (size_t i = 0; i < count; i += UnpackBlock)
+	{
+		size_t n = min(UnpackBlock, count - i);
+		unpackS24(src + i * 3, bigEndian, unpacked, n);
+		ConvertSamples(SoundIoFormatS32NE, unpacked, dst + i, n);
+	}
+}
+
+void PcmFile::convert(uint64_t startFrame, size_t frames, int16_t* dst) const
+{
+	convertSamples(startFrame, frames, dst);
+}
+
+void PcmFile::convert(uint64_t startFrame, size_t frames, float* dst) const
+{
+	convertSamples(startFrame, frames, dst);
+}
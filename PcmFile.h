@@ -0,0 +1,89 @@
+#pragma once
+
+#include <soundio/soundio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "MappedFile.h"
+
+// Uncompressed audio in a WAV file (including RF64 and WAVE_FORMAT_EXTENSIBLE
+// for files over 4 GB and more than two channels) or a headerless raw PCM
+// file. The file is memory-mapped and converted to int16 or float samples
+// with the same kernels as captured audio (see SampleConvert.h).
+class PcmFile
+{
+public:
+	// Sample formats of the file. 24 bit samples are packed into 3 bytes,
+	// as they are in WAV files.
+	enum SampleFormat
+	{
+		Format_S16LE,
+		Format_S16BE,
+		Format_S24LE,
+		Format_S24BE,
+		Format_S32LE,
+		Format_S32BE,
+		Format_F32LE,
+		Format_F32BE,
+	};
+
+	PcmFile();
+	~PcmFile();
+
+	// Open a WAV file. Prints an error and returns false on failure.
+	bool open(const std::string& filename);
+	// Open a raw file of interleaved samples, which doesn't say what it
+	// contains. Prints an error and returns false on failure.
+	bool openRaw(const std::string& filename, SampleFormat format, int sampleRate, int channels);
+
+	SampleFormat format() const;
+	int sampleRate() const;
+	int channels() const;
+
+	// The WAV channel mask (bit 0 is front left and so on), or 0 if the file
+	// doesn't have one.
+	uint32_t channelMask() const;
+
+	// Number of frames (samples for every channel) in the file.
+	uint64_t frames() const;
+	// Size of the audio data in bytes.
+	uint64_t dataBytes() const;
+
+	// True if the samples have more than 16 bits and so should be converted to
+	// float rather than int16 to keep them.
+	bool isFloat() const;
+
+	// Convert `frames` frames, starting `startFrame` frames in, to interleaved
+	// native-endian samples in the file's channel order. It doesn't modify
+	// anything, so it can be called from several threads at once.
+	void convert(uint64_t startFrame, size_t frames, int16_t* dst) const;
+	void convert(uint64_t startFrame, size_t frames, float* dst) const;
+
+private:
+	PcmFile(const PcmFile&) = delete;
+	PcmFile& operator=(const PcmFile&) = delete;
+
+	// Set the format and work out the frame size. Returns false if the
+	// description is invalid.
+	bool setFormat(SampleFormat format, int sampleRate, int channels);
+
+	// The implementation of both versions of `convert()`.
+	template <typename Out>
+	void convertSamples(uint64_t startFrame, size_t frames, Out* dst) const;
+
+	MappedFile mFile;
+
+	SampleFormat mFormat = Format_S16LE;
+	int mSampleRate = 0;
+	int mChannels = 0;
+	uint32_t mChannelMask = 0;
+	// Bytes per sample and per frame in the file.
+	size_t mSampleBytes = 0;
+	size_t mFrameBytes = 0;
+
+	// Where the samples start in the mapped file, and how many frames there are.
+	const uint8_t* mData = nullptr;
+	uint64_t mFrames = 0;
+};
@@ -0,0 +1,496 @@
+#include "Pipeline.h"
+
+#include "AudioSource.h"
+#include "OpusWriter.h"
+#include "Trace.h"
+#include "VoiceGate.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+
+// How much audio each queue can hold. The packet queue absorbs filesystem
+// stalls so it is much bigger; packets are small anyway.
+static const int PcmQueueMilliseconds = 200;
+static const int PacketQueueMilliseconds = 2000;
+
+// Most frames that are given to the resampler at once.
+static const size_t ResamplerChunk = 1024;
+
+// Number of frames of `writer` in `ms` milliseconds (at least 2).
+static size_t framesIn(const OpusWriter& writer, int ms)
+{
+	size_t frames = static_cast<size_t>(ms) * 1000 / writer.frameLength();
+	return frames < 2 ? 2 : frames;
+}
+
+static void updateBacklog(StageStats& stats, uint64_t backlog)
+{
+	if (backlog > stats.maxBacklog)
+		stats.maxBacklog = backlog;
+}
+
+Pipeline::Pipeline(AudioSource& input,
+                   OpusWriter& writer,
+                   Resampler::Quality quality,
+                   int64_t clockOrigin,
+                   Semaphore& workReady,
+                   Semaphore& packetReady)
+    : mInput(input.ringBuffer()),
+      mSource(input),
+      mWriter(writer),
+      mClockOrigin(clockOrigin),
+      mWorkReady(workReady),
+      mPacketReady(packetReady),
+      mFloat(input.isFloat()),
+      mInputFrameBytes(writer.channels() * (mFloat ? sizeof(float) : sizeof(int16_t))),
+      mFrameBytes(static_cast<int64_t>(writer.samplesPerFrame()) * input.sampleRate() / writer.samplingRate() *
+                  (mFloat ? sizeof(float) : sizeof(int16_t))),
+      mFrameLength(writer.samplesPerFrame() / writer.channels()),
+      mPcmQueue(framesIn(writer, PcmQueueMilliseconds),
+                PcmFrame{std::vector<int16_t>(mFloat ? 0 : writer.samplesPerFrame()),
+                         std::vector<float>(mFloat ? writer.samplesPerFrame() : 0)}),
+      mPacketQueue(framesIn(writer, PacketQueueMilliseconds),
+                   EncodedPacket{std::vector<uint8_t>(writer.maxPacketLength()), 0})
+{
+	if (input.sampleRate() != writer.samplingRate())
+	{
+		// The input is always float in this case. The resampler has to be
+		// able to hold a whole frame's worth of input as well as a chunk, or
+		// when downsampling a lot (e.g. 96 kHz to 16 kHz) it fills up before
+		// it has a frame to read.
+		size_t frameInput = mFrameBytes / mInputFrameBytes + 1;
+		mResampler.reset(new Resampler(input.sampleRate(), writer.samplingRate(), writer.channels(), quality, ResamplerChunk + frameInput));
+		mResamplerInput.resize(ResamplerChunk * writer.channels());
+		if (!mResampler->valid())
+			mFailed = true;
+	}
+}
+
+Pipeline::~Pipeline()
+{
+}
+
+void Pipeline::setVoiceGate(double thresholdDb, int hangoverMs, int prerollMs)
+{
+	int frameMicroseconds = mWriter.frameLength();
+	mGate.reset(new VoiceGate(thresholdDb, hangoverMs * 1000 / frameMicroseconds));
+	mHeld.assign(static_cast<size_t>(prerollMs) * 1000 / frameMicroseconds,
+	             PcmFrame{std::vector<int16_t>(mFloat ? 0 : mWriter.samplesPerFrame()),
+	                      std::vector<float>(mFloat ? mWriter.samplesPerFrame() : 0)});
+}
+
+void Pipeline::addJobs(WorkerPool& pool)
+{
+	pool.add([this] { return convert(); });
+	pool.add([this] { return encode(); });
+}
+
+void Pipeline::finish()
+{
+	mStopping = true;
+	mWorkReady.post();
+}
+
+bool Pipeline::failed() const
+{
+	return mFailed;
+}
+
+FrameQueue<EncodedPacket>& Pipeline::packets()
+{
+	return mPacketQueue;
+}
+
+OpusWriter& Pipeline::writer()
+{
+	return mWriter;
+}
+
+uint64_t Pipeline::startOffset() const
+{
+	return mStartOffset;
+}
+
+StageStats& Pipeline::muxStats()
+{
+	return mMuxStats;
+}
+
+std::atomic<uint64_t>& Pipeline::outputBytes()
+{
+	return mOutputBytes;
+}
+
+void Pipeline::printStats(std::ostream& os) const
+{
+	auto print = [&](const char* name, const StageStats& stats) {
+		os << "  " << name << ": " << stats.frames << " frames, "
+		   << stats.stalls << " stalls, "
+		   << "max backlog " << stats.maxBacklog;
+		if (stats.time.count() > 0)
+			os << ", 99% in " << stats.time.quantile(0.99) / 1000 << " us, max " << stats.time.max() / 1000 << " us";
+		os << std::endl;
+	};
+	print("convert", mConvertStats);
+	print("encode", mEncodeStats);
+	print("mux", mMuxStats);
+	if (mGate)
+		os << "  gate: " << mGatedFrames << " frames left out" << std::endl;
+}
+
+void Pipeline::addMetrics(Metrics& metrics, const Metrics::Labels& labels) const
+{
+	auto add = [&](const char* name, const StageStats& stats) {
+		Metrics::Labels stageLabels = labels;
+		stageLabels.emplace_back("stage", name);
+		metrics.addCounter("opusrec_stage_frames_total", "Frames or packets processed by each stage.", stageLabels, stats.frames);
+		metrics.addCounter("opusrec_stage_stalls_total", "Times each stage had to wait for space in the next stage's queue.", stageLabels, stats.stalls);
+		metrics.addGauge("opusrec_stage_max_backlog", "The most items that were ever waiting for each stage.", stageLabels, [&stats]() {
+			return static_cast<double>(stats.maxBacklog);
+		});
+	};
+	add("convert", mConvertStats);
+	add("encode", mEncodeStats);
+	add("mux", mMuxStats);
+
+	metrics.addHistogram("opusrec_encode_seconds", "Time to encode each frame.", labels, mEncodeStats.time, 1e-9);
+	metrics.addHistogram("opusrec_mux_write_seconds", "Time for the muxer to write each packet.", labels, mMuxStats.time, 1e-9);
+	metrics.addCounter("opusrec_encoded_bytes_total", "Bytes of encoded audio given to the muxer.", labels, mMuxStats.bytes);
+	const std::atomic<uint64_t>& outputBytes = mOutputBytes;
+	metrics.addGauge("opusrec_output_file_bytes", "Size of the file being written, or the current segment.", labels, [&outputBytes]() {
+		return static_cast<double>(outputBytes);
+	});
+	if (mGate)
+		metrics.addCounter("opusrec_gated_frames_total", "Frames the voice gate left out.", labels, mGatedFrames);
+}
+
+bool Pipeline::convert()
+{
+	if (mPcmQueueClosed)
+		return false;
+
+	// Check this before draining so that nothing captured before finish() is lost.
+	bool stopping = mStopping;
+
+	updateBacklog(mConvertStats, mInput.size() / mFrameBytes);
+
+	bool progress = false;
+	for (;;)
+	{
+		if (!frameReady())
+		{
+			if (mResampler && feedResampler())
+				continue;
+			break;
+		}
+
+		PcmFrame* frame = mPcmQueue.tryAcquire();
+		if (frame == nullptr)
+		{
+			// The encode job will run again once it has released a frame.
+			if (!mConvertStalled)
+				++mConvertStats.stalls;
+			mConvertStalled = true;
+			return progress;
+		}
+		mConvertStalled = false;
+
+		TRACE_SCOPE("convert_frame");
+
+		if (!mStarted)
+		{
+			// The input's start time is set before anything is written to
+			// the ring buffer, so it is valid now.
+			int64_t offset = mSource.startTime() - mClockOrigin;
+			mStartOffset = offset > 0 ? offset : 0;
+			mStarted = true;
+		}
+
+		if (mResampler)
+		{
+			mResampler->read(frame->floatSamples.data(), mFrameLength);
+		}
+		else
+		{
+			// The samples were converted when they were captured.
+			uint8_t* out = mFloat ? reinterpret_cast<uint8_t*>(frame->floatSamples.data())
+			                      : reinterpret_cast<uint8_t*>(frame->samples.data());
+			mInput.pop_n(out, mFrameBytes);
+		}
+
+		mPcmQueue.push(frame);
+		++mConvertStats.frames;
+		progress = true;
+	}
+
+	if (stopping)
+	{
+		mPcmQueue.close();
+		mPcmQueueClosed = true;
+		progress = true;
+	}
+	return progress;
+}
+
+bool Pipeline::frameReady() const
+{
+	if (mResampler)
+		return mResampler->available() >= mFrameLength;
+	return mInput.size() >= mFrameBytes;
+}
+
+bool Pipeline::feedResampler()
+{
+	size_t frames = std::min(mInput.size() / mInputFrameBytes, mResampler->space());
+	frames = std::min(frames, ResamplerChunk);
+	if (frames == 0)
+		return false;
+
+	TRACE_SCOPE("resampler_write");
+	mInput.pop_n(reinterpret_cast<uint8_t*>(mResamplerInput.data()), frames * mInputFrameBytes);
+	mResampler->write(mResamplerInput.data(), frames);
+	return true;
+}
+
+bool Pipeline::encode()
+{
+	if (mPacketQueueClosed)
+		return false;
+
+	updateBacklog(mEncodeStats, mPcmQueue.size());
+
+	bool progress = false;
+	for (;;)
+	{
+		PcmFrame* frame = mPcmQueue.front();
+		if (frame == nullptr)
+		{
+			if (mPcmQueue.finished())
+			{
+				mPacketQueue.close();
+				mPacketQueueClosed = true;
+				mPacketReady.post();
+				return true;
+			}
+			return progress;
+		}
+
+		if (!mFailed)
+		{
+			if (mGate && !mGateDecided)
+			{
+				if (mFloat)
+					mGateOpen = mGate->process(frame->floatSamples.data(), frame->floatSamples.size());
+				else
+					mGateOpen = mGate->process(frame->samples.data(), frame->samples.size());
+				mGateDecided = true;
+			}
+
+			if (mGate && !mGateOpen)
+			{
+				if (!holdBack(*frame))
+					return progress;
+			}
+			else
+			{
+				// Encode what was held back first so that the speech doesn't
+				// start abruptly.
+				while (mHeldCount > 0)
+				{
+					if (!emit(&mHeld[mHeldStart]))
+						return progress;
+					mHeldStart = (mHeldStart + 1) % mHeld.size();
+					--mHeldCount;
+					progress = true;
+				}
+				if (!emit(frame))
+					return progress;
+			}
+			mGateDecided = false;
+		}
+
+		mPcmQueue.tryPop();
+		mPcmQueue.release(frame);
+		progress = true;
+	}
+}
+
+bool Pipeline::emit(const PcmFrame* frame)
+{
+	EncodedPacket* packet = mPacketQueue.tryAcquire();
+	if (packet == nullptr)
+	{
+		// The mux thread posts `workReady` when it releases one.
+		if (!mEncodeStalled)
+			++mEncodeStats.stalls;
+		mEncodeStalled = true;
+		return false;
+	}
+	mEncodeStalled = false;
+
+	if (frame == nullptr)
+	{
+		packet->length = 0;
+		++mGatedFrames;
+	}
+	else
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (mFloat)
+			packet->length = mWriter.encode(frame->floatSamples.data(), packet->data.data(), packet->data.size());
+		else
+			packet->length = mWriter.encode(frame->samples.data(), packet->data.data(), packet->data.size());
+		mEncodeStats.time.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		if (packet->length < 0)
+			mFailed = true;
+		else
+			++mEncodeStats.frames;
+	}
+
+	// Pass it on even if it failed, since only the mux thread can release it.
+	mPacketQueue.push(packet);
+	mPacketReady.post();
+	return true;
+}
+
+bool Pipeline::holdBack(const PcmFrame& frame)
+{
+	// The packet for a frame that is left out still has to be passed on so
+	// that the mux thread knows how far this input has got.
+	if (mHeld.empty())
+		return emit(nullptr);
+
+	if (mHeldCount == mHeld.size())
+	{
+		if (!emit(nullptr))
+			return false;
+		mHeldStart = (mHeldStart + 1) % mHeld.size();
+		--mHeldCount;
+	}
+
+	PcmFrame& copy = mHeld[(mHeldStart + mHeldCount) % mHeld.size()];
+	copy.samples.assign(frame.samples.begin(), frame.samples.end());
+	copy.floatSamples.assign(frame.floatSamples.begin(), frame.floatSamples.end());
+	++mHeldCount;
+	return true;
+}
+
+MuxThread::MuxThread(std::vector<Pipeline*> pipelines, bool interleave, Semaphore& workReady, Semaphore& packetReady)
+    : mPipelines(pipelines),
+      mStarted(pipelines.size(), false),
+      mPipelineFailed(pipelines.size(), false),
+      mInterleave(interleave),
+      mWorkReady(workReady),
+      mPacketReady(packetReady)
+{
+}
+
+MuxThread::~MuxThread()
+{
+	join();
+}
+
+void MuxThread::start()
+{
+	mThread = std::thread(&MuxThread::run, this);
+}
+
+void MuxThread::join()
+{
+	if (mThread.joinable())
+		mThread.join();
+}
+
+bool MuxThread::failed() const
+{
+	return mFailed;
+}
+
+void MuxThread::run()
+{
+	TRACE_THREAD("mux");
+	for (;;)
+	{
+		// Find the pipeline with the earliest packet.
+		size_t next = mPipelines.size();
+		bool waiting = false;
+		bool finished = true;
+
+		for (size_t i = 0; i < mPipelines.size(); ++i)
+		{
+			FrameQueue<EncodedPacket>& packets = mPipelines[i]->packets();
+			if (packets.front() == nullptr)
+			{
+				if (!packets.finished())
+				{
+					waiting = true;
+					finished = false;
+				}
+				continue;
+			}
+			finished = false;
+
+			OpusWriter& writer = mPipelines[i]->writer();
+			if (!mStarted[i])
+			{
+				writer.setStartTime(mPipelines[i]->startOffset());
+				mStarted[i] = true;
+			}
+
+			if (next == mPipelines.size() || writer.nextTimestamp() < mPipelines[next]->writer().nextTimestamp())
+				next = i;
+		}
+
+		if (finished)
+			break;
+
+		// When interleaving, a pipeline that doesn't have a packet yet might
+		// be about to produce one with an earlier timestamp.
+		if (next == mPipelines.size() || (mInterleave && waiting))
+		{
+			mPacketReady.waitFor(std::chrono::milliseconds(100));
+			continue;
+		}
+
+		write(next);
+	}
+}
+
+void MuxThread::write(size_t index)
+{
+	Pipeline* pipeline = mPipelines[index];
+	FrameQueue<EncodedPacket>& packets = pipeline->packets();
+	EncodedPacket* packet = packets.tryPop();
+	TRACE_SCOPE("mux_write");
+
+	updateBacklog(pipeline->muxStats(), packets.size() + 1);
+
+	if (!mPipelineFailed[index] && packet->length == 0)
+	{
+		pipeline->writer().skipFrame();
+	}
+	else if (!mPipelineFailed[index] && packet->length > 0)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool written = pipeline->writer().writePacket(packet->data.data(), packet->length);
+		pipeline->muxStats().time.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		if (written)
+		{
+			++pipeline->muxStats().frames;
+			pipeline->muxStats().bytes.fetch_add(packet->length, std::memory_order_relaxed);
+			pipeline->outputBytes().store(pipeline->writer().bytesWritten(), std::memory_order_relaxed);
+		}
+		else
+		{
+			mPipelineFailed[index] = true;
+			mFailed = true;
+		}
+	}
+
+	packets.release(packet);
+
+	// The encode job might be waiting for a free packet.
+	mWorkReady.post();
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "FrameQueue.h"
+#include "Metrics.h"
+#include "Resampler.h"
+#include "RingBuffer.h"
+#include "Semaphore.h"
+
+class AudioSource;
+class OpusWriter;
+class VoiceGate;
+class WorkerPool;
+
+// Counters for one stage of the pipeline. They are only written by the
+// stage's own thread but can be read from anywhere.
+struct StageStats
+{
+	// Frames (or packets) processed.
+	std::atomic<uint64_t> frames{0};
+	// Number of times the next stage's queue filled up so this stage had to
+	// wait for it. This is the backpressure.
+	std::atomic<uint64_t> stalls{0};
+	// The most items that were ever waiting in this stage's input.
+	std::atomic<uint64_t> maxBacklog{0};
+	// Nanoseconds spent on each item: opus_encode() for the encode stage and
+	// the muxer for the mux stage. Not recorded for convert.
+	Histogram time;
+	// Bytes passed to the next stage. Only counted for the mux stage, where
+	// it is the encoded audio given to the muxer.
+	std::atomic<uint64_t> bytes{0};
+};
+
+// One encoded frame.
+struct EncodedPacket
+{
+	std::vector<uint8_t> data;
+	// -1 if encoding failed, or 0 if the voice gate left the frame out.
+	int length;
+};
+
+// Converts and encodes the audio from one input. It has a job for each stage,
+// which are run by a WorkerPool that is shared with the other inputs:
+//
+//   convert: int16 or float samples from the ring buffer -> frames, resampled
+//            if the input isn't at the encoder's rate
+//   encode:  frames -> Opus packets (OpusWriter::encode()), skipping the
+//            quiet ones if there is a voice gate
+//
+// The packets are then written by a MuxThread.
+class Pipeline
+{
+public:
+	// `clockOrigin` is the steady_clock time in nanoseconds that corresponds
+	// to timestamp 0 in the output. It is used to line up inputs that start
+	// at slightly different times. `packetReady` is posted whenever a packet
+	// is produced, and `workReady` is the pool's wakeup semaphore.
+	// `quality` is used if the input has to be resampled.
+	Pipeline(AudioSource& input,
+	         OpusWriter& writer,
+	         Resampler::Quality quality,
+	         int64_t clockOrigin,
+	         Semaphore& workReady,
+	         Semaphore& packetReady);
+
+	~Pipeline();
+
+	// Only encode the frames that are louder than `thresholdDb` (dBFS), plus
+	// `hangoverMs` after each one and `prerollMs` before. The rest are left
+	// out, which leaves gaps in the timestamps. Call it before addJobs().
+	void setVoiceGate(double thresholdDb, int hangoverMs, int prerollMs);
+
+	// Add the convert and encode jobs to the pool.
+	void addJobs(WorkerPool& pool);
+
+	// The input has stopped. Encode whatever whole frames are left in it and
+	// then close the packet queue.
+	void finish();
+
+	// True if encoding failed. The pipeline keeps draining its input so
+	// capture doesn't back up, but the output is lost.
+	bool failed() const;
+
+	// The encoded packets, for the MuxThread.
+	FrameQueue<EncodedPacket>& packets();
+	OpusWriter& writer();
+
+	// Timestamp of the first sample in nanoseconds. It is set before the
+	// first packet is pushed.
+	uint64_t startOffset() const;
+
+	// The mux stage is run by the MuxThread but its stats are kept here.
+	StageStats& muxStats();
+
+	// Size of the file the mux stage is writing to, or the current segment.
+	// It is updated by the MuxThread after each packet, since the muxers can
+	// only be asked from the thread that writes to them.
+	std::atomic<uint64_t>& outputBytes();
+
+	// Print the statistics for each stage.
+	void printStats(std::ostream& os) const;
+
+	// Add the statistics for each stage, labelled with `stage`, and the
+	// voice gate's count.
+	void addMetrics(Metrics& metrics, const Metrics::Labels& labels) const;
+
+private:
+	Pipeline(const Pipeline&) = delete;
+	Pipeline& operator=(const Pipeline&) = delete;
+
+	// Interleaved samples for one frame. Only one of these is used, depending
+	// on what the input produces.
+	struct PcmFrame
+	{
+		std::vector<int16_t> samples;
+		std::vector<float> floatSamples;
+	};
+
+	// The jobs. They return true if they did anything.
+	bool convert();
+	bool encode();
+
+	// Encode `frame` and pass the packet on, or pass on an empty packet if
+	// it is null because the voice gate left the frame out. Returns false if
+	// the packet queue is full.
+	bool emit(const PcmFrame* frame);
+	// Keep a copy of a frame the voice gate left out, in case it opens in
+	// the next few frames. Returns false if the packet queue is full.
+	bool holdBack(const PcmFrame& frame);
+
+	// Is there a whole frame ready for the convert job?
+	bool frameReady() const;
+	// Give the resampler as much input as it can take. Returns false if
+	// there wasn't any.
+	bool feedResampler();
+
+	RingBuffer<uint8_t>& mInput;
+	AudioSource& mSource;
+	OpusWriter& mWriter;
+	int64_t mClockOrigin;
+	Semaphore& mWorkReady;
+	Semaphore& mPacketReady;
+
+	// Whether the input produces floats.
+	bool mFloat = false;
+	// Size of one sample for every channel in the input ring buffer.
+	size_t mInputFrameBytes = 0;
+	// Size of one encoder frame in the input ring buffer (approximately, if
+	// resampling).
+	size_t mFrameBytes = 0;
+	// Samples per channel in one encoder frame.
+	size_t mFrameLength = 0;
+
+	// Only used if the input isn't at the encoder's sampling rate.
+	std::unique_ptr<Resampler> mResampler;
+	std::vector<float> mResamplerInput;
+
+	FrameQueue<PcmFrame> mPcmQueue;
+	FrameQueue<EncodedPacket> mPacketQueue;
+
+	// These are only touched by the jobs. The pool never runs a job on two
+	// threads at once, so they don't need to be atomic.
+	bool mStarted = false;
+	bool mPcmQueueClosed = false;
+	bool mPacketQueueClosed = false;
+	// Whether each job is currently waiting for space in its output queue.
+	bool mConvertStalled = false;
+	bool mEncodeStalled = false;
+	uint64_t mStartOffset = 0;
+
+	// Only used with a voice gate. `mHeld` is a ring of copies of the most
+	// recent frames that were left out, oldest at `mHeldStart`.
+	std::unique_ptr<VoiceGate> mGate;
+	std::vector<PcmFrame> mHeld;
+	size_t mHeldStart = 0;
+	size_t mHeldCount = 0;
+	// Whether the gate has been asked about the frame at the front of the
+	// PCM queue yet, and what it said. The frame can't be taken until the
+	// held frames have all been encoded, which might take more than one go.
+	bool mGateDecided = false;
+	bool mGateOpen = false;
+	std::atomic<uint64_t> mGatedFrames{0};
+
+	StageStats mConvertStats;
+	StageStats mEncodeStats;
+	StageStats mMuxStats;
+	std::atomic<uint64_t> mOutputBytes{0};
+
+	std::atomic<bool> mStopping{false};
+	std::atomic<bool> mFailed{false};
+};
+
+// Writes the packets from a set of pipelines on its own thread, so that slow
+// disk writes only delay encoding once the packet queues are full.
+//
+// If `interleave` is set the pipelines are writing tracks to the same file, so
+// the packets are written in timestamp order. That means waiting until every
+// pipeline has a packet ready (or has finished).
+class MuxThread
+{
+public:
+	MuxThread(std::vector<Pipeline*> pipelines, bool interleave, Semaphore& workReady, Semaphore& packetReady);
+	~MuxThread();
+
+	void start();
+
+	// Wait for all the pipelines to finish and their packets to be written.
+	void join();
+
+	// True if writing failed for any of the pipelines.
+	bool failed() const;
+
+private:
+	MuxThread(const MuxThread&) = delete;
+	MuxThread& operator=(const MuxThread&) = delete;
+
+	void run();
+
+	// Write (or discard, if it has failed) the next packet from a pipeline.
+	void write(size_t index);
+
+	std::vector<Pipeline*> mPipelines;
+	// Whether the start time has been set for each pipeline's writer.
+	std::vector<bool> mStarted;
+	// Whether writing has failed for each pipeline.
+	std::vector<bool> mPipelineFailed;
+	bool mInterleave;
+	Semaphore& mWorkReady;
+	Semaphore& mPacketReady;
+
+	std::thread mThread;
+	std::atomic<bool> mFailed{false};
+};
@@ -0,0 +1,230 @@
+#include "PrerollContainer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+using namespace std;
+
+// How many of the buffered packets to write for each new one once it has
+// been triggered. This writes minutes of backlog in a few seconds without
+// holding up any one frame for long.
+static const int DrainPerFrame = 64;
+
+// For sizing the buffer: at most this many packets per second per track
+// (10 ms frames), and VBR may go up to this many times the average bitrate.
+static const uint64_t MaxPacketsPerSecond = 100;
+static const uint64_t BitrateHeadroom = 2;
+
+// Insert the local date and time before the extension of `filename`.
+static string timestampedFilename(const string& filename)
+{
+	time_t now = time(nullptr);
+	char date[32];
+	strftime(date, sizeof(date), "-%Y%m%d-%H%M%S", localtime(&now));
+	return Container::insertBeforeExtension(filename, date);
+}
+
+PrerollContainer::PrerollContainer(Format format, uint64_t prerollSeconds, uint64_t postrollSeconds, uint64_t bytesPerSecond)
+    : mFormat(format),
+      mPreroll(prerollSeconds * 1000000000),
+      mPostroll(postrollSeconds * 1000000000),
+      mBytesPerSecond(bytesPerSecond)
+{
+}
+
+PrerollContainer::~PrerollContainer()
+{
+	close();
+}
+
+bool PrerollContainer::open(const string& filename)
+{
+	mFilename = filename;
+	mFinisher.reset();
+	return true;
+}
+
+bool PrerollContainer::openLive(const string& output, int flushMilliseconds)
+{
+	cerr << "Live streams can't have a pre-roll." << endl;
+	return false;
+}
+
+uint64_t PrerollContainer::addOpusTrack(int samplingRate, int channels, const vector<uint8_t>& opusHead, int maxPacketLength)
+{
+	if (mPackets)
+		return 0;
+
+	Track track = {samplingRate, channels, opusHead, maxPacketLength, 0};
+	mTracks.push_back(track);
+	mPacket.resize(max<size_t>(mPacket.size(), maxPacketLength));
+	return mTracks.size();
+}
+
+void PrerollContainer::trigger()
+{
+	mTriggered = true;
+}
+
+bool PrerollContainer::writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp)
+{
+	if (trackNumber == 0 || trackNumber > mTracks.size() || length <= 0)
+		return false;
+
+	if (!mPackets)
+	{
+		uint64_t bytesPerSecond = BitrateHeadroom * mBytesPerSecond + mTracks.size() * MaxPacketsPerSecond * sizeof(PacketHeader);
+		mPackets.reset(new RingBuffer<uint8_t>(max<uint64_t>(mPreroll / 1000000000, 1) * bytesPerSecond));
+	}
+
+	size_t needed = sizeof(PacketHeader) + length;
+	if (needed > mPackets->capacity())
+		return true;
+
+	// Make room, which only drops packets early if the bitrate is well over
+	// what was expected. A packet that couldn't be written is gone already,
+	// and the file is finished like it is when the backlog is written below.
+	while (mPackets->free() < needed)
+	{
+		if (!mCurrent)
+			dropOldest();
+		else if (!writeOldest())
+		{
+			cerr << "Error writing " << mCurrentFilename << endl;
+			finishFile();
+		}
+	}
+
+	PacketHeader header = {timestamp, static_cast<uint32_t>(trackNumber), static_cast<uint32_t>(length)};
+	mPackets->push_n(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+	mPackets->push_n(data, length);
+
+	if (mTriggered.exchange(false))
+	{
+		// If the file can't be written, carry on waiting for the next trigger.
+		if (!mCurrent && !startFile())
+			mCurrent.reset();
+		mStopAt = mPostroll > 0 ? timestamp + mPostroll : 0;
+	}
+
+	if (!mCurrent)
+	{
+		// Forget anything older than the pre-roll.
+		PacketHeader oldest;
+		while (peekHeader(oldest) && oldest.timestamp + mPreroll < timestamp)
+			dropOldest();
+		return true;
+	}
+
+	// Write the backlog a bit at a time; once it has caught up this writes
+	// each packet as it arrives.
+	for (int i = 0; i < DrainPerFrame && !mPackets->empty(); ++i)
+	{
+		if (!writeOldest())
+		{
+			cerr << "Error writing " << mCurrentFilename << endl;
+			finishFile();
+			return true;
+		}
+	}
+
+	if (mStopAt != 0 && timestamp >= mStopAt && mPackets->empty())
+		finishFile();
+	return true;
+}
+
+bool PrerollContainer::startFile()
+{
+	string filename = timestampedFilename(mFilename);
+	mCurrentFilename = filename;
+	mCurrent.reset(Container::create(mFormat, filename));
+	if (!mCurrent->open(filename))
+	{
+		cerr << "Unable to open output file: " << filename << endl;
+		return false;
+	}
+	mCurrent->setCheckpointInterval(mCheckpointInterval);
+
+	for (Track& track : mTracks)
+	{
+		track.number = mCurrent->addOpusTrack(track.samplingRate, track.channels, track.opusHead, track.maxPacketLength);
+		if (track.number == 0)
+		{
+			cerr << "Unable to add a track to " << filename << endl;
+			return false;
+		}
+	}
+
+	PacketHeader oldest;
+	mFileStart = peekHeader(oldest) ? oldest.timestamp : 0;
+
+	cerr << "Writing " << filename << endl;
+	return true;
+}
+
+void PrerollContainer::finishFile()
+{
+	mFinisher.finish(move(mCurrent), mCurrentFilename);
+}
+
+bool PrerollContainer::peekHeader(PacketHeader& header)
+{
+	RingBuffer<uint8_t>::Region region = mPackets->peek(sizeof(header));
+	if (region.size() < sizeof(header))
+		return false;
+
+	uint8_t* bytes = reinterpret_cast<uint8_t*>(&header);
+	memcpy(bytes, region.first, region.first_size);
+	memcpy(bytes + region.first_size, region.second, region.second_size);
+	return true;
+}
+
+void PrerollContainer::dropOldest()
+{
+	PacketHeader header;
+	if (peekHeader(header))
+		mPackets->consume(sizeof(header) + header.length);
+}
+
+bool PrerollContainer::writeOldest()
+{
+	PacketHeader header;
+	if (!peekHeader(header))
+		return true;
+
+	mPackets->consume(sizeof(header));
+	if (mPacket.size() < header.length)
+		mPacket.resize(header.length);
+	mPackets->pop_n(mPacket.data(), header.length);
+
+	return mCurrent->writeFrame(mTracks[header.track - 1].number, mPacket.data(), header.length, header.timestamp - mFileStart);
+}
+
+void PrerollContainer::setCheckpointInterval(int milliseconds)
+{
+	mCheckpointInterval = milliseconds;
+	if (mCurrent)
+		mCurrent->setCheckpointInterval(milliseconds);
+}
+
+uint64_t PrerollContainer::bytesWritten() const
+{
+	return mCurrent ? mCurrent->bytesWritten() : 0;
+}
+
+bool PrerollContainer::close()
+{
+	bool success = true;
+	if (mCurrent)
+	{
+		while (!mPackets->empty() && success)
+			success = writeOldest();
+		success = mCurrent->close() && success;
+		mCurrent.reset();
+	}
+	if (mPackets)
+		mPackets->consume(mPackets->size());
+	return mFinisher.wait() && success;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Container.h"
+#include "ContainerFinisher.h"
+#include "RingBuffer.h"
+
+// A Container that keeps the last few minutes of packets in memory and only
+// writes a file when `trigger()` is called. The file starts with what was
+// kept, and then carries on with the live packets. This is for leaving a
+// recorder running all the time to catch things that have already happened
+// by the time anybody notices.
+//
+// The packets are kept encoded, so a minute is only about 60 KB at 8 kbps.
+// They are copied into one ring buffer that is allocated once, on the first
+// frame, so nothing is allocated while waiting. If they don't fit (which
+// only happens if the bitrate is far more than was said) the oldest are
+// dropped sooner.
+//
+// Each trigger starts a file named after the filename given to `open()` with
+// the date and time added before the extension, e.g. rec-20240131-153000.webm.
+// Its timestamps start from 0. With a post-roll the file is finished (on a
+// background thread) that long after the last trigger, and it goes back to
+// waiting; otherwise it keeps writing until it is closed.
+class PrerollContainer : public Container
+{
+public:
+	// Keep `prerollSeconds` of packets. `bytesPerSecond` is the average
+	// bitrate of all the tracks together, for sizing the buffer.
+	PrerollContainer(Format format, uint64_t prerollSeconds, uint64_t postrollSeconds, uint64_t bytesPerSecond);
+	virtual ~PrerollContainer();
+
+	// Nothing is written until a trigger, so this can't fail.
+	virtual bool open(const std::string& filename) override;
+	// Live streams can't be held back, so this always fails.
+	virtual bool openLive(const std::string& output, int flushMilliseconds) override;
+	virtual uint64_t addOpusTrack(int samplingRate, int channels, const std::vector<uint8_t>& opusHead, int maxPacketLength) override;
+	virtual bool writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp) override;
+	// For every file.
+	virtual void setCheckpointInterval(int milliseconds) override;
+	// For the current file, or 0 if there isn't one.
+	virtual uint64_t bytesWritten() const override;
+	// Finishes the current file, if there is one, with everything that is
+	// buffered. Returns false if any file couldn't be finished.
+	virtual bool close() override;
+
+	// Start saving, or carry on for longer if it already is. This can be
+	// called from any thread; it takes effect on the next frame.
+	void trigger();
+
+private:
+	PrerollContainer(const PrerollContainer&) = delete;
+	PrerollContainer& operator=(const PrerollContainer&) = delete;
+
+	struct Track
+	{
+		int samplingRate;
+		int channels;
+		std::vector<uint8_t> opusHead;
+		int maxPacketLength;
+		// Its number in the current file.
+		uint64_t number;
+	};
+
+	// What is stored in the ring buffer before each packet.
+	struct PacketHeader
+	{
+		uint64_t timestamp;
+		uint32_t track;
+		uint32_t length;
+	};
+
+	// Open a new file and add the tracks to it. Prints an error and returns
+	// false on failure.
+	bool startFile();
+
+	// Finish the current file in the background.
+	void finishFile();
+
+	// Read the oldest packet's header. Returns false if there are none.
+	bool peekHeader(PacketHeader& header);
+	// Drop the oldest packet.
+	void dropOldest();
+	// Write the oldest packet to the current file and remove it.
+	bool writeOldest();
+
+	Format mFormat;
+	uint64_t mPreroll;
+	uint64_t mPostroll;
+	uint64_t mBytesPerSecond;
+	int mCheckpointInterval = 0;
+
+	std::string mFilename;
+	std::vector<Track> mTracks;
+
+	// Allocated on the first frame, when the number of tracks is known.
+	std::unique_ptr<RingBuffer<uint8_t>> mPackets;
+	std::vector<uint8_t> mPacket;
+
+	std::atomic<bool> mTriggered{false};
+	// The file being written, if there is one.
+	std::unique_ptr<Container> mCurrent;
+	std::string mCurrentFilename;
+	// Timestamp of the first packet in it, which becomes 0.
+	uint64_t mFileStart = 0;
+	// When to stop writing it, or 0 to keep going.
+	uint64_t mStopAt = 0;
+
+	// Finishes the previous file.
+	ContainerFinisher mFinisher;
+};
@@ -0,0 +1,117 @@
+#include "ProcessStats.h"
+
+#if defined(_WIN32)
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+#if defined(__linux__)
+#include <cstdio>
+#endif
+
+#if defined(_WIN32)
+
+static double fileTimeSeconds(const FILETIME& time)
+{
+	ULARGE_INTEGER ticks;
+	ticks.LowPart = time.dwLowDateTime;
+	ticks.HighPart = time.dwHighDateTime;
+	// In units of 100 ns.
+	return ticks.QuadPart * 1e-7;
+}
+
+double ProcessCpuSeconds()
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return 0.0;
+	return fileTimeSeconds(kernel) + fileTimeSeconds(user);
+}
+
+double ThreadCpuSeconds()
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+		return 0.0;
+	return fileTimeSeconds(kernel) + fileTimeSeconds(user);
+}
+
+uint64_t PeakRssBytes()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+}
+
+void ResetPeakRss()
+{
+}
+
+#else
+
+static double clockSeconds(clockid_t clock)
+{
+	timespec time;
+	if (clock_gettime(clock, &time) != 0)
+		return 0.0;
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+double ProcessCpuSeconds()
+{
+	return clockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+double ThreadCpuSeconds()
+{
+	return clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+uint64_t PeakRssBytes()
+{
+#if defined(__linux__)
+	// VmHWM can be reset, unlike ru_maxrss.
+	FILE* status = fopen("/proc/self/status", "r");
+	if (status != nullptr)
+	{
+		char line[256];
+		unsigned long long kilobytes = 0;
+		bool found = false;
+		while (!found && fgets(line, sizeof(line), status) != nullptr)
+			found = sscanf(line, "VmHWM: %llu kB", &kilobytes) == 1;
+		fclose(status);
+		if (found)
+			return kilobytes * 1024;
+	}
+#endif
+
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#if defined(__APPLE__)
+	return usage.ru_maxrss;
+#else
+	// Linux and the BSDs give it in kilobytes.
+	return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+void ResetPeakRss()
+{
+#if defined(__linux__)
+	// Writing 5 resets the peak resident set size (Linux 4.0 and later).
+	FILE* clearRefs = fopen("/proc/self/clear_refs", "w");
+	if (clearRefs != nullptr)
+	{
+		fputs("5", clearRefs);
+		fclose(clearRefs);
+	}
+#endif
+}
+
+#endif
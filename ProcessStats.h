@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+// Resource usage of this process, for benchmarking.
+
+// CPU time used by the whole process, or by the calling thread, in seconds.
+double ProcessCpuSeconds();
+double ThreadCpuSeconds();
+
+// The most memory the process has had resident, in bytes, or 0 if it can't
+// be found out.
+uint64_t PeakRssBytes();
+
+// Start measuring PeakRssBytes() again from the current usage. Only Linux can
+// do this; elsewhere it is the peak since the process started.
+void ResetPeakRss();
@@ -0,0 +1,268 @@
+#include "Resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define RESAMPLER_SSE 1
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RESAMPLER_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// Limits on the size of the filter table. Common rates have far fewer phases
+// (44100 -> 48000 is 160), so this only rules out very odd ratios.
+static const int MaxPhases = 1024;
+static const int MaxTaps = 512;
+
+// The filter length is a multiple of this so the dot product doesn't need a tail.
+static const int TapMultiple = 8;
+
+static const double Pi = 3.14159265358979323846;
+
+// The filter design for each quality.
+struct QualitySettings
+{
+	// Zero crossings of the sinc on each side of the centre (when not
+	// downsampling).
+	int zeroCrossings;
+	// Kaiser window shape. Higher means more stopband attenuation but a
+	// wider transition band.
+	double beta;
+	// Where the passband ends, as a fraction of the lower Nyquist frequency.
+	double rolloff;
+};
+
+static const QualitySettings Settings[] = {
+	{8, 6.0, 0.85},   // Quality_Low
+	{16, 8.0, 0.91},  // Quality_Medium
+	{32, 10.0, 0.95}, // Quality_High
+};
+
+static int gcd(int a, int b)
+{
+	while (b != 0)
+	{
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Zeroth order modified Bessel function of the first kind, for the window.
+static double besselI0(double x)
+{
+	double sum = 1.0;
+	double term = 1.0;
+	for (int k = 1; k < 50; ++k)
+	{
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+// Dot product of `n` floats, where `n` is a multiple of TapMultiple.
+static inline float dot(const float* a, const float* b, int n)
+{
+#if RESAMPLER_SSE
+	__m128 s0 = _mm_setzero_ps();
+	__m128 s1 = _mm_setzero_ps();
+	for (int k = 0; k < n; k += 8)
+	{
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + k + 4), _mm_loadu_ps(b + k + 4)));
+	}
+	s0 = _mm_add_ps(s0, s1);
+	s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+	s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+	return _mm_cvtss_f32(s0);
+#elif RESAMPLER_NEON
+	float32x4_t s0 = vdupq_n_f32(0.0f);
+	float32x4_t s1 = vdupq_n_f32(0.0f);
+	for (int k = 0; k < n; k += 8)
+	{
+		s0 = vmlaq_f32(s0, vld1q_f32(a + k), vld1q_f32(b + k));
+		s1 = vmlaq_f32(s1, vld1q_f32(a + k + 4), vld1q_f32(b + k + 4));
+	}
+	s0 = vaddq_f32(s0, s1);
+#if defined(__aarch64__)
+	return vaddvq_f32(s0);
+#else
+	float32x2_t s = vadd_f32(vget_low_f32(s0), vget_high_f32(s0));
+	return vget_lane_f32(vpadd_f32(s, s), 0);
+#endif
+#else
+	// Several sums so the compiler can vectorise it.
+	float s[TapMultiple] = {};
+	for (int k = 0; k < n; k += TapMultiple)
+	{
+		for (int j = 0; j < TapMultiple; ++j)
+			s[j] += a[k + j] * b[k + j];
+	}
+	float sum = 0.0f;
+	for (int j = 0; j < TapMultiple; ++j)
+		sum += s[j];
+	return sum;
+#endif
+}
+
+Resampler::Resampler(int inputRate, int outputRate, int channels, Quality quality, size_t maxWrite)
+    : mChannels(channels)
+{
+	if (inputRate <= 0 || outputRate <= 0 || channels <= 0)
+		return;
+
+	int divisor = gcd(inputRate, outputRate);
+	mUp = outputRate / divisor;
+	mDown = inputRate / divisor;
+	if (mUp > MaxPhases)
+		return;
+
+	const QualitySettings& settings = Settings[quality];
+
+	// When downsampling the cutoff is below the input's Nyquist frequency,
+	// so the sinc is wider and the filter needs more taps for the same
+	// number of zero crossings.
+	double ratio = min(1.0, static_cast<double>(outputRate) / inputRate);
+	double cutoff = ratio * settings.rolloff;
+	int halfTaps = static_cast<int>(ceil(settings.zeroCrossings / ratio));
+	mTaps = min(MaxTaps, (2 * halfTaps + TapMultiple - 1) / TapMultiple * TapMultiple);
+
+	// Tap k of phase p is for the input sample at (k - centre), relative to
+	// the output's position of p / mUp past the centre.
+	const int centre = mTaps / 2 - 1;
+	const double halfWidth = mTaps / 2.0;
+	const double windowScale = 1.0 / besselI0(settings.beta);
+
+	mFilter.resize(static_cast<size_t>(mUp) * mTaps);
+	for (int p = 0; p < mUp; ++p)
+	{
+		float* phase = &mFilter[static_cast<size_t>(p) * mTaps];
+		double sum = 0.0;
+		for (int k = 0; k < mTaps; ++k)
+		{
+			double x = k - centre - static_cast<double>(p) / mUp;
+			double arg = cutoff * x;
+			double sinc = arg == 0.0 ? 1.0 : sin(Pi * arg) / (Pi * arg);
+			double w = x / halfWidth;
+			double window = w * w < 1.0 ? besselI0(settings.beta * sqrt(1.0 - w * w)) * windowScale : 0.0;
+			double h = cutoff * sinc * window;
+			phase[k] = static_cast<float>(h);
+			sum += h;
+		}
+		// Make the gain exactly 1 at DC for every phase.
+		for (int k = 0; k < mTaps; ++k)
+			phase[k] = static_cast<float>(phase[k] / sum);
+	}
+
+	// Room for the filter's history, the input that is waiting for enough
+	// following samples, and one write.
+	mCapacity = 2 * mTaps + maxWrite + mDown / mUp + 1;
+	mInput.assign(mCapacity * channels, 0.0f);
+
+	reset();
+}
+
+void Resampler::reset()
+{
+	if (!valid())
+		return;
+
+	// Start with silence before the first sample, so the first output is
+	// exactly at the first input.
+	fill(mInput.begin(), mInput.end(), 0.0f);
+	mFill = mTaps / 2 - 1;
+	mIndex = mTaps / 2 - 1;
+	mPhase = 0;
+}
+
+bool Resampler::valid() const
+{
+	return mTaps > 0;
+}
+
+int Resampler::taps() const
+{
+	return mTaps;
+}
+
+void Resampler::compact()
+{
+	// Everything before the first tap of the next output can go.
+	size_t drop = min(mIndex - (mTaps / 2 - 1), mFill);
+	if (drop == 0)
+		return;
+
+	for (int ch = 0; ch < mChannels; ++ch)
+	{
+		float* buffer = &mInput[ch * mCapacity];
+		memmove(buffer, buffer + drop, (mFill - drop) * sizeof(float));
+	}
+	mFill -= drop;
+	mIndex -= drop;
+}
+
+size_t Resampler::space() const
+{
+	if (!valid())
+		return 0;
+	size_t drop = min(mIndex - (mTaps / 2 - 1), mFill);
+	return mCapacity - (mFill - drop);
+}
+
+size_t Resampler::write(const float* input, size_t frames)
+{
+	if (!valid())
+		return 0;
+
+	compact();
+
+	size_t n = min(frames, mCapacity - mFill);
+	for (int ch = 0; ch < mChannels; ++ch)
+	{
+		float* buffer = &mInput[ch * mCapacity + mFill];
+		for (size_t i = 0; i < n; ++i)
+			buffer[i] = input[i * mChannels + ch];
+	}
+	mFill += n;
+	return n;
+}
+
+size_t Resampler::available() const
+{
+	if (!valid())
+		return 0;
+
+	// Output n is at input position mIndex + (mPhase + n * mDown) / mUp and
+	// needs the input up to mTaps / 2 after that.
+	int64_t last = static_cast<int64_t>(mFill) - mTaps / 2 - 1 - static_cast<int64_t>(mIndex);
+	if (last < 0)
+		return 0;
+	return static_cast<size_t>(((last + 1) * mUp - mPhase + mDown - 1) / mDown);
+}
+
+size_t Resampler::read(float* output, size_t frames)
+{
+	size_t n = min(frames, available());
+	for (size_t i = 0; i < n; ++i)
+	{
+		const float* filter = &mFilter[static_cast<size_t>(mPhase) * mTaps];
+		size_t start = mIndex - (mTaps / 2 - 1);
+		for (int ch = 0; ch < mChannels; ++ch)
+			output[i * mChannels + ch] = dot(filter, &mInput[ch * mCapacity + start], mTaps);
+
+		mPhase += mDown;
+		mIndex += mPhase / mUp;
+		mPhase %= mUp;
+	}
+	return n;
+}
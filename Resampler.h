@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// A polyphase windowed-sinc resampler for converting from whatever rate the
+// device runs at to one of the Opus rates, e.g. 44.1 kHz to 48 kHz.
+//
+// The ratio between the rates is reduced to L/M, and the filter is stored as
+// L phases of `taps()` coefficients each, so each output sample is one dot
+// product per channel. The input is kept per channel so the dot products are
+// over contiguous memory and use SIMD.
+//
+// It is streaming: `write()` some input, then `read()` as much output as
+// `available()` says. It doesn't allocate after construction. The output is
+// aligned with the input, i.e. the filter delay is compensated for.
+class Resampler
+{
+public:
+	// Longer filters have a sharper cutoff and less aliasing but cost more.
+	enum Quality
+	{
+		Quality_Low,
+		Quality_Medium,
+		Quality_High,
+	};
+
+	// `maxWrite` is the most frames that will be passed to each `write()`.
+	Resampler(int inputRate, int outputRate, int channels, Quality quality, size_t maxWrite = 1024);
+
+	// False if the rates are unsupported, e.g. the reduced ratio is so
+	// awkward that the filter table would be huge.
+	bool valid() const;
+
+	// Number of input frames that `write()` can take right now. It is always
+	// at least `maxWrite` once `available()` output frames have been read.
+	size_t space() const;
+
+	// Add up to `space()` interleaved frames of input. Returns the number
+	// that were taken.
+	size_t write(const float* input, size_t frames);
+
+	// Number of output frames that can be read.
+	size_t available() const;
+
+	// Read up to `frames` interleaved frames of output. Returns the number read.
+	size_t read(float* output, size_t frames);
+
+	// Filter length in input samples.
+	int taps() const;
+
+	// Forget all the input so it can be used for another stream, without
+	// designing the filter again.
+	void reset();
+
+private:
+	// Drop input that is no longer needed from the start of the buffers.
+	void compact();
+
+	int mChannels = 0;
+	// Output rate / input rate = mUp / mDown, in lowest terms.
+	int mUp = 1;
+	int mDown = 1;
+	int mTaps = 0;
+
+	// mUp phases of mTaps coefficients.
+	std::vector<float> mFilter;
+
+	// The input for each channel, one after the other, each mCapacity long.
+	std::vector<float> mInput;
+	size_t mCapacity = 0;
+	// Number of samples in each channel's buffer.
+	size_t mFill = 0;
+
+	// The next output is at input position mIndex + mPhase / mUp, where
+	// mIndex is an index into the buffers.
+	size_t mIndex = 0;
+	int mPhase = 0;
+};
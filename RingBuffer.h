@@ -3,109 +3,241 @@
 #include <vector>
 #include <atomic>
 #include <cstddef>
+#include <algorithm>
 
 using std::size_t;
 
-// This is a lock-free content-aware ring buffer.
-// It's thread-safe if there is one writer and one reader.
-// TODO: Better guarantees for multiple readers and writers.
-// TODO: Use less conservative memory ordering guarantees.
+// This is a wait-free single-producer single-consumer ring buffer. It's
+// thread-safe if there is exactly one writer thread and one reader thread.
+//
+// The capacity is always a power of two so that the read and write positions
+// can be free-running counters that are masked to get the index into the
+// storage. `write - read` is the number of elements in the buffer, so all of
+// it can be used (there's no need for a spare element to tell full from empty).
+//
+// Each side only ever stores to its own position, and keeps a cached copy
+// of the other side's position so that it only needs to touch the other
+// side's cache line when the cached value says there isn't enough room or data.
+//
+// As well as single element `push()` and `pop()` there are bulk versions, and
+// a way to get direct access to the (up to two) contiguous regions of the
+// underlying storage, so that data can be written and read in place. T
+// should be trivially copyable for the bulk functions.
 template <typename T>
 class RingBuffer
 {
 public:
-	explicit RingBuffer(size_t capacity) : data(capacity + 1), len(capacity + 1)
+	// A view of some elements in the buffer. Because it may wrap around the end
+	// of the storage it consists of up to two contiguous runs. `second` is only
+	// used if `first` is not enough.
+	struct Region
+	{
+		T* first = nullptr;
+		size_t first_size = 0;
+		T* second = nullptr;
+		size_t second_size = 0;
+
+		// Total number of elements in the region.
+		size_t size() const
+		{
+			return first_size + second_size;
+		}
+	};
+
+	// The capacity is rounded up to the next power of two.
+	explicit RingBuffer(size_t capacity) : data(roundUpToPowerOfTwo(capacity)), mask(data.size() - 1)
 	{
 	}
-	
+
 	// How many elements can this store in total?
 	size_t capacity() const
 	{
-		return len - 1;
+		return mask + 1;
 	}
-	
+
 	// How many more elements can be pushed before it is full?
 	size_t free() const
 	{
 		return capacity() - size();
 	}
-	
+
 	// How many elements can be popped before it is empty?
 	size_t size() const
 	{
-		size_t r = read.load();
-		size_t w = write.load();
-		return (w - r + len) % len;
+		// Load `read` first; `write` can only have moved further ahead of it.
+		size_t r = read.load(std::memory_order_acquire);
+		size_t w = write.load(std::memory_order_acquire);
+		return w - r;
 	}
-	
+
 	// Can any more elements be pushed?
 	bool full() const
 	{
-		size_t r = read.load();
-		size_t w = write.load();
-		return (w + 1) % len == r;
+		return size() == capacity();
 	}
-	
+
 	// Can any elements be popped?
 	bool empty() const
 	{
-		size_t r = read.load();
-		size_t w = write.load();
-		return w == r;
+		return size() == 0;
 	}
-	
+
 	// Read the oldest element and remove it. Returns false
-	// if there were none.
+	// if there were none. Only call this from the reader thread.
 	bool pop(T& x)
 	{
-		size_t r = read.load();
-		size_t w = write.load();
-		if (w == r)
-			return false;
-		
-		x = data[r];
-		
-		// Atomically increment and modulo `read`.
-		size_t new_r;
-		do
+		size_t r = read.load(std::memory_order_relaxed);
+		if (r == cached_write)
 		{
-			new_r = (r + 1) % len;
-		} while (!read.compare_exchange_weak(r, new_r));
-		
+			cached_write = write.load(std::memory_order_acquire);
+			if (r == cached_write)
+				return false;
+		}
+
+		x = data[r & mask];
+
+		read.store(r + 1, std::memory_order_release);
 		return true;
 	}
 
-	// Add an element. Returns false if there is no space.
+	// Add an element. Returns false if there is no space. Only call
+	// this from the writer thread.
 	bool push(const T& x)
 	{
-		size_t w = write.load();
-		size_t r = read.load();
-		if ((w + 1) % len == r)
-			return false;
-		
-		data[w] = x;
-		
-		// Atomically increment and modulo `write`.
-		size_t new_w;
-		do
+		size_t w = write.load(std::memory_order_relaxed);
+		if (w - cached_read == capacity())
 		{
-			new_w = (w + 1) % len;
-		} while (!write.compare_exchange_weak(w, new_w));
+			cached_read = read.load(std::memory_order_acquire);
+			if (w - cached_read == capacity())
+				return false;
+		}
 
+		data[w & mask] = x;
+
+		write.store(w + 1, std::memory_order_release);
 		return true;
 	}
-	
+
+	// Add up to `n` elements from `x`. Returns the number actually added, which
+	// is less than `n` if there isn't enough space.
+	size_t push_n(const T* x, size_t n)
+	{
+		Region region = reserve(n);
+		std::copy(x, x + region.first_size, region.first);
+		std::copy(x + region.first_size, x + region.size(), region.second);
+		commit(region.size());
+		return region.size();
+	}
+
+	// Read and remove up to `n` of the oldest elements into `x`. Returns the
+	// number actually read, which is less than `n` if there weren't enough.
+	size_t pop_n(T* x, size_t n)
+	{
+		Region region = peek(n);
+		std::copy(region.first, region.first + region.first_size, x);
+		std::copy(region.second, region.second + region.second_size, x + region.first_size);
+		consume(region.size());
+		return region.size();
+	}
+
+	// Get direct access to the free space so it can be written in place. The
+	// region is at most `n` elements long (less if there is not enough space).
+	// Nothing is visible to the reader until `commit()` is called. Only call
+	// this from the writer thread.
+	Region reserve(size_t n)
+	{
+		size_t w = write.load(std::memory_order_relaxed);
+		size_t available = capacity() - (w - cached_read);
+		if (available < n)
+		{
+			cached_read = read.load(std::memory_order_acquire);
+			available = capacity() - (w - cached_read);
+		}
+		return region(w, std::min(n, available));
+	}
+
+	// Make `n` elements that were written into the region returned by
+	// `reserve()` available to the reader. `n` must not be more than the size
+	// of that region.
+	void commit(size_t n)
+	{
+		size_t w = write.load(std::memory_order_relaxed);
+		write.store(w + n, std::memory_order_release);
+	}
+
+	// Get direct access to up to `n` of the oldest elements so they can be
+	// read in place. They are not removed until `consume()` is called. Only
+	// call this from the reader thread.
+	Region peek(size_t n = static_cast<size_t>(-1))
+	{
+		size_t r = read.load(std::memory_order_relaxed);
+		size_t available = cached_write - r;
+		if (available < n)
+		{
+			cached_write = write.load(std::memory_order_acquire);
+			available = cached_write - r;
+		}
+		return region(r, std::min(n, available));
+	}
+
+	// Remove `n` elements that were read via the region returned by `peek()`.
+	// `n` must not be more than the size of that region.
+	void consume(size_t n)
+	{
+		size_t r = read.load(std::memory_order_relaxed);
+		read.store(r + n, std::memory_order_release);
+	}
+
 private:
+	// Assume 64 byte cache lines. Some ARM cores use 128 but 64 still keeps
+	// the two sides out of each other's way most of the time.
+	static const size_t CacheLineSize = 64;
+
+	static size_t roundUpToPowerOfTwo(size_t x)
+	{
+		size_t p = 1;
+		while (p < x)
+			p <<= 1;
+		return p;
+	}
+
+	// The region of `n` elements starting at position `pos`, split at the end
+	// of the storage.
+	Region region(size_t pos, size_t n)
+	{
+		size_t start = pos & mask;
+		Region rgn;
+		rgn.first = data.data() + start;
+		rgn.first_size = std::min(n, capacity() - start);
+		rgn.second = data.data();
+		rgn.second_size = n - rgn.first_size;
+		return rgn;
+	}
+
+	// These are never modified after construction, but both sides read them
+	// all the time, so keep them away from the lines that are written.
 	std::vector<T> data;
-	
-	// Actual length of data. It is one more than the capacity because
-	// it is never 100% full (so we can easily distinguish the full and
-	// empty cases).
-	size_t len;
-	
-	// Where to write to next. If write = read then the buffer is empty.
-	// If write = read - 1 then it is full.
-	std::atomic<size_t> write{0};
-	// Where to read from next.
+	size_t mask;
+
+	// The two sides are kept on separate cache lines with padding rather than
+	// alignas(), because C++11's `new` ignores extended alignment and these
+	// are often heap allocated.
+	char padding0[CacheLineSize];
+
+	// Where to read from next (before masking). Only the reader stores to it.
 	std::atomic<size_t> read{0};
+	// The reader's copy of `write`. It may be out of date, but never ahead.
+	size_t cached_write = 0;
+
+	char padding1[CacheLineSize];
+
+	// Where to write to next (before masking). If write = read then the buffer
+	// is empty. If write = read + capacity() then it is full. Only the writer
+	// stores to it.
+	std::atomic<size_t> write{0};
+	// The writer's copy of `read`. It may be out of date, but never ahead.
+	size_t cached_read = 0;
+
+	// Keep whatever comes after this object off the writer's line.
+	char padding2[CacheLineSize];
 };
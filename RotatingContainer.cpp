@@ -0,0 +1,150 @@
+#include "RotatingContainer.h"
+
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+// Insert `-<index>` before the extension of `filename`, padded so that the
+// files sort in order.
+static string segmentFilename(const string& filename, int index)
+{
+	char number[16];
+	snprintf(number, sizeof(number), "-%04d", index);
+	return Container::insertBeforeExtension(filename, number);
+}
+
+RotatingContainer::RotatingContainer(Format format, uint64_t maxSeconds, uint64_t maxBytes)
+    : mFormat(format), mMaxDuration(maxSeconds * 1000000000), mMaxBytes(maxBytes)
+{
+}
+
+RotatingContainer::~RotatingContainer()
+{
+	close();
+}
+
+bool RotatingContainer::open(const string& filename)
+{
+	mFilename = filename;
+	mIndex = 0;
+	mNextRotation = 0;
+	mFinisher.reset();
+	return openNext(mCurrent);
+}
+
+bool RotatingContainer::openLive(const string& output, int flushMilliseconds)
+{
+	cerr << "Live streams can't be split into segments." << endl;
+	return false;
+}
+
+bool RotatingContainer::openNext(unique_ptr<Container>& container)
+{
+	// mIndex only moves on once the file is open, so that it always names
+	// the current file.
+	int index = mIndex + 1;
+	string filename = segmentFilename(mFilename, index);
+	container.reset(Container::create(mFormat, filename));
+	if (!container->open(filename))
+	{
+		cerr << "Unable to open output file: " << filename << endl;
+		return false;
+	}
+	container->setCheckpointInterval(mCheckpointInterval);
+
+	for (Track& track : mTracks)
+	{
+		// The encoder carries on from the last file, so there's nothing to
+		// skip at the start of this one.
+		vector<uint8_t> opusHead = track.opusHead;
+		if (index > 1 && opusHead.size() >= 12)
+		{
+			opusHead[10] = 0;
+			opusHead[11] = 0;
+		}
+
+		track.number = container->addOpusTrack(track.samplingRate, track.channels, opusHead, track.maxPacketLength);
+		if (track.number == 0)
+		{
+			cerr << "Unable to add a track to " << filename << endl;
+			return false;
+		}
+	}
+
+	mIndex = index;
+	cerr << "Writing " << filename << endl;
+	return true;
+}
+
+uint64_t RotatingContainer::addOpusTrack(int samplingRate, int channels, const vector<uint8_t>& opusHead, int maxPacketLength)
+{
+	if (!mCurrent)
+		return 0;
+
+	Track track = {samplingRate, channels, opusHead, maxPacketLength, 0};
+	track.number = mCurrent->addOpusTrack(samplingRate, channels, opusHead, maxPacketLength);
+	if (track.number == 0)
+		return 0;
+
+	mTracks.push_back(track);
+	return mTracks.size();
+}
+
+bool RotatingContainer::writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp)
+{
+	if (!mCurrent || trackNumber == 0 || trackNumber > mTracks.size())
+		return false;
+
+	if (mMaxDuration > 0 && mNextRotation == 0)
+		mNextRotation = timestamp + mMaxDuration;
+
+	bool tooLong = mNextRotation != 0 && timestamp >= mNextRotation;
+	bool tooBig = mMaxBytes > 0 && mCurrent->bytesWritten() >= mMaxBytes;
+	if (tooLong || tooBig)
+	{
+		if (!rotate())
+			return false;
+		while (mNextRotation != 0 && timestamp >= mNextRotation)
+			mNextRotation += mMaxDuration;
+	}
+
+	return mCurrent->writeFrame(mTracks[trackNumber - 1].number, data, length, timestamp);
+}
+
+bool RotatingContainer::rotate()
+{
+	string previousFilename = segmentFilename(mFilename, mIndex);
+	unique_ptr<Container> next;
+	if (!openNext(next))
+		return false;
+
+	// Files are normally long enough that the previous one has finished by
+	// the time this one is.
+	mFinisher.finish(move(mCurrent), previousFilename);
+	mCurrent = move(next);
+	return true;
+}
+
+void RotatingContainer::setCheckpointInterval(int milliseconds)
+{
+	mCheckpointInterval = milliseconds;
+	if (mCurrent)
+		mCurrent->setCheckpointInterval(milliseconds);
+}
+
+uint64_t RotatingContainer::bytesWritten() const
+{
+	return mCurrent ? mCurrent->bytesWritten() : 0;
+}
+
+bool RotatingContainer::close()
+{
+	bool success = true;
+	if (mCurrent)
+	{
+		success = mCurrent->close();
+		mCurrent.reset();
+	}
+	return mFinisher.wait() && success;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Container.h"
+#include "ContainerFinisher.h"
+
+// A Container that starts a new file whenever the current one has gone on
+// for long enough or got big enough, so that a recording that runs for days
+// isn't one huge file that is only finished at the end.
+//
+// The files are named after the filename given to `open()` with -0001,
+// -0002 etc. before the extension. The switch happens between two frames, so
+// every packet is in exactly one file, and the timestamps carry on from one
+// file to the next. The encoder isn't restarted, so the OpusHead pre-skip is
+// zero in all but the first file; nothing is cut from the start of them.
+//
+// Finishing a file (which for WebM means writing the cues and going back to
+// fill in sizes and the duration) is done on a background thread so that it
+// never holds up muxing.
+class RotatingContainer : public Container
+{
+public:
+	// A limit of 0 means there is no limit.
+	RotatingContainer(Format format, uint64_t maxSeconds, uint64_t maxBytes);
+	virtual ~RotatingContainer();
+
+	virtual bool open(const std::string& filename) override;
+	// Live streams can't be split, so this always fails.
+	virtual bool openLive(const std::string& output, int flushMilliseconds) override;
+	virtual uint64_t addOpusTrack(int samplingRate, int channels, const std::vector<uint8_t>& opusHead, int maxPacketLength) override;
+	virtual bool writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp) override;
+	// For every file.
+	virtual void setCheckpointInterval(int milliseconds) override;
+	// For the current file.
+	virtual uint64_t bytesWritten() const override;
+	// Finishes the current file, and waits for the previous one to finish.
+	// Returns false if any of them couldn't be finished.
+	virtual bool close() override;
+
+private:
+	RotatingContainer(const RotatingContainer&) = delete;
+	RotatingContainer& operator=(const RotatingContainer&) = delete;
+
+	struct Track
+	{
+		int samplingRate;
+		int channels;
+		std::vector<uint8_t> opusHead;
+		int maxPacketLength;
+		// Its number in the current file.
+		uint64_t number;
+	};
+
+	// Open the next file and add the tracks to it. Prints an error and
+	// returns false on failure.
+	bool openNext(std::unique_ptr<Container>& container);
+
+	// Switch to the next file and finish the current one in the background.
+	bool rotate();
+
+	Format mFormat;
+	uint64_t mMaxDuration;
+	uint64_t mMaxBytes;
+	int mCheckpointInterval = 0;
+
+	std::string mFilename;
+	// The number of the current file, from 1.
+	int mIndex = 0;
+	std::unique_ptr<Container> mCurrent;
+	std::vector<Track> mTracks;
+
+	// When to start the next file, or 0 before the first frame. Time limits
+	// are counted from the first frame so they don't drift.
+	uint64_t mNextRotation = 0;
+
+	// Finishes the previous file.
+	ContainerFinisher mFinisher;
+};
@@ -0,0 +1,714 @@
+#include "SampleConvert.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CONVERT_SSE2 1
+#define CONVERT_AVX2 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+// GCC and Clang only let you use AVX2 intrinsics in functions that are
+// compiled for it. MSVC lets you use them anywhere.
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+using namespace std;
+
+// The formats we can convert from, ignoring byte order.
+enum SourceFormat
+{
+	Src_S16,
+	Src_S24,
+	Src_S32,
+	Src_F32,
+	Src_Count,
+};
+
+// The native byte order formats are the ones that libsoundio says are.
+static const bool HostBigEndian = SoundIoFormatS16NE == SoundIoFormatS16BE;
+
+static bool sourceFormat(SoundIoFormat format, SourceFormat& source, bool& bigEndian)
+{
+	switch (format)
+	{
+	case SoundIoFormatS16LE: source = Src_S16; bigEndian = false; return true;
+	case SoundIoFormatS16BE: source = Src_S16; bigEndian = true; return true;
+	case SoundIoFormatS24LE: source = Src_S24; bigEndian = false; return true;
+	case SoundIoFormatS24BE: source = Src_S24; bigEndian = true; return true;
+	case SoundIoFormatS32LE: source = Src_S32; bigEndian = false; return true;
+	case SoundIoFormatS32BE: source = Src_S32; bigEndian = true; return true;
+	case SoundIoFormatFloat32LE: source = Src_F32; bigEndian = false; return true;
+	case SoundIoFormatFloat32BE: source = Src_F32; bigEndian = true; return true;
+	default: return false;
+	}
+}
+
+static size_t bytesPerSample(SourceFormat source)
+{
+	return source == Src_S16 ? 2 : 4;
+}
+
+// Scalar conversion. This handles either byte order, and is used for the ends
+// of buffers that are too short for the SIMD kernels, and for non-contiguous
+// samples.
+
+template <bool BigEndian>
+static inline uint32_t load16(const uint8_t* p)
+{
+	return BigEndian ? (uint32_t(p[0]) << 8 | p[1]) : (uint32_t(p[1]) << 8 | p[0]);
+}
+
+template <bool BigEndian>
+static inline uint32_t load32(const uint8_t* p)
+{
+	return BigEndian ? (uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3])
+	                 : (uint32_t(p[3]) << 24 | uint32_t(p[2]) << 16 | uint32_t(p[1]) << 8 | p[0]);
+}
+
+static inline int16_t floatToS16(float x)
+{
+	float y = x * 32768.0f;
+	// Written so that NaN ends up as -32768.
+	if (!(y > -32768.0f))
+		return -32768;
+	if (y > 32767.0f)
+		return 32767;
+	return static_cast<int16_t>(lrintf(y));
+}
+
+template <SourceFormat Source, bool BigEndian>
+struct Reader
+{
+	static const size_t Bytes = Source == Src_S16 ? 2 : 4;
+
+	static void read(const uint8_t* p, int16_t& out)
+	{
+		if (Source == Src_F32)
+			out = floatToS16(loadFloat(p));
+		else
+			out = static_cast<int16_t>(fullScale(p) >> 16);
+	}
+
+	static void read(const uint8_t* p, float& out)
+	{
+		if (Source == Src_F32)
+			out = loadFloat(p);
+		else
+			out = fullScale(p) * (1.0f / 2147483648.0f);
+	}
+
+private:
+	// Integer samples scaled up so that the sign bit is bit 31.
+	static int32_t fullScale(const uint8_t* p)
+	{
+		switch (Source)
+		{
+		case Src_S16: return static_cast<int32_t>(load16<BigEndian>(p) << 16);
+		case Src_S24: return static_cast<int32_t>(load32<BigEndian>(p) << 8);
+		default: return static_cast<int32_t>(load32<BigEndian>(p));
+		}
+	}
+
+	static float loadFloat(const uint8_t* p)
+	{
+		uint32_t bits = load32<BigEndian>(p);
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+};
+
+// Convert `count` samples that are `step` bytes apart, writing them
+// `dstStride` samples apart.
+template <SourceFormat Source, bool BigEndian, typename Out>
+static void convertStrided(const uint8_t* src, ptrdiff_t step, Out* dst, size_t dstStride, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		Reader<Source, BigEndian>::read(src, *dst);
+		src += step;
+		dst += dstStride;
+	}
+}
+
+template <SourceFormat Source, typename Out>
+static void convertStrided(bool bigEndian, const uint8_t* src, ptrdiff_t step, Out* dst, size_t dstStride, size_t count)
+{
+	if (bigEndian)
+		convertStrided<Source, true>(src, step, dst, dstStride, count);
+	else
+		convertStrided<Source, false>(src, step, dst, dstStride, count);
+}
+
+template <typename Out>
+static void convertStrided(SourceFormat source, bool bigEndian, const uint8_t* src, ptrdiff_t step, Out* dst, size_t dstStride, size_t count)
+{
+	switch (source)
+	{
+	case Src_S16: convertStrided<Src_S16>(bigEndian, src, step, dst, dstStride, count); break;
+	case Src_S24: convertStrided<Src_S24>(bigEndian, src, step, dst, dstStride, count); break;
+	case Src_S32: convertStrided<Src_S32>(bigEndian, src, step, dst, dstStride, count); break;
+	default: convertStrided<Src_F32>(bigEndian, src, step, dst, dstStride, count); break;
+	}
+}
+
+// Contiguous native byte order samples, which is where the SIMD kernels are used.
+template <SourceFormat Source>
+static void scalarToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	convertStrided<Source, HostBigEndian>(src, Reader<Source, HostBigEndian>::Bytes, dst, 1, count);
+}
+
+template <SourceFormat Source>
+static void scalarToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	convertStrided<Source, HostBigEndian>(src, Reader<Source, HostBigEndian>::Bytes, dst, 1, count);
+}
+
+static void copyS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	memcpy(dst, src, count * sizeof(int16_t));
+}
+
+static void copyFloat(const uint8_t* src, float* dst, size_t count)
+{
+	memcpy(dst, src, count * sizeof(float));
+}
+
+typedef void (*ToS16Kernel)(const uint8_t* src, int16_t* dst, size_t count);
+typedef void (*ToFloatKernel)(const uint8_t* src, float* dst, size_t count);
+
+// A set of kernels for native byte order, indexed by SourceFormat.
+struct Kernels
+{
+	const char* name;
+	ToS16Kernel toS16[Src_Count];
+	ToFloatKernel toFloat[Src_Count];
+};
+
+static const Kernels ScalarKernels = {
+	"scalar",
+	{copyS16, scalarToS16<Src_S24>, scalarToS16<Src_S32>, scalarToS16<Src_F32>},
+	{scalarToFloat<Src_S16>, scalarToFloat<Src_S24>, scalarToFloat<Src_S32>, copyFloat},
+};
+
+#if CONVERT_SSE2
+
+// Each of these does as many whole vectors as it can and leaves the rest to
+// the scalar version.
+
+static void sse2S24ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4 + 16));
+		// Move the sign bit to the top, then take the top 16 bits.
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 8), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 8), 16);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(a, b));
+	}
+	scalarToS16<Src_S24>(src + i * 4, dst + i, count - i);
+}
+
+static void sse2S32ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4 + 16));
+		a = _mm_srai_epi32(a, 16);
+		b = _mm_srai_epi32(b, 16);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(a, b));
+	}
+	scalarToS16<Src_S32>(src + i * 4, dst + i, count - i);
+}
+
+static void sse2F32ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(32768.0f);
+	const __m128 lo = _mm_set1_ps(-32768.0f);
+	const __m128 hi = _mm_set1_ps(32767.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(reinterpret_cast<const float*>(src + i * 4)), scale);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(reinterpret_cast<const float*>(src + i * 4 + 16)), scale);
+		// Clip before converting, since out of range values convert to
+		// INT_MIN. _mm_max_ps() returns the second argument for NaN.
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+	}
+	scalarToS16<Src_F32>(src + i * 4, dst + i, count - i);
+}
+
+static void sse2S16ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+		// Sign extend by putting each sample in the top half and shifting down.
+		__m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		__m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(a), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), scale));
+	}
+	scalarToFloat<Src_S16>(src + i * 2, dst + i, count - i);
+}
+
+static void sse2S24ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 8388608.0f);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+		x = _mm_srai_epi32(_mm_slli_epi32(x, 8), 8);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+	}
+	scalarToFloat<Src_S24>(src + i * 4, dst + i, count - i);
+}
+
+static void sse2S32ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+	}
+	scalarToFloat<Src_S32>(src + i * 4, dst + i, count - i);
+}
+
+static const Kernels Sse2Kernels = {
+	"sse2",
+	{copyS16, sse2S24ToS16, sse2S32ToS16, sse2F32ToS16},
+	{sse2S16ToFloat, sse2S24ToFloat, sse2S32ToFloat, copyFloat},
+};
+
+#endif
+
+#if CONVERT_AVX2
+
+// The AVX2 pack instructions work on each 128 bit half separately, so the
+// result has to be put back in order.
+TARGET_AVX2 static inline __m256i avx2Pack(__m256i a, __m256i b)
+{
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+}
+
+TARGET_AVX2 static void avx2S24ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4 + 32));
+		a = _mm256_srai_epi32(_mm256_slli_epi32(a, 8), 16);
+		b = _mm256_srai_epi32(_mm256_slli_epi32(b, 8), 16);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), avx2Pack(a, b));
+	}
+	scalarToS16<Src_S24>(src + i * 4, dst + i, count - i);
+}
+
+TARGET_AVX2 static void avx2S32ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4 + 32));
+		a = _mm256_srai_epi32(a, 16);
+		b = _mm256_srai_epi32(b, 16);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), avx2Pack(a, b));
+	}
+	scalarToS16<Src_S32>(src + i * 4, dst + i, count - i);
+}
+
+TARGET_AVX2 static void avx2F32ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(32768.0f);
+	const __m256 lo = _mm256_set1_ps(-32768.0f);
+	const __m256 hi = _mm256_set1_ps(32767.0f);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(reinterpret_cast<const float*>(src + i * 4)), scale);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(reinterpret_cast<const float*>(src + i * 4 + 32)), scale);
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), avx2Pack(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b)));
+	}
+	scalarToS16<Src_F32>(src + i * 4, dst + i, count - i);
+}
+
+TARGET_AVX2 static void avx2S16ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2)));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	scalarToFloat<Src_S16>(src + i * 2, dst + i, count - i);
+}
+
+TARGET_AVX2 static void avx2S24ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 8388608.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+		x = _mm256_srai_epi32(_mm256_slli_epi32(x, 8), 8);
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	scalarToFloat<Src_S24>(src + i * 4, dst + i, count - i);
+}
+
+TARGET_AVX2 static void avx2S32ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+	}
+	scalarToFloat<Src_S32>(src + i * 4, dst + i, count - i);
+}
+
+static const Kernels Avx2Kernels = {
+	"avx2",
+	{copyS16, avx2S24ToS16, avx2S32ToS16, avx2F32ToS16},
+	{avx2S16ToFloat, avx2S24ToFloat, avx2S32ToFloat, copyFloat},
+};
+
+static bool cpuHasAvx2()
+{
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	// The OS has to save the AVX registers too.
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return false;
+#endif
+}
+
+#endif
+
+#if CONVERT_NEON
+
+static void neonS24ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		int32x4_t a = vld1q_s32(reinterpret_cast<const int32_t*>(src + i * 4));
+		int32x4_t b = vld1q_s32(reinterpret_cast<const int32_t*>(src + i * 4 + 16));
+		// Move the sign bit to the top, then take the top 16 bits.
+		a = vshlq_n_s32(a, 8);
+		b = vshlq_n_s32(b, 8);
+		vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(a, 16), vshrn_n_s32(b, 16)));
+	}
+	scalarToS16<Src_S24>(src + i * 4, dst + i, count - i);
+}
+
+static void neonS32ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		int32x4_t a = vld1q_s32(reinterpret_cast<const int32_t*>(src + i * 4));
+		int32x4_t b = vld1q_s32(reinterpret_cast<const int32_t*>(src + i * 4 + 16));
+		vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(a, 16), vshrn_n_s32(b, 16)));
+	}
+	scalarToS16<Src_S32>(src + i * 4, dst + i, count - i);
+}
+
+// Round to nearest. ARMv7 only has a truncating conversion.
+static inline int32x4_t neonRound(float32x4_t x)
+{
+#if defined(__aarch64__)
+	return vcvtnq_s32_f32(x);
+#else
+	uint32x4_t negative = vcltq_f32(x, vdupq_n_f32(0.0f));
+	float32x4_t half = vbslq_f32(negative, vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f));
+	return vcvtq_s32_f32(vaddq_f32(x, half));
+#endif
+}
+
+static void neonF32ToS16(const uint8_t* src, int16_t* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		float32x4_t a = vmulq_n_f32(vld1q_f32(reinterpret_cast<const float*>(src + i * 4)), 32768.0f);
+		float32x4_t b = vmulq_n_f32(vld1q_f32(reinterpret_cast<const float*>(src + i * 4 + 16)), 32768.0f);
+		// The conversion and the narrowing both saturate, which clips.
+		vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(neonRound(a)), vqmovn_s32(neonRound(b))));
+	}
+	scalarToS16<Src_F32>(src + i * 4, dst + i, count - i);
+}
+
+static void neonS16ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		int16x8_t x = vld1q_s16(reinterpret_cast<const int16_t*>(src + i * 2));
+		float32x4_t a = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+		float32x4_t b = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+		vst1q_f32(dst + i, vmulq_n_f32(a, 1.0f / 32768.0f));
+		vst1q_f32(dst + i + 4, vmulq_n_f32(b, 1.0f / 32768.0f));
+	}
+	scalarToFloat<Src_S16>(src + i * 2, dst + i, count - i);
+}
+
+static void neonS24ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		int32x4_t x = vld1q_s32(reinterpret_cast<const int32_t*>(src + i * 4));
+		x = vshrq_n_s32(vshlq_n_s32(x, 8), 8);
+		vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(x), 1.0f / 8388608.0f));
+	}
+	scalarToFloat<Src_S24>(src + i * 4, dst + i, count - i);
+}
+
+static void neonS32ToFloat(const uint8_t* src, float* dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		int32x4_t x = vld1q_s32(reinterpret_cast<const int32_t*>(src + i * 4));
+		vst1q_f32(dst + i, vmulq_n_f32(vcvtq_f32_s32(x), 1.0f / 2147483648.0f));
+	}
+	scalarToFloat<Src_S32>(src + i * 4, dst + i, count - i);
+}
+
+static const Kernels NeonKernels = {
+	"neon",
+	{copyS16, neonS24ToS16, neonS32ToS16, neonF32ToS16},
+	{neonS16ToFloat, neonS24ToFloat, neonS32ToFloat, copyFloat},
+};
+
+#endif
+
+// Pick the fastest kernels that the CPU supports, unless overridden.
+static const Kernels* chooseKernels()
+{
+	vector<const Kernels*> available;
+	// The SIMD kernels assume little endian.
+	if (!HostBigEndian)
+	{
+#if CONVERT_AVX2
+		if (cpuHasAvx2())
+			available.push_back(&Avx2Kernels);
+#endif
+#if CONVERT_SSE2
+		available.push_back(&Sse2Kernels);
+#endif
+#if CONVERT_NEON
+		available.push_back(&NeonKernels);
+#endif
+	}
+	available.push_back(&ScalarKernels);
+
+	const char* override = getenv("OPUSREC_CONVERT");
+	if (override != nullptr)
+	{
+		for (const Kernels* kernels : available)
+		{
+			if (override == string(kernels->name))
+				return kernels;
+		}
+	}
+	return available.front();
+}
+
+// This is chosen before main() so there's no chance of doing it in the
+// realtime callback.
+static const Kernels* const SelectedKernels = chooseKernels();
+
+const char* ConvertIsa()
+{
+	return SelectedKernels->name;
+}
+
+bool CanConvertFormat(SoundIoFormat format)
+{
+	SourceFormat source;
+	bool bigEndian;
+	return sourceFormat(format, source, bigEndian);
+}
+
+static void convertContiguous(SourceFormat source, bool bigEndian, const uint8_t* src, int16_t* dst, size_t count)
+{
+	if (bigEndian == HostBigEndian)
+		SelectedKernels->toS16[source](src, dst, count);
+	else
+		convertStrided(source, bigEndian, src, bytesPerSample(source), dst, 1, count);
+}
+
+static void convertContiguous(SourceFormat source, bool bigEndian, const uint8_t* src, float* dst, size_t count)
+{
+	if (bigEndian == HostBigEndian)
+		SelectedKernels->toFloat[source](src, dst, count);
+	else
+		convertStrided(source, bigEndian, src, bytesPerSample(source), dst, 1, count);
+}
+
+template <typename Out>
+static void convertSamples(SoundIoFormat format, const void* src, Out* dst, size_t count)
+{
+	SourceFormat source;
+	bool bigEndian;
+	if (!sourceFormat(format, source, bigEndian))
+	{
+		fill(dst, dst + count, Out(0));
+		return;
+	}
+	convertContiguous(source, bigEndian, static_cast<const uint8_t*>(src), dst, count);
+}
+
+void ConvertSamples(SoundIoFormat format, const void* src, int16_t* dst, size_t count)
+{
+	convertSamples(format, src, dst, count);
+}
+
+void ConvertSamples(SoundIoFormat format, const void* src, float* dst, size_t count)
+{
+	convertSamples(format, src, dst, count);
+}
+
+template <typename Out>
+static void convertAreas(SoundIoFormat format,
+                         const SoundIoChannelArea* areas,
+                         const int* order,
+                         int channels,
+                         int startFrame,
+                         int frames,
+                         Out* dst)
+{
+	size_t count = static_cast<size_t>(frames) * channels;
+
+	SourceFormat source;
+	bool bigEndian;
+	if (!sourceFormat(format, source, bigEndian) || channels > SOUNDIO_MAX_CHANNELS)
+	{
+		fill(dst, dst + count, Out(0));
+		return;
+	}
+	int bytes = static_cast<int>(bytesPerSample(source));
+
+	bool interleaved = true;
+	for (int ch = 0; ch < channels; ++ch)
+	{
+		if (areas[ch].step != bytes * channels || areas[ch].ptr != areas[0].ptr + ch * bytes)
+			interleaved = false;
+	}
+
+	if (interleaved)
+	{
+		// This is the usual case. Convert them all in one go, and then
+		// shuffle the channels in each frame if necessary.
+		const uint8_t* src = reinterpret_cast<const uint8_t*>(areas[0].ptr) + static_cast<ptrdiff_t>(startFrame) * areas[0].step;
+		convertContiguous(source, bigEndian, src, dst, count);
+
+		if (order != nullptr)
+		{
+			Out frame[SOUNDIO_MAX_CHANNELS];
+			for (Out* out = dst; out < dst + count; out += channels)
+			{
+				copy(out, out + channels, frame);
+				for (int ch = 0; ch < channels; ++ch)
+					out[ch] = frame[order[ch]];
+			}
+		}
+		return;
+	}
+
+	// Otherwise do one channel at a time.
+	for (int ch = 0; ch < channels; ++ch)
+	{
+		const SoundIoChannelArea& area = areas[order != nullptr ? order[ch] : ch];
+		const uint8_t* src = reinterpret_cast<const uint8_t*>(area.ptr) + static_cast<ptrdiff_t>(startFrame) * area.step;
+
+		if (area.step != bytes)
+		{
+			convertStrided(source, bigEndian, src, area.step, dst + ch, channels, frames);
+			continue;
+		}
+
+		// Planar, so the channel's samples are contiguous. Convert them in
+		// chunks with the fast kernels and then interleave them.
+		const int ChunkSize = 256;
+		Out chunk[ChunkSize];
+		for (int done = 0; done < frames; done += ChunkSize)
+		{
+			int n = min(ChunkSize, frames - done);
+			convertContiguous(source, bigEndian, src + done * bytes, chunk, n);
+			Out* out = dst + static_cast<size_t>(done) * channels + ch;
+			for (int i = 0; i < n; ++i)
+				out[static_cast<size_t>(i) * channels] = chunk[i];
+		}
+	}
+}
+
+void ConvertAreas(SoundIoFormat format,
+                  const SoundIoChannelArea* areas,
+                  const int* order,
+                  int channels,
+                  int startFrame,
+                  int frames,
+                  int16_t* dst)
+{
+	convertAreas(format, areas, order, channels, startFrame, frames, dst);
+}
+
+void ConvertAreas(SoundIoFormat format,
+                  const SoundIoChannelArea* areas,
+                  const int* order,
+                  int channels,
+                  int startFrame,
+                  int frames,
+                  float* dst)
+{
+	convertAreas(format, areas, order, channels, startFrame, frames, dst);
+}
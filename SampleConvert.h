@@ -0,0 +1,50 @@
+#pragma once
+
+#include <soundio/soundio.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Conversion from the sample formats that libsoundio delivers into the
+// interleaved native-endian int16 or float samples that Opus takes.
+//
+// Signed 16, 24 (in 32 bits, as libsoundio uses) and 32 bit integers and
+// 32 bit floats are supported, in either byte order. Native byte order is
+// converted with SIMD kernels (SSE2 or AVX2 on x86, NEON on ARM); the best
+// ones for the CPU are chosen when the program starts. Setting the
+// environment variable OPUSREC_CONVERT to "scalar", "sse2", "avx2" or "neon"
+// forces a particular set, if the CPU supports it.
+//
+// Integers are scaled by their full range, so a 32 bit sample becomes its
+// top 16 bits, and floats are clipped to [-1, 1) when converted to int16.
+//
+// These don't allocate or lock, so they can be used in the realtime callback.
+
+// The name of the instruction set that the kernels are using.
+const char* ConvertIsa();
+
+// True if samples in `format` can be converted.
+bool CanConvertFormat(SoundIoFormat format);
+
+// Convert `count` contiguous samples in `format`.
+void ConvertSamples(SoundIoFormat format, const void* src, int16_t* dst, size_t count);
+void ConvertSamples(SoundIoFormat format, const void* src, float* dst, size_t count);
+
+// Convert `frames` frames, starting `startFrame` frames in, from libsoundio
+// channel areas into interleaved samples. If `order` is not null, channel `i`
+// of the output comes from `areas[order[i]]`. The areas aren't modified.
+// `channels` must be at most SOUNDIO_MAX_CHANNELS.
+void ConvertAreas(SoundIoFormat format,
+                  const SoundIoChannelArea* areas,
+                  const int* order,
+                  int channels,
+                  int startFrame,
+                  int frames,
+                  int16_t* dst);
+void ConvertAreas(SoundIoFormat format,
+                  const SoundIoChannelArea* areas,
+                  const int* order,
+                  int channels,
+                  int startFrame,
+                  int frames,
+                  float* dst);
@@ -0,0 +1,105 @@
+#include "Semaphore.h"
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+struct Semaphore::Impl
+{
+	HANDLE handle;
+};
+
+Semaphore::Semaphore() : mImpl(new Impl)
+{
+	mImpl->handle = CreateSemaphore(nullptr, 0, LONG_MAX, nullptr);
+}
+
+Semaphore::~Semaphore()
+{
+	CloseHandle(mImpl->handle);
+}
+
+void Semaphore::post()
+{
+	ReleaseSemaphore(mImpl->handle, 1, nullptr);
+}
+
+bool Semaphore::waitFor(std::chrono::microseconds timeout)
+{
+	DWORD ms = static_cast<DWORD>((timeout.count() + 999) / 1000);
+	return WaitForSingleObject(mImpl->handle, ms) == WAIT_OBJECT_0;
+}
+
+#elif defined(__APPLE__)
+
+// macOS doesn't support unnamed POSIX semaphores.
+#include <dispatch/dispatch.h>
+
+struct Semaphore::Impl
+{
+	dispatch_semaphore_t sem;
+};
+
+Semaphore::Semaphore() : mImpl(new Impl)
+{
+	mImpl->sem = dispatch_semaphore_create(0);
+}
+
+Semaphore::~Semaphore()
+{
+	dispatch_release(mImpl->sem);
+}
+
+void Semaphore::post()
+{
+	dispatch_semaphore_signal(mImpl->sem);
+}
+
+bool Semaphore::waitFor(std::chrono::microseconds timeout)
+{
+	dispatch_time_t deadline = dispatch_time(DISPATCH_TIME_NOW, timeout.count() * 1000);
+	return dispatch_semaphore_wait(mImpl->sem, deadline) == 0;
+}
+
+#elif defined(__unix)
+
+#include <semaphore.h>
+#include <time.h>
+
+struct Semaphore::Impl
+{
+	sem_t sem;
+};
+
+Semaphore::Semaphore() : mImpl(new Impl)
+{
+	sem_init(&mImpl->sem, 0, 0);
+}
+
+Semaphore::~Semaphore()
+{
+	sem_destroy(&mImpl->sem);
+}
+
+void Semaphore::post()
+{
+	// This is async-signal-safe, and only makes a syscall if there is a waiter.
+	sem_post(&mImpl->sem);
+}
+
+bool Semaphore::waitFor(std::chrono::microseconds timeout)
+{
+	// sem_timedwait() takes an absolute CLOCK_REALTIME deadline.
+	timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+
+	long long ns = deadline.tv_nsec + (timeout.count() % 1000000) * 1000;
+	deadline.tv_sec += timeout.count() / 1000000 + ns / 1000000000;
+	deadline.tv_nsec = ns % 1000000000;
+
+	return sem_timedwait(&mImpl->sem, &deadline) == 0;
+}
+
+#else
+#error Semaphore not written for this platform yet.
+#endif
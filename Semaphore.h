@@ -0,0 +1,31 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+
+// A counting semaphore for waking one thread from another.
+//
+// `post()` never blocks and doesn't allocate, so it is safe to call from the
+// libsoundio realtime callback and from the Ctrl-C handler. When nobody is
+// waiting it is usually just an atomic increment.
+class Semaphore
+{
+public:
+	Semaphore();
+	~Semaphore();
+
+	// Increment the count, waking a waiting thread if there is one.
+	void post();
+
+	// Wait until the count is non-zero and then decrement it. Returns false if
+	// the timeout expired (or the wait was interrupted) first.
+	bool waitFor(std::chrono::microseconds timeout);
+
+private:
+	Semaphore(const Semaphore&) = delete;
+	Semaphore& operator=(const Semaphore&) = delete;
+
+	// The platform-specific semaphore.
+	struct Impl;
+	std::unique_ptr<Impl> mImpl;
+};
@@ -0,0 +1,268 @@
+#include "SyntheticInput.h"
+
+#include "ProcessStats.h"
+#include "SampleConvert.h"
+#include "Semaphore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+// Frames generated at a time.
+static const size_t ChunkFrames = 1024;
+
+// Frames that the slowly changing parts of a signal are held for.
+static const size_t BlockFrames = 32;
+
+// How long to wait for the pipeline to make room in the ring buffer.
+static const chrono::microseconds FullWait(100);
+
+static const double Pi = 3.14159265358979323846;
+
+// Bytes per sample of the formats that can be generated.
+static size_t deviceSampleBytes(SoundIoFormat format)
+{
+	return format == SoundIoFormatS16NE ? sizeof(int16_t) : sizeof(int32_t);
+}
+
+SyntheticInput::SyntheticInput(Signal signal,
+                               int sampleRate,
+                               int encoderRate,
+                               int channels,
+                               SoundIoFormat format,
+                               double seconds,
+                               size_t wakeFrames,
+                               Semaphore& dataReady)
+    : mSignal(signal),
+      mSampleRate(sampleRate),
+      mChannels(channels),
+      mFormat(format),
+      mTotalFrames(static_cast<uint64_t>(seconds * sampleRate)),
+      mFloat(format != SoundIoFormatS16NE || sampleRate != encoderRate),
+      mSampleBytes(mFloat ? sizeof(float) : sizeof(int16_t)),
+      mWakeBytes(static_cast<int64_t>(wakeFrames) * sampleRate / encoderRate * mSampleBytes * channels),
+      mDataReady(dataReady),
+      mRingBuffer(new RingBuffer<uint8_t>(sampleRate * mSampleBytes * channels)),
+      mSignalSamples(ChunkFrames * channels),
+      mDeviceSamples(ChunkFrames * channels * deviceSampleBytes(format)),
+      mCos(channels, 1.0),
+      mSin(channels, 0.0)
+{
+}
+
+SyntheticInput::~SyntheticInput()
+{
+	join();
+}
+
+void SyntheticInput::start()
+{
+	mThread = thread(&SyntheticInput::run, this);
+}
+
+void SyntheticInput::join()
+{
+	if (mThread.joinable())
+		mThread.join();
+}
+
+double SyntheticInput::cpuSeconds() const
+{
+	return mCpuSeconds;
+}
+
+RingBuffer<uint8_t>& SyntheticInput::ringBuffer()
+{
+	return *mRingBuffer;
+}
+
+int64_t SyntheticInput::startTime() const
+{
+	return mStartTime;
+}
+
+int SyntheticInput::sampleRate() const
+{
+	return mSampleRate;
+}
+
+bool SyntheticInput::isFloat() const
+{
+	return mFloat;
+}
+
+string SyntheticInput::name() const
+{
+	static const char* const names[] = {"sweep", "noise", "silence", "speech"};
+	return string("synthetic ") + names[mSignal];
+}
+
+void SyntheticInput::run()
+{
+	mStartTime = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+
+	while (mFrame < mTotalFrames)
+	{
+		size_t frames = static_cast<size_t>(min<uint64_t>(ChunkFrames, mTotalFrames - mFrame));
+		size_t samples = frames * mChannels;
+		size_t bytes = samples * mSampleBytes;
+
+		generate(frames);
+		toDeviceFormat(samples);
+
+		// Unlike a device this waits for the reader rather than overflowing.
+		while (mRingBuffer->free() < bytes)
+			this_thread::sleep_for(FullWait);
+
+		RingBuffer<uint8_t>::Region region = mRingBuffer->reserve(bytes);
+		size_t firstSamples = region.first_size / mSampleBytes;
+		const uint8_t* second = mDeviceSamples.data() + firstSamples * deviceSampleBytes(mFormat);
+		if (mFloat)
+		{
+			ConvertSamples(mFormat, mDeviceSamples.data(), reinterpret_cast<float*>(region.first), firstSamples);
+			ConvertSamples(mFormat, second, reinterpret_cast<float*>(region.second), samples - firstSamples);
+		}
+		else
+		{
+			ConvertSamples(mFormat, mDeviceSamples.data(), reinterpret_cast<int16_t*>(region.first), firstSamples);
+			ConvertSamples(mFormat, second, reinterpret_cast<int16_t*>(region.second), samples - firstSamples);
+		}
+		mRingBuffer->commit(bytes);
+
+		if (mRingBuffer->size() >= mWakeBytes)
+			mDataReady.post();
+		mFrame += frames;
+	}
+
+	// Whatever is left is less than a frame, but the reader might be waiting
+	// to be told that it is all there.
+	mDataReady.post();
+	mCpuSeconds = ThreadCpuSeconds();
+}
+
+void SyntheticInput::generate(size_t frames)
+{
+	float* out = mSignalSamples.data();
+	const double rate = mSampleRate;
+
+	// Everything that changes slowly is worked out once per block, which
+	// keeps this much faster than the encoder it is feeding.
+	for (size_t block = 0; block < frames; block += BlockFrames)
+	{
+		size_t blockFrames = min(BlockFrames, frames - block);
+		double t = (mFrame + block) / rate;
+
+		switch (mSignal)
+		{
+		case Signal_Sweep:
+		{
+			const double period = 10.0;
+			const double low = 20.0;
+			const double high = 0.45 * rate;
+			for (int c = 0; c < mChannels; ++c)
+			{
+				// Each channel is a little way behind the last so that they
+				// aren't identical. The oscillator is a rotating phasor,
+				// renormalised every block.
+				double position = fmod(t + 0.37 * c, period) / period;
+				double step = 2.0 * Pi * low * pow(high / low, position) / rate;
+				double stepCos = cos(step);
+				double stepSin = sin(step);
+				double magnitude = sqrt(mCos[c] * mCos[c] + mSin[c] * mSin[c]);
+				double x = mCos[c] / magnitude;
+				double y = mSin[c] / magnitude;
+				float* sample = out + c;
+				for (size_t i = 0; i < blockFrames; ++i)
+				{
+					*sample = static_cast<float>(0.5 * y);
+					sample += mChannels;
+					double next = x * stepCos - y * stepSin;
+					y = x * stepSin + y * stepCos;
+					x = next;
+				}
+				mCos[c] = x;
+				mSin[c] = y;
+			}
+			out += blockFrames * mChannels;
+			break;
+		}
+		case Signal_Noise:
+			for (size_t i = 0; i < blockFrames * mChannels; ++i)
+				*out++ = static_cast<float>(0.25 * noise());
+			break;
+		case Signal_Silence:
+			fill(out, out + blockFrames * mChannels, 0.0f);
+			out += blockFrames * mChannels;
+			break;
+		case Signal_Speech:
+		{
+			// 2.5 s phrases with 1 s pauses, four syllables a second, and a
+			// pitch that wanders between 100 and 180 Hz.
+			bool talking = fmod(t, 3.5) < 2.5;
+			double syllable = sin(2.0 * Pi * 4.0 * t);
+			double envelope = talking && syllable > 0.0 ? syllable * syllable : 0.0;
+			double pitch = 140.0 + 40.0 * sin(2.0 * Pi * 0.7 * t);
+			for (size_t i = 0; i < blockFrames; ++i)
+			{
+				// A sawtooth is rich in harmonics like the voice; the
+				// low-pass gives it a similar spectral tilt.
+				mPitchPhase += pitch / rate;
+				if (mPitchPhase >= 1.0)
+					mPitchPhase -= 1.0;
+				mLowpass += 0.2 * ((2.0 * mPitchPhase - 1.0) - mLowpass);
+				double voice = 0.4 * envelope * mLowpass;
+
+				// Further channels are further from the talker, and they all
+				// hear some room noise.
+				for (int c = 0; c < mChannels; ++c)
+					*out++ = static_cast<float>(voice / (1.0 + 0.2 * c) + 0.003 * noise());
+			}
+			break;
+		}
+		}
+	}
+}
+
+double SyntheticInput::noise()
+{
+	// xorshift64*, scaled to [-1, 1).
+	mNoiseState ^= mNoiseState >> 12;
+	mNoiseState ^= mNoiseState << 25;
+	mNoiseState ^= mNoiseState >> 27;
+	uint64_t random = mNoiseState * 0x2545F4914F6CDD1Dull;
+	return (static_cast<int64_t>(random) >> 11) * (1.0 / 4503599627370496.0);
+}
+
+void SyntheticInput::toDeviceFormat(size_t samples)
+{
+	const float* in = mSignalSamples.data();
+	switch (mFormat)
+	{
+	case SoundIoFormatS16NE:
+	{
+		int16_t* out = reinterpret_cast<int16_t*>(mDeviceSamples.data());
+		for (size_t i = 0; i < samples; ++i)
+			out[i] = static_cast<int16_t>(lrint(in[i] * 32767.0));
+		break;
+	}
+	case SoundIoFormatS24NE:
+	{
+		int32_t* out = reinterpret_cast<int32_t*>(mDeviceSamples.data());
+		for (size_t i = 0; i < samples; ++i)
+			out[i] = static_cast<int32_t>(lrint(in[i] * 8388607.0));
+		break;
+	}
+	case SoundIoFormatS32NE:
+	{
+		int32_t* out = reinterpret_cast<int32_t*>(mDeviceSamples.data());
+		for (size_t i = 0; i < samples; ++i)
+			out[i] = static_cast<int32_t>(llrint(in[i] * 2147483647.0));
+		break;
+	}
+	default:
+		copy(in, in + samples, reinterpret_cast<float*>(mDeviceSamples.data()));
+		break;
+	}
+}
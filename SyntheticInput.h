@@ -0,0 +1,108 @@
+#pragma once
+
+#include <soundio/soundio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "AudioSource.h"
+#include "RingBuffer.h"
+
+class Semaphore;
+
+// Generates a test signal into a ring buffer as fast as it is read, so that a
+// Pipeline can be run without a microphone and much faster than realtime
+// (see `OpusRec benchmark`).
+//
+// The signal is generated in `format`, as if a device delivered it, and
+// converted into the ring buffer with SampleConvert like AudioInput does, so
+// the conversion is part of what is measured. As with AudioInput, the ring
+// buffer holds floats if the format has more than 16 bits or the signal isn't
+// at the encoder's rate, and int16 otherwise.
+class SyntheticInput : public AudioSource
+{
+public:
+	enum Signal
+	{
+		// A logarithmic sine sweep from 20 Hz to near Nyquist every 10 s.
+		Signal_Sweep,
+		// White noise, different in each channel.
+		Signal_Noise,
+		Signal_Silence,
+		// Voiced syllables in phrases with pauses between them, which is
+		// roughly what a microphone in a meeting picks up.
+		Signal_Speech,
+	};
+
+	// `seconds` is how much to generate. `dataReady` is posted whenever there
+	// are at least `wakeFrames` frames (at `encoderRate`) in the ring buffer.
+	SyntheticInput(Signal signal,
+	               int sampleRate,
+	               int encoderRate,
+	               int channels,
+	               SoundIoFormat format,
+	               double seconds,
+	               size_t wakeFrames,
+	               Semaphore& dataReady);
+	~SyntheticInput() override;
+
+	// Start generating on a thread of its own.
+	void start();
+
+	// Wait until it has all been written to the ring buffer.
+	void join();
+
+	// CPU time the generating thread used, so that it can be left out of
+	// measurements. Only valid after join().
+	double cpuSeconds() const;
+
+	RingBuffer<uint8_t>& ringBuffer() override;
+	int64_t startTime() const override;
+	int sampleRate() const override;
+	bool isFloat() const override;
+	std::string name() const override;
+
+private:
+	SyntheticInput(const SyntheticInput&) = delete;
+	SyntheticInput& operator=(const SyntheticInput&) = delete;
+
+	void run();
+
+	// Generate the next `frames` frames into mSignalSamples, in [-1, 1].
+	void generate(size_t frames);
+	// Store mSignalSamples in mFormat in mDeviceSamples.
+	void toDeviceFormat(size_t samples);
+	// The next white noise sample, in [-1, 1).
+	double noise();
+
+	Signal mSignal;
+	int mSampleRate;
+	int mChannels;
+	SoundIoFormat mFormat;
+	uint64_t mTotalFrames;
+	bool mFloat;
+	size_t mSampleBytes;
+	size_t mWakeBytes;
+	Semaphore& mDataReady;
+
+	std::unique_ptr<RingBuffer<uint8_t>> mRingBuffer;
+	std::vector<float> mSignalSamples;
+	std::vector<uint8_t> mDeviceSamples;
+
+	// Position in the signal, in frames.
+	uint64_t mFrame = 0;
+	// State of the generators. The sweep is a phasor for each channel.
+	std::vector<double> mCos;
+	std::vector<double> mSin;
+	uint64_t mNoiseState = 0x9E3779B97F4A7C15ull;
+	double mPitchPhase = 0.0;
+	double mLowpass = 0.0;
+
+	std::thread mThread;
+	std::atomic<int64_t> mStartTime{0};
+	double mCpuSeconds = 0.0;
+};
@@ -0,0 +1,208 @@
+#include "Trace.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+struct Event
+{
+	uint64_t start;
+	// Instant for an instant event.
+	uint64_t duration;
+	const char* name;
+};
+
+static const uint64_t Instant = ~0ULL;
+
+// The events from one thread. Only that thread writes to it.
+struct ThreadBuffer
+{
+	uint64_t threadId = 0;
+	const char* name = nullptr;
+	unique_ptr<Event[]> events;
+	size_t capacity = 0;
+	// Total number of events recorded. The most recent `capacity` of them
+	// are kept.
+	atomic<uint64_t> count{0};
+};
+
+// These are only written by `Tracer::start()`, before it sets sEnabled.
+static unique_ptr<ThreadBuffer[]> buffers;
+static int bufferCount = 0;
+static uint64_t origin = 0;
+static bool started = false;
+
+// The number of buffers that threads have claimed, which goes past
+// bufferCount if there are more threads than buffers.
+static atomic<int> claimed{0};
+
+static thread_local ThreadBuffer* threadBuffer = nullptr;
+static thread_local bool untraced = false;
+
+static uint64_t currentThreadId(int slot)
+{
+#if defined(_WIN32)
+	return GetCurrentThreadId();
+#elif defined(__linux__)
+	return static_cast<uint64_t>(syscall(SYS_gettid));
+#else
+	return slot + 1;
+#endif
+}
+
+// This thread's buffer, which is claimed the first time it is needed.
+// Returns null if there are too many threads.
+static ThreadBuffer* currentBuffer()
+{
+	if (threadBuffer != nullptr || untraced)
+		return threadBuffer;
+
+	int slot = claimed.fetch_add(1, memory_order_relaxed);
+	if (slot >= bufferCount)
+	{
+		untraced = true;
+		return nullptr;
+	}
+
+	ThreadBuffer* buffer = &buffers[slot];
+	buffer->threadId = currentThreadId(slot);
+	threadBuffer = buffer;
+	return buffer;
+}
+
+static void record(const Event& event)
+{
+	ThreadBuffer* buffer = currentBuffer();
+	if (buffer == nullptr)
+		return;
+	uint64_t count = buffer->count.load(memory_order_relaxed);
+	buffer->events[count % buffer->capacity] = event;
+	buffer->count.store(count + 1, memory_order_release);
+}
+
+atomic<bool> Tracer::sEnabled{false};
+
+bool Tracer::start(size_t eventsPerThread, int threads)
+{
+#if defined(OPUSREC_TRACING)
+	if (started || eventsPerThread == 0 || threads <= 0)
+		return false;
+	started = true;
+
+	// Zeroing the events touches every page, so that the first events on a
+	// thread don't page fault either.
+	buffers.reset(new ThreadBuffer[threads]);
+	for (int i = 0; i < threads; ++i)
+	{
+		buffers[i].events.reset(new Event[eventsPerThread]());
+		buffers[i].capacity = eventsPerThread;
+	}
+	bufferCount = threads;
+	origin = now();
+	sEnabled.store(true, memory_order_release);
+	return true;
+#else
+	cerr << "Tracing isn't built in. Configure with `meson configure -Dtracing=true`." << endl;
+	return false;
+#endif
+}
+
+bool Tracer::stop(const string& filename)
+{
+	if (!started)
+		return true;
+	sEnabled.store(false, memory_order_release);
+
+	ofstream file(filename.c_str(), ios::binary | ios::trunc);
+	if (!file)
+	{
+		cerr << "Unable to write trace to " << filename << endl;
+		return false;
+	}
+
+	file << fixed << setprecision(3);
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+	const char* separator = "";
+	uint64_t written = 0;
+	uint64_t lost = 0;
+	// The threads that recorded anything have finished, so everything they
+	// wrote is visible here.
+	int threads = min(claimed.load(), bufferCount);
+	for (int i = 0; i < threads; ++i)
+	{
+		ThreadBuffer* buffer = &buffers[i];
+
+		if (buffer->name != nullptr)
+		{
+			file << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->threadId
+			     << ", \"args\": {\"name\": \"" << buffer->name << "\"}}";
+			separator = ",\n";
+		}
+
+		uint64_t count = buffer->count.load(memory_order_acquire);
+		uint64_t first = count > buffer->capacity ? count - buffer->capacity : 0;
+		lost += first;
+		for (uint64_t n = first; n < count; ++n)
+		{
+			const Event& event = buffer->events[n % buffer->capacity];
+			file << separator << "{\"name\": \"" << event.name << "\", \"pid\": 1, \"tid\": " << buffer->threadId
+			     << ", \"ts\": " << (event.start - origin) / 1000.0;
+			if (event.duration == Instant)
+				file << ", \"ph\": \"i\", \"s\": \"t\"}";
+			else
+				file << ", \"ph\": \"X\", \"dur\": " << event.duration / 1000.0 << "}";
+			separator = ",\n";
+			++written;
+		}
+	}
+	file << "\n]}\n";
+
+	file.close();
+	if (!file)
+	{
+		cerr << "Error writing trace to " << filename << endl;
+		return false;
+	}
+
+	cerr << "Wrote " << written << " trace events to " << filename;
+	if (lost > 0)
+		cerr << " (" << lost << " older ones were overwritten)";
+	if (claimed > bufferCount)
+		cerr << " (only the first " << bufferCount << " threads were traced)";
+	cerr << endl;
+	return true;
+}
+
+void Tracer::complete(const char* name, uint64_t start, uint64_t duration)
+{
+	record(Event{start, duration, name});
+}
+
+void Tracer::instant(const char* name)
+{
+	record(Event{now(), Instant, name});
+}
+
+void Tracer::nameThread(const char* name)
+{
+	ThreadBuffer* buffer = currentBuffer();
+	if (buffer != nullptr && buffer->name == nullptr)
+		buffer->name = name;
+}
+
+uint64_t Tracer::now()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Records when the hot paths run on each thread, to be looked at as a
+// timeline in chrome://tracing or https://ui.perfetto.dev, e.g. to see
+// whether a glitch came from a slow read callback, a slow encode or a slow
+// write.
+//
+// The ring buffers of events are all allocated (and their pages touched) by
+// `start()`, and each thread claims one the first time it records an event,
+// so recording is lock-free and never allocates, even on a realtime thread.
+// When a buffer fills up the oldest events are overwritten, so the file has
+// the most recent events from each thread.
+//
+// Tracing is built in unless meson is configured with -Dtracing=false, in
+// which case the TRACE_ macros compile to nothing. When it is built in but
+// hasn't been started, each TRACE_ macro is a single branch.
+class Tracer
+{
+public:
+	// Start recording, keeping up to `eventsPerThread` events from each of
+	// the first `threads` threads that record anything; any after that
+	// aren't traced. Prints an error and returns false if tracing isn't
+	// built in.
+	static bool start(size_t eventsPerThread, int threads);
+
+	// Stop recording and write the events as Chrome trace JSON. Every thread
+	// that recorded anything must have stopped doing so first. Prints an
+	// error and returns false on failure.
+	static bool stop(const std::string& filename);
+
+	// This acquires what `start()` set up, so the other functions must only
+	// be called once this has returned true.
+	static bool enabled()
+	{
+		return sEnabled.load(std::memory_order_acquire);
+	}
+
+	// Record that `name` ran on this thread from `start` for `duration` (in
+	// steady_clock nanoseconds). `name` must be a string literal, since only
+	// the pointer is kept.
+	static void complete(const char* name, uint64_t start, uint64_t duration);
+
+	// Record a moment, e.g. an overflow.
+	static void instant(const char* name);
+
+	// Name this thread in the timeline. Only the first name counts.
+	static void nameThread(const char* name);
+
+	static uint64_t now();
+
+private:
+	static std::atomic<bool> sEnabled;
+};
+
+// Records the time from construction to destruction.
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name) : mName(Tracer::enabled() ? name : nullptr)
+	{
+		if (mName != nullptr)
+			mStart = Tracer::now();
+	}
+
+	~TraceScope()
+	{
+		if (mName != nullptr)
+			Tracer::complete(mName, mStart, Tracer::now() - mStart);
+	}
+
+private:
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	const char* mName;
+	uint64_t mStart = 0;
+};
+
+#if defined(OPUSREC_TRACING)
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_INSTANT(name) \
+	do \
+	{ \
+		if (Tracer::enabled()) \
+			Tracer::instant(name); \
+	} while (0)
+#define TRACE_THREAD(name) \
+	do \
+	{ \
+		if (Tracer::enabled()) \
+			Tracer::nameThread(name); \
+	} while (0)
+#else
+#define TRACE_SCOPE(name) \
+	do \
+	{ \
+	} while (0)
+#define TRACE_INSTANT(name) \
+	do \
+	{ \
+	} while (0)
+#define TRACE_THREAD(name) \
+	do \
+	{ \
+	} while (0)
+#endif
@@ -0,0 +1,130 @@
+#include "Trigger.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstring>
+#include <iostream>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+Trigger::Trigger()
+{
+}
+
+Trigger::~Trigger()
+{
+	close();
+}
+
+bool Trigger::open(const string& source)
+{
+	close();
+
+	if (source.compare(0, 5, "unix:") != 0)
+	{
+		mPath = source;
+		mFileExisted = fileTime(mFileModified);
+		return true;
+	}
+
+#if defined(_WIN32)
+	cerr << "Unix domain sockets aren't supported on Windows." << endl;
+	return false;
+#else
+	string path = source.substr(5);
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		cerr << "Socket path too long: " << path << endl;
+		return false;
+	}
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	mSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (mSocket < 0)
+	{
+		cerr << "Unable to create socket: " << strerror(errno) << endl;
+		return false;
+	}
+
+	// A socket left over from last time would stop it binding.
+	unlink(path.c_str());
+	if (bind(mSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(mSocket, 8) != 0)
+	{
+		cerr << "Unable to listen on " << path << ": " << strerror(errno) << endl;
+		::close(mSocket);
+		mSocket = -1;
+		return false;
+	}
+
+	mPath = path;
+	return true;
+#endif
+}
+
+bool Trigger::poll()
+{
+#if !defined(_WIN32)
+	if (mSocket >= 0)
+	{
+		bool triggered = false;
+		for (;;)
+		{
+			int connection = accept(mSocket, nullptr, nullptr);
+			if (connection < 0)
+				break;
+
+			// Let whoever asked know it has been done.
+			static const char reply[] = "ok\n";
+			send(connection, reply, sizeof(reply) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+			::close(connection);
+			triggered = true;
+		}
+		return triggered;
+	}
+#endif
+
+	if (mPath.empty())
+		return false;
+
+	time_t modified = 0;
+	bool exists = fileTime(modified);
+	bool triggered = exists && (!mFileExisted || modified != mFileModified);
+	mFileExisted = exists;
+	mFileModified = modified;
+	return triggered;
+}
+
+void Trigger::close()
+{
+#if !defined(_WIN32)
+	if (mSocket >= 0)
+	{
+		::close(mSocket);
+		unlink(mPath.c_str());
+	}
+#endif
+	mSocket = -1;
+	mPath.clear();
+	mFileExisted = false;
+}
+
+bool Trigger::fileTime(time_t& modified) const
+{
+	struct stat st;
+	if (stat(mPath.c_str(), &st) != 0)
+		return false;
+	modified = st.st_mtime;
+	return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <ctime>
+#include <string>
+
+// Watches for another program asking for something to be done, without a
+// thread of its own: `poll()` is called every so often to see if it has.
+class Trigger
+{
+public:
+	Trigger();
+	~Trigger();
+
+	// `source` is "unix:<path>" to listen on a Unix domain socket, where
+	// every connection is a trigger (e.g. `socat - UNIX-CONNECT:<path>`), or
+	// the name of a file, where it is a trigger whenever the file is touched
+	// or created. Prints an error and returns false on failure.
+	bool open(const std::string& source);
+
+	// Returns true if it has been triggered since the last call. It doesn't
+	// wait. Files are only checked to the second, so touching one twice in a
+	// second is one trigger.
+	bool poll();
+
+	void close();
+
+private:
+	Trigger(const Trigger&) = delete;
+	Trigger& operator=(const Trigger&) = delete;
+
+	// Get the file's modification time. Returns false if it doesn't exist.
+	bool fileTime(time_t& modified) const;
+
+	std::string mPath;
+
+	// The listening socket, or -1 if a file is being watched.
+	int mSocket = -1;
+
+	// Whether the file existed when it was last checked, and when it was
+	// modified.
+	bool mFileExisted = false;
+	time_t mFileModified = 0;
+};
@@ -0,0 +1,41 @@
+#include "VoiceGate.h"
+
+#include <cmath>
+
+VoiceGate::VoiceGate(double thresholdDb, int hangoverFrames)
+    : mThreshold(std::pow(10.0, thresholdDb / 10.0)), mHangover(hangoverFrames)
+{
+}
+
+bool VoiceGate::process(const int16_t* samples, size_t count)
+{
+	// Integer sums are exact and faster; a frame is at most a few thousand
+	// samples so this can't overflow.
+	int64_t sum = 0;
+	for (size_t i = 0; i < count; ++i)
+		sum += static_cast<int32_t>(samples[i]) * samples[i];
+	return update(count > 0 ? static_cast<double>(sum) / (32768.0 * 32768.0) / count : 0.0);
+}
+
+bool VoiceGate::process(const float* samples, size_t count)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < count; ++i)
+		sum += samples[i] * samples[i];
+	return update(count > 0 ? sum / count : 0.0);
+}
+
+bool VoiceGate::update(double power)
+{
+	if (power > mThreshold)
+	{
+		mRemaining = mHangover;
+		return true;
+	}
+	if (mRemaining > 0)
+	{
+		--mRemaining;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Decides which frames are worth encoding from how loud they are. It is a
+// simple energy gate rather than a real voice detector, which is enough to
+// tell a silent room from one where someone is talking, and costs next to
+// nothing compared to encoding.
+//
+// A frame opens the gate if its level (RMS over all the channels) is above
+// the threshold. The gate then stays open for `hangoverFrames` more frames
+// after the last loud one, so that the quiet ends of words and the gaps
+// between them aren't cut out.
+class VoiceGate
+{
+public:
+	// `thresholdDb` is in dB relative to full scale, e.g. -50.
+	VoiceGate(double thresholdDb, int hangoverFrames);
+
+	// Returns true if the frame should be encoded. `count` is the number of
+	// samples for all channels.
+	bool process(const int16_t* samples, size_t count);
+	bool process(const float* samples, size_t count);
+
+private:
+	// `power` is the mean of the squared samples, scaled to full scale = 1.
+	bool update(double power);
+
+	// The threshold as a mean square.
+	double mThreshold;
+	int mHangover;
+	// How many more frames the gate stays open for.
+	int mRemaining = 0;
+};
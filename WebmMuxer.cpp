@@ -0,0 +1,193 @@
+#include "WebmMuxer.h"
+
+#include "Trace.h"
+
+#include <common/webmids.h>
+#include <mkvmuxer/mkvmuxerutil.h>
+
+// Number of frame copies in the arena. mkvmuxer only keeps one at a time for
+// audio, but its cluster and cue lists are arrays that can end up in the
+// arena too.
+static const size_t ArenaBlocks = 8;
+
+WebmMuxer::WebmMuxer()
+{
+}
+
+WebmMuxer::~WebmMuxer()
+{
+	close();
+}
+
+bool WebmMuxer::open(const std::string& filename)
+{
+	if (!mWriter.open(filename))
+		return false;
+
+	mLive = false;
+	return initSegment();
+}
+
+bool WebmMuxer::openLive(const std::string& output, int clusterMilliseconds)
+{
+	if (!mWriter.open(output))
+		return false;
+
+	if (!initSegment())
+		return false;
+
+	// Nothing can be gone back and filled in, and there is no index at the
+	// end, so players have to read it from the start.
+	mSegment.set_mode(mkvmuxer::Segment::kLive);
+	mSegment.OutputCues(false);
+	mSegment.set_max_cluster_duration(static_cast<uint64_t>(clusterMilliseconds) * 1000000);
+	mLive = true;
+	return true;
+}
+
+bool WebmMuxer::initSegment()
+{
+	mWriter.durationPosition = -1;
+	mNextCheckpoint = 0;
+
+	// WebM files have one segment.
+	if (!mSegment.Init(&mWriter))
+		return false;
+	
+	mkvmuxer::SegmentInfo* info = mSegment.GetSegmentInfo();
+	if (info == nullptr)
+		return false;
+	
+	info->set_writing_app("OpusRec");
+
+	mFinalize = true;
+	return true;
+}
+
+uint64_t WebmMuxer::addOpusTrack(int samplingRate, int channels, const std::vector<uint8_t>& opusHead, int maxPacketLength)
+{
+	if (!mFinalize)
+		return 0;
+
+	// Add an audio track.
+	uint64_t trackNumber = mSegment.AddAudioTrack(samplingRate, channels, 0); // 0 allows the muxer to device on track number.
+	if (trackNumber == 0)
+		return 0;
+	
+	mkvmuxer::AudioTrack* audio = static_cast<mkvmuxer::AudioTrack*>(mSegment.GetTrackByNumber(trackNumber));
+	if (audio == nullptr)
+		return 0;
+
+	audio->set_codec_id(mkvmuxer::Tracks::kOpusCodecId);
+	audio->set_bit_depth(16);
+
+	// Delay built into the code during decoding in nanoseconds. This is the
+	// pre-skip from the OpusHead, which is in 48 kHz samples.
+	uint64_t preSkip = opusHead.size() >= 12 ? opusHead[10] | (opusHead[11] << 8) : 0;
+	audio->set_codec_delay(preSkip * 1000000000 / 48000);
+
+	// Amount of audio to discard after a seek, or something like that.
+	audio->set_seek_pre_roll(80000000); // TODO: How do I know this?
+
+	if (!audio->SetCodecPrivate(opusHead.data(), opusHead.size()))
+		return 0;
+
+	// If this fails the frames are just allocated normally.
+	mArena.reserve(maxPacketLength, ArenaBlocks);
+
+	return trackNumber;
+}
+
+bool WebmMuxer::writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp)
+{
+	if (!mFinalize)
+		return false;
+
+	// We are allowed to ignore packets shorter than or equal to 2 bytes.
+	if (length <= 2)
+		return true;
+
+	FrameArena::Scope arena(mArena);
+
+	mkvmuxer::Frame frame;
+	if (!frame.Init(data, length))
+		return false;
+
+	frame.set_track_number(trackNumber);
+	frame.set_timestamp(timestamp); // In nanoseconds.
+
+	frame.set_is_key(true); // Does this do anything for audio?
+
+	// Don't start another checkpoint while the disk is still busy with the
+	// last one; it is done on a later frame instead.
+	bool checkpointNow = mCheckpointInterval > 0 && timestamp >= mNextCheckpoint && !mWriter.syncPending();
+
+	// The current cluster's size is only written when the next one starts,
+	// so start one with this frame. Live clusters don't have sizes.
+	if (checkpointNow && !mLive)
+		mSegment.ForceNewCluster();
+
+	{
+		TRACE_SCOPE("AddGenericFrame");
+		if (!mSegment.AddGenericFrame(&frame))
+			return false;
+	}
+
+	if (checkpointNow && !checkpoint(timestamp))
+		return false;
+
+	// Don't wait for a buffer to fill up before whoever is listening gets it.
+	if (mLive)
+		mWriter.flush();
+	return true;
+}
+
+void WebmMuxer::setCheckpointInterval(int milliseconds)
+{
+	mCheckpointInterval = milliseconds > 0 ? static_cast<uint64_t>(milliseconds) * 1000000 : 0;
+}
+
+bool WebmMuxer::checkpoint(uint64_t timestamp)
+{
+	TRACE_SCOPE("checkpoint");
+	mNextCheckpoint = timestamp + mCheckpointInterval;
+
+	// The duration is written as a placeholder when the segment is started
+	// (only for seekable files), and normally filled in by Finalize(). It is
+	// always a 4 byte float, so it can be written over.
+	if (mWriter.durationPosition >= 0)
+	{
+		int64_t end = mWriter.Position();
+		double duration = static_cast<double>(timestamp) / mSegment.GetSegmentInfo()->timecode_scale();
+		if (mWriter.Position(mWriter.durationPosition) != 0 ||
+		    !mkvmuxer::WriteEbmlElement(&mWriter, libwebm::kMkvDuration, static_cast<float>(duration)) ||
+		    mWriter.Position(end) != 0)
+			return false;
+	}
+
+	mWriter.sync();
+	return true;
+}
+
+void WebmMuxer::Writer::ElementStartNotify(mkvmuxer::uint64 elementId, mkvmuxer::int64 position)
+{
+	if (elementId == libwebm::kMkvDuration && durationPosition < 0)
+		durationPosition = position;
+}
+
+uint64_t WebmMuxer::bytesWritten() const
+{
+	return mWriter.Position();
+}
+
+bool WebmMuxer::close()
+{
+	bool success = true;
+	if (mFinalize)
+	{
+		success = mSegment.Finalize();
+		success = mWriter.close() && success;
+		mFinalize = false;
+	}
+	return success;
+}
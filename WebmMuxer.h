@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <mkvmuxer/mkvmuxer.h>
+
+#include "AsyncFileWriter.h"
+#include "Container.h"
+#include "FrameArena.h"
+
+// Writes Opus tracks to a WebM file (basically Matroska).
+class WebmMuxer : public Container
+{
+public:
+	WebmMuxer();
+	virtual ~WebmMuxer();
+
+	virtual bool open(const std::string& filename) override;
+
+	// In live mode the segment and clusters have unknown sizes and there are
+	// no cues. Each frame is passed on as soon as it is written, and a new
+	// cluster is started at least every `clusterMilliseconds`.
+	virtual bool openLive(const std::string& output, int clusterMilliseconds) override;
+
+	virtual uint64_t addOpusTrack(int samplingRate, int channels, const std::vector<uint8_t>& opusHead, int maxPacketLength) override;
+
+	// Packets of 2 bytes or less are dropped, since the timestamps say that
+	// there's a gap.
+	virtual bool writeFrame(uint64_t trackNumber, const uint8_t* data, int length, uint64_t timestamp) override;
+
+	// A checkpoint starts a new cluster, so that the last one's size is
+	// filled in, and writes the duration so far over mkvmuxer's placeholder.
+	// The file has no cues until it is finished; `OpusRec repair` can add
+	// them to one that never was.
+	virtual void setCheckpointInterval(int milliseconds) override;
+
+	virtual uint64_t bytesWritten() const override;
+	virtual bool close() override;
+
+private:
+	WebmMuxer(const WebmMuxer&) = delete;
+	WebmMuxer& operator=(const WebmMuxer&) = delete;
+
+	// Set up the segment once mWriter is open.
+	bool initSegment();
+
+	// Update the duration and sync the file. `timestamp` is that of the
+	// frame that has just been written.
+	bool checkpoint(uint64_t timestamp);
+
+	// Notes where mkvmuxer puts the segment duration, so that it can be
+	// filled in before the file is finished.
+	class Writer : public AsyncFileWriter
+	{
+	public:
+		virtual void ElementStartNotify(mkvmuxer::uint64 elementId, mkvmuxer::int64 position) override;
+
+		// Where the Duration element is, or -1 if it hasn't been written.
+		int64_t durationPosition = -1;
+	};
+
+	// mkvmuxer copies every frame; the copies come from here. It is declared
+	// first so that it outlives everything in mSegment.
+	FrameArena mArena;
+	Writer mWriter;
+	mkvmuxer::Segment mSegment;
+	bool mFinalize = false;
+	bool mLive = false;
+	// In nanoseconds, or 0 for no checkpoints.
+	uint64_t mCheckpointInterval = 0;
+	uint64_t mNextCheckpoint = 0;
+};
@@ -0,0 +1,156 @@
+#include "WebmRepair.h"
+
+#include <mkvparser/mkvparser.h>
+#include <mkvparser/mkvreader.h>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "WebmMuxer.h"
+
+using namespace std;
+
+typedef function<bool(const mkvparser::Block& block, const mkvparser::Block::Frame& frame, long long timestamp)> FrameCallback;
+
+// Call `callback` for every frame of every block that mkvparser loaded, in
+// file order, until it returns false. It stops at the first block that
+// can't be parsed, which is where the file was cut off.
+static void forEachFrame(mkvparser::Segment& segment, const FrameCallback& callback)
+{
+	for (const mkvparser::Cluster* cluster = segment.GetFirst(); cluster != nullptr && !cluster->EOS(); cluster = segment.GetNext(cluster))
+	{
+		const mkvparser::BlockEntry* entry = nullptr;
+		long status = cluster->GetFirst(entry);
+		while (status >= 0 && entry != nullptr && !entry->EOS())
+		{
+			const mkvparser::Block* block = entry->GetBlock();
+			for (int i = 0; i < block->GetFrameCount(); ++i)
+			{
+				if (!callback(*block, block->GetFrame(i), block->GetTime(cluster)))
+					return;
+			}
+			status = cluster->GetNext(entry, entry);
+		}
+	}
+}
+
+bool RepairWebm(const string& infile, const string& outfile)
+{
+	mkvparser::MkvReader reader;
+	if (reader.Open(infile.c_str()) != 0)
+	{
+		cerr << "Unable to open " << infile << endl;
+		return false;
+	}
+
+	long long position = 0;
+	mkvparser::EBMLHeader ebmlHeader;
+	mkvparser::Segment* parsed = nullptr;
+	if (ebmlHeader.Parse(&reader, position) < 0 || mkvparser::Segment::CreateInstance(&reader, position, parsed) != 0 || parsed == nullptr)
+	{
+		cerr << infile << " isn't a WebM file." << endl;
+		return false;
+	}
+	unique_ptr<mkvparser::Segment> segment(parsed);
+
+	// This fails where the file is cut off, but the clusters before that can
+	// still be read.
+	long status = segment->Load();
+	const mkvparser::Tracks* tracks = segment->GetTracks();
+	if (tracks == nullptr)
+	{
+		cerr << "Unable to read the tracks in " << infile << endl;
+		return false;
+	}
+	if (status < 0)
+		cerr << infile << " is cut off; recovering everything before that." << endl;
+
+	// The muxer's buffers are sized for the longest packet.
+	long maxPacketLength = 0;
+	forEachFrame(*segment, [&](const mkvparser::Block&, const mkvparser::Block::Frame& frame, long long) {
+		maxPacketLength = max(maxPacketLength, frame.len);
+		return true;
+	});
+
+	WebmMuxer muxer;
+	if (!muxer.open(outfile))
+	{
+		cerr << "Unable to open output file: " << outfile << endl;
+		return false;
+	}
+
+	// From the input's track numbers to the output's.
+	map<long long, uint64_t> trackNumbers;
+	for (unsigned long i = 0; i < tracks->GetTracksCount(); ++i)
+	{
+		const mkvparser::Track* track = tracks->GetTrackByIndex(i);
+		if (track == nullptr)
+			continue;
+
+		const char* codecId = track->GetCodecId();
+		if (track->GetType() != mkvparser::Track::kAudio || codecId == nullptr || strcmp(codecId, "A_OPUS") != 0)
+		{
+			cerr << "Skipping track " << track->GetNumber() << ", which isn't Opus." << endl;
+			continue;
+		}
+
+		const mkvparser::AudioTrack* audio = static_cast<const mkvparser::AudioTrack*>(track);
+		size_t opusHeadSize = 0;
+		const unsigned char* opusHead = track->GetCodecPrivate(opusHeadSize);
+		vector<uint8_t> head;
+		if (opusHead != nullptr)
+			head.assign(opusHead, opusHead + opusHeadSize);
+
+		uint64_t number = muxer.addOpusTrack(static_cast<int>(audio->GetSamplingRate()), static_cast<int>(audio->GetChannels()), head, static_cast<int>(maxPacketLength));
+		if (number == 0)
+		{
+			cerr << "Unable to add track " << track->GetNumber() << " to " << outfile << endl;
+			return false;
+		}
+		trackNumbers[track->GetNumber()] = number;
+	}
+
+	if (trackNumbers.empty())
+	{
+		cerr << infile << " has no Opus tracks." << endl;
+		return false;
+	}
+
+	vector<uint8_t> packet;
+	uint64_t packets = 0;
+	long long lastTimestamp = 0;
+	bool writeFailed = false;
+	forEachFrame(*segment, [&](const mkvparser::Block& block, const mkvparser::Block::Frame& frame, long long timestamp) {
+		map<long long, uint64_t>::const_iterator track = trackNumbers.find(block.GetTrackNumber());
+		if (track == trackNumbers.end())
+			return true;
+
+		// The last frame may be only partly there.
+		packet.resize(max(frame.len, 1L));
+		if (frame.len <= 0 || frame.Read(&reader, packet.data()) != 0)
+			return false;
+
+		if (!muxer.writeFrame(track->second, packet.data(), static_cast<int>(frame.len), static_cast<uint64_t>(max(timestamp, 0LL))))
+		{
+			writeFailed = true;
+			return false;
+		}
+		++packets;
+		lastTimestamp = max(lastTimestamp, timestamp);
+		return true;
+	});
+
+	if (!muxer.close() || writeFailed)
+	{
+		cerr << "Error writing " << outfile << endl;
+		return false;
+	}
+
+	cerr << "Recovered " << packets << " packets, " << lastTimestamp / 1e9 << " s, to " << outfile << endl;
+	return true;
+}
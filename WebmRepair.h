@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+// Rebuild a WebM file that was never finished, because the program was
+// killed or the power went off, so that it has a duration, cues and sizes
+// like any other. Every Opus packet that can be read is copied to
+// `outfile` with its original timestamp; the input is left alone. A file
+// that is cut off part way through a cluster keeps everything up to the
+// last complete frame. Prints an error and returns false on failure.
+bool RepairWebm(const std::string& infile, const std::string& outfile);
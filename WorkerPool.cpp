@@ -0,0 +1,80 @@
+#include "WorkerPool.h"
+
+#include "Semaphore.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+
+WorkerPool::WorkerPool(int threads, Semaphore& wakeup) : mThreadCount(std::max(threads, 1)), mWakeup(wakeup)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+void WorkerPool::add(std::function<bool()> job)
+{
+	std::unique_ptr<Job> j(new Job);
+	j->run = job;
+	mJobs.push_back(std::move(j));
+}
+
+void WorkerPool::start()
+{
+	for (int i = 0; i < mThreadCount; ++i)
+		mThreads.push_back(std::thread(&WorkerPool::workerThread, this));
+}
+
+void WorkerPool::stop()
+{
+	mStopping = true;
+	for (size_t i = 0; i < mThreads.size(); ++i)
+		mWakeup.post();
+	for (std::thread& t : mThreads)
+		t.join();
+	mThreads.clear();
+}
+
+int WorkerPool::defaultThreads(int jobs)
+{
+	int cores = static_cast<int>(std::thread::hardware_concurrency());
+	if (cores <= 0)
+		cores = 2;
+	return std::max(1, std::min(jobs, cores));
+}
+
+void WorkerPool::workerThread()
+{
+	TRACE_THREAD("worker");
+	while (!mStopping)
+	{
+		bool progress = false;
+		for (std::unique_ptr<Job>& job : mJobs)
+		{
+			if (job->busy.test_and_set())
+			{
+				// Another worker has it. It might have just missed the work we
+				// were woken for, so tell it to go round again. If it finished
+				// in the meantime we can run it ourselves.
+				job->pending = true;
+				if (job->busy.test_and_set())
+					continue;
+			}
+
+			job->pending = false;
+			if (job->run())
+				progress = true;
+			job->busy.clear();
+
+			if (job->pending)
+				progress = true;
+		}
+
+		// The timeout is just a backstop in case a wakeup is missed.
+		if (!progress)
+			mWakeup.waitFor(std::chrono::milliseconds(20));
+	}
+}
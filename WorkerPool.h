@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+class Semaphore;
+
+// Runs a set of jobs on a fixed number of threads.
+//
+// A job does whatever work it can without blocking and returns true if it
+// did anything. The workers keep calling the jobs until none of them has
+// anything to do, and then sleep until `wakeup` is posted (which anything
+// that produces work for the jobs should do). A job never runs on more than
+// one thread at a time, so jobs that are each end of an SPSC queue are safe.
+class WorkerPool
+{
+public:
+	WorkerPool(int threads, Semaphore& wakeup);
+	~WorkerPool();
+
+	// Add a job. Only call this before `start()`.
+	void add(std::function<bool()> job);
+
+	void start();
+
+	// Wait for the workers to finish what they are doing and exit.
+	void stop();
+
+	// A sensible number of threads for `jobs` jobs.
+	static int defaultThreads(int jobs);
+
+private:
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	struct Job
+	{
+		std::function<bool()> run;
+		// Set while a worker is running it.
+		std::atomic_flag busy = ATOMIC_FLAG_INIT;
+		// Set when another worker wanted to run it while it was busy.
+		std::atomic<bool> pending{false};
+	};
+
+	void workerThread();
+
+	int mThreadCount;
+	Semaphore& mWakeup;
+	std::vector<std::unique_ptr<Job>> mJobs;
+	std::vector<std::thread> mThreads;
+	std::atomic<bool> mStopping{false};
+};
@@ -10,124 +10,55 @@
 #include <docopt.h>
 
 #include <string>
+#include <fstream>
 #include <iostream>
 #include <map>
-#include <thread>
+#include <memory>
+#include <vector>
 #include <chrono>
 #include <atomic>
 
+#include "AudioInput.h"
+#include "Benchmark.h"
+#include "Container.h"
 #include "CtrlC.h"
-#include "RingBuffer.h"
+#include "FileEncoder.h"
+#include "Metrics.h"
+#include "MetricsExporter.h"
 #include "OpusWriter.h"
+#include "PcmFile.h"
+#include "Pipeline.h"
+#include "PrerollContainer.h"
+#include "Resampler.h"
+#include "RotatingContainer.h"
+#include "Semaphore.h"
+#include "Trace.h"
+#include "Trigger.h"
+#include "WebmRepair.h"
+#include "WorkerPool.h"
 
 using namespace std;
 //using namespace std::chrono_literals;
 
-// This is passed to the read callback in the `void* userdata` pointer.
-struct RecordContext
-{
-	explicit RecordContext(int cap) : ring_buffer(cap) {}
-	RingBuffer<uint8_t> ring_buffer;
-};
-
-static int min_int(int a, int b)
-{
-	return (a < b) ? a : b;
-}
-
 static atomic_bool ctrlcPressed(false);
 
+// Posted to wake up the main loop when Ctrl-C has been pressed.
+static Semaphore wakeup;
+
 void CtrlC()
 {
 	cerr << "Exiting..." << endl;
 	ctrlcPressed = true;
+	wakeup.post();
 }
 
-// This callback is called when libsoundio has some auto data to send us.
-static void read_callback(SoundIoInStream* instream, int frame_count_min, int frame_count_max)
-{
-	// Recover the RecordContext object.
-	RecordContext* rc = static_cast<RecordContext*>(instream->userdata);
-
-	size_t free_bytes = rc->ring_buffer.free();
-	int free_count = free_bytes / instream->bytes_per_frame;
-	
-	if (free_count < frame_count_min)
-	{
-		cerr << "Ring buffer overflow :(" << endl;
-		exit(1);
-	}
-
-	int write_frames = min_int(free_count, frame_count_max);
-	int frames_left = write_frames;
-	for (;;)
-	{
-		int frame_count = frames_left;
-		
-		SoundIoChannelArea* areas = nullptr;
-		
-		int err = soundio_instream_begin_read(instream, &areas, &frame_count);
-		if (err != SoundIoErrorNone)
-		{
-			cerr << "Begin read error: " << soundio_strerror(err) << endl;
-			exit(1);
-		}
-
-		if (frame_count == 0)
-			break;
-		
-		if (areas == nullptr)
-		{
-			// Due to an overflow there is a hole. Fill the ring buffer with
-			// silence for the size of the hole.
-			for (int i = 0; i < frame_count * instream->bytes_per_frame; ++i)
-			{
-				if (!rc->ring_buffer.push(0))
-				{
-					cerr << "Ring buffer overflow :/" << endl;
-					exit(1);
-				}
-			}
-		}
-		else
-		{
-			// Copy each frame.
-			for (int frame = 0; frame < frame_count; ++frame)
-			{
-				// Copy each channel for the frame.
-				for (int ch = 0; ch < instream->layout.channel_count; ++ch)
-				{
-					// Copy all the sample bytes for that sample.
-					for (int z = 0; z < instream->bytes_per_sample; ++z)
-					{
-						if (!rc->ring_buffer.push(areas[ch].ptr[z]))
-						{
-							cerr << "Ring buffer overflow D:" << endl;
-							exit(1);
-						}
-					}
-					areas[ch].ptr += areas[ch].step;
-				}
-			}
-		}
-		err = soundio_instream_end_read(instream);
-		if (err != SoundIoErrorNone)
-		{
-			cerr << "End read error: " << soundio_strerror(err) << endl;
-			exit(1);
-		}
+// Set by SIGUSR1 to save the pre-roll.
+static atomic_bool triggerRequested(false);
 
-		frames_left -= frame_count;
-		if (frames_left <= 0)
-			break;
-	}
-}
-
-static void overflow_callback(SoundIoInStream* instream)
+void UserSignal()
 {
-	(void)instream;
-	static int count = 0;
-	cerr << "Overflow " << ++count << endl;
+	triggerRequested = true;
+	wakeup.post();
 }
 
 static void backend_disconnect_callback(SoundIo* soundio, int err)
@@ -224,197 +155,461 @@ void printInputDevices(SoundIo* soundio)
 	}
 }
 
-void record(SoundIo* soundio, string device_id, bool is_raw, int samplingRate, int channels, int complexity, int bitrate, int duration, string outfile)
+// Insert `-<index>` before the extension of `filename`.
+static string numberedFilename(const string& filename, int index)
 {
-	// Find the device.
-	std::vector<int> selected_devices;
+	return Container::insertBeforeExtension(filename, "-" + to_string(index));
+}
 
-	for (int i = 0; i < soundio_input_device_count(soundio); ++i)
-	{
-		SoundIoDevice* device = soundio_get_input_device(soundio, i);
-		if (device == nullptr)
-		{
-			cerr << "Error getting device: " << i << endl;
-			return;
-		}
+// How many events `--trace` keeps from each thread. At 24 bytes each that is
+// 6 MB, which is several minutes of the busiest thread. It is all allocated
+// when tracing starts.
+static const size_t TraceEventsPerThread = 1 << 18;
 
-		if (device->is_raw == is_raw && (device_id.empty() || device->id == device_id))
-			selected_devices.push_back(i);
+// Settings for `record()`, from the command line.
+struct RecordOptions
+{
+	// Empty means the only device there is.
+	vector<string> device_ids;
+	bool is_raw = false;
+	int samplingRate = 48000;
+	int channels = 2;
+	int complexity = 10;
+	int bitrate = 64000;
+	// In seconds, or -1 to record until Ctrl-C.
+	int duration = -1;
+	string outfile;
+	bool separate_files = false;
+	// Capture at the device's own rate and resample it ourselves, rather
+	// than letting the backend do it.
+	bool native_rate = true;
+	Resampler::Quality resample_quality = Resampler::Quality_Medium;
+	// Stream live WebM rather than writing a file that is finished at the end.
+	bool live = false;
+	int cluster_ms = 1000;
+	Container::Format container = Container::Format_Auto;
+	// Start a new file after this many seconds or bytes, or 0 for no limit.
+	uint64_t segment_seconds = 0;
+	uint64_t segment_bytes = 0;
+	// Make the file playable and sync it to disk this often, or 0 not to.
+	int checkpoint_ms = 0;
+	// Keep this much in memory and only write it when triggered, or 0 to
+	// write everything.
+	uint64_t preroll_seconds = 0;
+	// After a trigger, write for this long and then go back to waiting, or
+	// 0 to keep writing.
+	uint64_t postroll_seconds = 0;
+	// A Trigger source, as well as SIGUSR1.
+	string trigger;
+	// Let the encoder send almost nothing during silence.
+	bool dtx = false;
+	// Only encode frames louder than `gate_db` (dBFS), plus the hangover
+	// after and the pre-roll before them.
+	bool gate = false;
+	int gate_db = -50;
+	int gate_hangover_ms = 500;
+	int gate_preroll_ms = 200;
+	// Where to make the metrics available (see MetricsExporter), or empty
+	// not to.
+	string metrics;
+	// Where to write a Chrome trace when recording stops, or empty not to
+	// trace.
+	string trace;
+};
 
-		soundio_device_unref(device);
+void record(SoundIo* soundio, const RecordOptions& options)
+{
+	// Default 20ms is best.
+	const OpusWriter::FrameLength frameLen = OpusWriter::Frame_20ms;
+
+	// The number of samples in one frame.
+	const int samplesPerFramePerChannel = options.samplingRate * frameLen / 1000000;
+
+	// Posted when there's work for the worker pool: when there's captured
+	// audio, or the mux thread frees up space for more packets.
+	Semaphore workReady;
+	// Posted when there's an encoded packet for the mux thread.
+	Semaphore packetReady;
+
+	// With no --device use the only device there is.
+	vector<string> device_ids = options.device_ids;
+	if (device_ids.empty())
+		device_ids.push_back("");
+
+	vector<unique_ptr<AudioInput>> inputs;
+	for (const string& device_id : device_ids)
+	{
+		unique_ptr<AudioInput> input(new AudioInput);
+		if (!input->open(soundio, device_id, options.is_raw, options.samplingRate, options.native_rate, options.channels, samplesPerFramePerChannel, workReady))
+			return;
+		inputs.push_back(move(input));
 	}
 
-	if (selected_devices.size() != 1)
+	// Ok now initialise Opus. Several inputs are written as tracks of one file
+	// unless they are wanted separately.
+	bool interleave = inputs.size() > 1 && !options.separate_files;
+
+	if (options.live && options.outfile == "-" && inputs.size() > 1 && options.separate_files)
 	{
-		cerr << "Device not found, or too many devices: " << device_id << endl;
+		cerr << "Only one stream can be written to stdout." << endl;
 		return;
 	}
 
-	SoundIoDevice* device = soundio_get_input_device(soundio, selected_devices[0]);
-	if (device == nullptr)
+	bool rotate = options.segment_seconds > 0 || options.segment_bytes > 0;
+	if (options.live && rotate)
 	{
-		cerr << "Error getting device 0" << endl;
+		cerr << "Live streams can't be split into segments." << endl;
 		return;
 	}
 
-	cout << "Device: " << device->name << (device->is_raw ? " raw" : " not raw") << endl;
-
-	if (device->probe_error)
+	bool preroll = options.preroll_seconds > 0;
+	if (preroll && (options.live || rotate))
 	{
-		cerr << "Unable to probe device: " << soundio_strerror(device->probe_error) << endl;
+		cerr << "A pre-roll can't be used with --live or segments." << endl;
 		return;
 	}
 
-	soundio_device_sort_channel_layouts(device);
-
-	SoundIoFormat fmt = SoundIoFormatS16LE;
+	Trigger trigger;
+	if (!options.trigger.empty() && !trigger.open(options.trigger))
+		return;
 
-	// Open the input stream.
-	SoundIoInStream* instream = soundio_instream_create(device);
-	if (instream == nullptr)
+	// A shared file is opened here, as are live streams, segmented files,
+	// checkpointed files and pre-rolls since OpusWriter only makes normal
+	// files. Otherwise each OpusWriter makes its own.
+	vector<unique_ptr<Container>> muxers;
+	vector<PrerollContainer*> prerolls;
+	size_t muxerCount = interleave ? 1 : (options.live || rotate || preroll || options.checkpoint_ms > 0 ? inputs.size() : 0);
+	for (size_t i = 0; i < muxerCount; ++i)
 	{
-		cerr << "Out of memory" << endl;
-		return;
+		string outfile = muxerCount > 1 ? numberedFilename(options.outfile, i + 1) : options.outfile;
+		unique_ptr<Container> muxer;
+		if (preroll)
+		{
+			uint64_t tracks = interleave ? inputs.size() : 1;
+			prerolls.push_back(new PrerollContainer(options.container, options.preroll_seconds, options.postroll_seconds, tracks * options.bitrate / 8));
+			muxer.reset(prerolls.back());
+		}
+		else if (rotate)
+			muxer.reset(new RotatingContainer(options.container, options.segment_seconds, options.segment_bytes));
+		else
+			muxer.reset(Container::create(options.container, outfile));
+		bool opened = options.live ? muxer->openLive(outfile, options.cluster_ms) : muxer->open(outfile);
+		if (!opened)
+		{
+			cerr << "Unable to open output file: " << outfile << endl;
+			return;
+		}
+		muxer->setCheckpointInterval(options.checkpoint_ms);
+		muxers.push_back(move(muxer));
 	}
 
-	cout << "Default format: " << instream->format << " sample rate: " << instream->sample_rate << endl;
-
-	int capacity = samplingRate * 30 * 4;
+	vector<unique_ptr<OpusWriter>> writers;
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		OpusWriter::SamplingRate rate = static_cast<OpusWriter::SamplingRate>(options.samplingRate);
+		OpusWriter::Channels chans = static_cast<OpusWriter::Channels>(options.channels);
+		OpusWriter::ComputationalComplexity comp = static_cast<OpusWriter::ComputationalComplexity>(options.complexity);
+		// Each input may have negotiated a different kind of layout.
+		OpusWriter::ChannelMapping mapping = inputs[i]->isSurround() ? OpusWriter::Mapping_Surround : OpusWriter::Mapping_Discrete;
+
+		unique_ptr<OpusWriter> writer;
+		if (!muxers.empty())
+			writer.reset(new OpusWriter(*muxers[interleave ? 0 : i], rate, chans, frameLen, options.bitrate, comp, mapping));
+		else
+			writer.reset(new OpusWriter(inputs.size() > 1 ? numberedFilename(options.outfile, i + 1) : options.outfile, rate, chans, frameLen, options.bitrate, comp, mapping, options.container));
 
-	RecordContext rc(capacity);
+		if (writer->status() != OpusWriter::Status_Ok)
+		{
+			cerr << "Opus error: " << writer->status() << endl; // TODO: Convert to readable string.
+			return;
+		}
+		if (options.dtx && !writer->setDtx(true))
+		{
+			cerr << "Unable to turn on DTX." << endl;
+			return;
+		}
+		writers.push_back(move(writer));
+	}
 
-	instream->format = fmt;
-	instream->sample_rate = samplingRate;
-	instream->read_callback = read_callback;
-	instream->overflow_callback = overflow_callback;
-	instream->userdata = &rc;
-	instream->layout = *soundio_channel_layout_get_default(channels);
+	// Timestamps in the output are relative to this, for all the inputs.
+	int64_t clockOrigin = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
 
-	cout << "Opening with format: " << instream->format << " sample rate: " << instream->sample_rate << endl;
+	// Convert and encode every input on a shared pool of threads, and write
+	// on another thread.
+	int workers = WorkerPool::defaultThreads(2 * inputs.size());
+	WorkerPool pool(workers, workReady);
 
-	int err = soundio_instream_open(instream);
-	if (err != SoundIoErrorNone)
+	vector<unique_ptr<Pipeline>> pipelines;
+	vector<Pipeline*> muxed;
+	for (size_t i = 0; i < inputs.size(); ++i)
 	{
-		cerr << "Unable to open input stream: " << soundio_strerror(err) << endl;
-		return;
+		pipelines.emplace_back(new Pipeline(*inputs[i], *writers[i], options.resample_quality, clockOrigin, workReady, packetReady));
+		if (pipelines.back()->failed())
+		{
+			cerr << "Unable to resample " << inputs[i]->name() << " from " << inputs[i]->sampleRate() << " Hz. Try --resample=off." << endl;
+			return;
+		}
+		if (options.gate)
+			pipelines.back()->setVoiceGate(options.gate_db, options.gate_hangover_ms, options.gate_preroll_ms);
+		pipelines.back()->addJobs(pool);
+		muxed.push_back(pipelines.back().get());
 	}
 
-	cerr << instream->layout.name << " " << samplingRate << " Hz " << soundio_format_string(fmt) << endl;
+	MuxThread mux(muxed, interleave, workReady, packetReady);
 
-	err = soundio_instream_start(instream);
-	if (err != SoundIoErrorNone)
+	// These only read counters that the inputs and pipelines keep anyway.
+	Metrics metrics;
+	MetricsExporter exporter(metrics);
+	if (!options.metrics.empty())
 	{
-		cerr <<  "Unable to start input device: " << soundio_strerror(err) << endl;
-		return;
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			Metrics::Labels labels = {{"input", to_string(i)}, {"device", inputs[i]->name()}};
+			inputs[i]->addMetrics(metrics, labels);
+			pipelines[i]->addMetrics(metrics, labels);
+		}
+		if (!exporter.start(options.metrics, 1000))
+			return;
 	}
 
-
-	// Ok now initialise Opus. Default 20ms is best.
-	const OpusWriter::FrameLength frameLen = OpusWriter::Frame_20ms;
-	
-	OpusWriter writer(outfile,
-	                  static_cast<OpusWriter::SamplingRate>(samplingRate),
-		              static_cast<OpusWriter::Channels>(channels),
-		              frameLen,
-		              bitrate,
-		              static_cast<OpusWriter::ComputationalComplexity>(complexity));
-	
-	if (writer.status() != OpusWriter::Status_Ok)
-	{
-		cerr << "Opus error: " << writer.status() << endl; // TODO: Convert to readable string.
+	// Trace the capture threads, the workers, the mux thread and the file
+	// I/O threads, with room for a second set of files while segments and
+	// pre-roll files are finished in the background.
+	int traceThreads = static_cast<int>(inputs.size()) + workers + 1 + 2 * static_cast<int>(max(muxerCount, inputs.size()));
+	if (!options.trace.empty() && !Tracer::start(TraceEventsPerThread, traceThreads))
 		return;
-	}
 
-	// The next frame to write.
-	const int samplesPerFramePerChannel = samplingRate * frameLen / 1000000;
-	// The audio from libsoundio for one frame.
-	uint8_t audio_frame_input[samplesPerFramePerChannel * sizeof(int16_t) * channels];
+	pool.start();
+	mux.start();
 
-	// Number of bytes in the frame we have filled.
-	unsigned int frameFilled = 0;
+	bool started = true;
+	for (unique_ptr<AudioInput>& input : inputs)
+		started = started && input->start();
 
 	// Set up ctrl-c handler.
 	SetCtrlCHandler(CtrlC);
+	if (preroll)
+		SetUserSignalHandler(UserSignal);
 	
 	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	// When to next print the progress and check the duration.
+	std::chrono::steady_clock::time_point nextReport = start;
+	// The number of overflows that have been printed for each input.
+	vector<uint64_t> reportedOverflows(inputs.size(), 0);
 	
-	while (!ctrlcPressed)
+	while (started && !ctrlcPressed)
 	{
-		int secondsPassed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count();
-		cerr << secondsPassed << endl;
+		if (preroll && (triggerRequested.exchange(false) || trigger.poll()))
+		{
+			cerr << "Triggered" << endl;
+			for (PrerollContainer* container : prerolls)
+				container->trigger();
+		}
 
-		if (duration >= 0 && secondsPassed >= duration)
-			break;
-		
-		soundio_flush_events(soundio);
-		
-		this_thread::sleep_for(chrono::seconds(1));
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now < nextReport)
+		{
+			// Sleep until it is time to report progress, or Ctrl-C.
+			wakeup.waitFor(std::chrono::duration_cast<std::chrono::microseconds>(nextReport - now));
+			continue;
+		}
 
-		int available = rc.ring_buffer.size();
+		int secondsPassed = std::chrono::duration_cast<std::chrono::seconds>(now - start).count();
+		cerr << secondsPassed << endl;
 
-		// There are `available` bytes available.
-		for (int i = 0; i < available; ++i)
+		// The inputs don't print anything themselves since they run on
+		// libsoundio's realtime thread.
+		bool inputFailed = false;
+		for (size_t i = 0; i < inputs.size(); ++i)
 		{
-			if (!rc.ring_buffer.pop(audio_frame_input[frameFilled]))
+			uint64_t overflows = inputs[i]->overflows();
+			if (overflows != reportedOverflows[i])
 			{
-				// This should never happen. TODO: Make this an assert.
-				cerr << "Error reading ring buffer." << endl;
-				exit(1);
+				cerr << inputs[i]->name() << ": overflow " << overflows << endl;
+				reportedOverflows[i] = overflows;
 			}
-			
-			++frameFilled;
-
-			// If the frame is full, write it.
-			if (frameFilled >= sizeof(audio_frame_input))
+			string error = inputs[i]->error();
+			if (!error.empty())
 			{
-				frameFilled = 0;
-
-				// The audio mixed down to mono.
-				int16_t audio_frame[frameLen];
-
-				for (int s = 0; s < frameLen; ++s)
-				{
-					// Just take the first channel for now. TODO: Fix this.
-					int32_t av = 0;
-					for (int c = 0; c < channels; ++c)
-					{
-						int idx = (s * channels + c) * sizeof(int16_t);
-						int16_t sample = static_cast<int16_t>(audio_frame_input[idx+1] << 8) + audio_frame_input[idx];
-						av += sample;
-					}
-					av /= channels;
-					audio_frame[s] = av;
-				}
-
-				// Encode to Opus.
-				
-				writer.write(audio_frame, frameLen);
-				
-				if (writer.status() != OpusWriter::Status_Ok)
-				{
-					// TODO: Convert to string.
-					cerr << "Opus writer error: " << writer.status() << endl;
-					return;
-				}
+				cerr << inputs[i]->name() << ": " << error << endl;
+				inputFailed = true;
 			}
 		}
+		if (inputFailed)
+			break;
+
+		if (options.duration >= 0 && secondsPassed >= options.duration)
+			break;
+
+		bool failed = mux.failed();
+		for (unique_ptr<Pipeline>& pipeline : pipelines)
+			failed = failed || pipeline->failed();
+		if (failed)
+		{
+			// TODO: Convert to string.
+			for (unique_ptr<OpusWriter>& writer : writers)
+				cerr << "Opus writer error: " << writer->status() << endl;
+			break;
+		}
+		
+		soundio_flush_events(soundio);
+
+		nextReport += chrono::seconds(1);
 	}
 
+	// Stop capturing, then encode and write whatever is left.
+	for (unique_ptr<AudioInput>& input : inputs)
+		input->close();
+	for (unique_ptr<Pipeline>& pipeline : pipelines)
+		pipeline->finish();
+	mux.join();
+	pool.stop();
+	exporter.stop();
 
-	soundio_instream_destroy(instream);
-	soundio_device_unref(device);
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		cerr << inputs[i]->name() << ": " << inputs[i]->overflows() << " overflows" << endl;
+		pipelines[i]->printStats(cerr);
+	}
 	
-	if (!writer.close())
+	bool closed = true;
+	for (unique_ptr<OpusWriter>& writer : writers)
+		closed = writer->close() && closed;
+	for (unique_ptr<Container>& muxer : muxers)
+		closed = muxer->close() && closed;
+	if (!closed)
 	{
 		cerr << "Error closing file." << endl;
 	}
+
+	// The files' IO threads have finished now too.
+	if (!options.trace.empty())
+		Tracer::stop(options.trace);
+}
+
+static const std::map<std::string, PcmFile::SampleFormat> rawFormats = {
+    {"s16le", PcmFile::Format_S16LE},
+    {"s16be", PcmFile::Format_S16BE},
+    {"s24le", PcmFile::Format_S24LE},
+    {"s24be", PcmFile::Format_S24BE},
+    {"s32le", PcmFile::Format_S32LE},
+    {"s32be", PcmFile::Format_S32BE},
+    {"f32le", PcmFile::Format_F32LE},
+    {"f32be", PcmFile::Format_F32BE},
+};
+
+static void printThroughput(const EncodeStats& stats)
+{
+	cerr << stats.audioSeconds << " s in " << stats.seconds << " s: "
+	     << stats.realtimeMultiple() << "x realtime, "
+	     << (stats.seconds > 0.0 ? stats.bytes / stats.seconds / 1e6 : 0.0) << " MB/s" << endl;
+}
+
+// Encode one file and report how fast it was.
+bool encode(const string& infile, const string& outfile, const OpenInput& open, const EncodeOptions& options)
+{
+	PcmFile input;
+	if (!open(input, infile))
+		return false;
+
+	cerr << infile << ": " << input.sampleRate() << " Hz, " << input.channels() << " channels, " << input.frames() << " frames" << endl;
+
+	EncodeStats stats;
+	if (!EncodeFile(input, outfile, options, stats))
+		return false;
+
+	cerr << "Encoded ";
+	printThroughput(stats);
+	return true;
+}
+
+// Read the list of files for `batch()`. Each line is an input and output
+// filename separated by a tab, or by a space if there is no tab. Empty lines
+// and lines starting with # are ignored.
+static bool readManifest(istream& is, vector<BatchJob>& jobs)
+{
+	string line;
+	while (getline(is, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		size_t split = line.find('\t');
+		if (split == string::npos)
+			split = line.find(' ');
+		if (split == string::npos || split == 0 || split + 1 == line.size())
+		{
+			cerr << "Invalid line in manifest: " << line << endl;
+			return false;
+		}
+
+		BatchJob job;
+		job.input = line.substr(0, split);
+		job.output = line.substr(split + 1);
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+// Encode all the files in a manifest (or stdin if it is empty or "-") and
+// report how fast each one and the whole lot were.
+bool batch(const string& manifest, const OpenInput& open, const EncodeOptions& options)
+{
+	vector<BatchJob> jobs;
+	if (manifest.empty() || manifest == "-")
+	{
+		if (!readManifest(cin, jobs))
+			return false;
+	}
+	else
+	{
+		ifstream file(manifest);
+		if (!file)
+		{
+			cerr << "Unable to open manifest: " << manifest << endl;
+			return false;
+		}
+		if (!readManifest(file, jobs))
+			return false;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	EncodeBatch(jobs, options, open);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	EncodeStats total;
+	total.seconds = seconds;
+	int failures = 0;
+	for (const BatchJob& job : jobs)
+	{
+		cerr << job.input << " -> " << job.output << ": ";
+		if (job.ok)
+			printThroughput(job.stats);
+		else
+			cerr << "failed" << endl;
+
+		failures += job.ok ? 0 : 1;
+		total.audioSeconds += job.stats.audioSeconds;
+		total.bytes += job.stats.bytes;
+	}
+
+	cerr << jobs.size() << " files, " << failures << " failed, "
+	     << (seconds > 0.0 ? jobs.size() / seconds : 0.0) << " files/s, ";
+	printThroughput(total);
+	return failures == 0;
 }
 
 static const char USAGE[] =
 R"(OpusRec
 
     Usage:
-      OpusRec record [--raw] [--rate=<hz>] [--channels=<n>] [--complexity=<n>] [--bitrate=<bps>] [--backend=<backend>] [--device=<id>] [--duration=<s>] <output_file>
+      OpusRec record [--raw] [--rate=<hz>] [--channels=<n>] [--complexity=<n>] [--bitrate=<bps>] [--backend=<backend>] [--device=<id>...] [--separate-files] [--resample=<quality>] [--duration=<s>] [--live [--cluster-ms=<ms>]] [--container=<format>] [--segment-seconds=<s>] [--segment-bytes=<n>] [--checkpoint-ms=<ms>] [--preroll=<s> [--postroll=<s>] [--trigger=<source>]] [--dtx] [--gate=<db> [--gate-hangover=<ms>] [--gate-preroll=<ms>]] [--metrics=<target>] [--trace=<file>] <output_file>
+      OpusRec encode [--format=<format>] [--input-rate=<hz>] [--input-channels=<n>] [--rate=<hz>] [--complexity=<n>] [--bitrate=<bps>] [--resample=<quality>] [--threads=<n>] [--container=<format>] <input> <output_file>
+      OpusRec batch [--format=<format>] [--input-rate=<hz>] [--input-channels=<n>] [--rate=<hz>] [--complexity=<n>] [--bitrate=<bps>] [--resample=<quality>] [--threads=<n>] [--container=<format>] [<manifest>]
+      OpusRec repair <input> <output_file>
+      OpusRec benchmark [--signal=<signal>] [--sample-format=<format>] [--input-rate=<hz>] [--rate=<hz>] [--channels=<n>] [--complexity=<n>] [--frame-ms=<ms>] [--bitrate=<bps>] [--resample=<quality>] [--inputs=<n>] [--threads=<n>] [--seconds=<s>]
       OpusRec devices [--backend=<backend>]
       OpusRec (-h | --help)
       OpusRec --version
@@ -424,14 +619,127 @@ R"(OpusRec
       --version              Print the version and exit.
       --raw                  Use the raw input from the device.
       --rate=<hz>            Set the sampling rate in Hz. Must be one of 8000, 12000, 16000, 24000, or 48000. Defaults to the highest supported value.
-      --channels=<channels>  Set the number of channels. Must be 2 or 1. Defaults to the highest supported number. If the device supports stereo and you use --channels 1 it will be downmixed.
+      --channels=<channels>  Set the number of channels, from 1 to 255. Defaults to 2. If the device supports stereo and you use --channels 1 it will be downmixed. For more than 2 the device must have a channel layout with exactly that many channels. Surround layouts up to 7.1 are encoded as surround; anything else as independent channels.
       --complexity=<n>       An integer from 0-10 inclusive. The computational effort that is used for encoding. Default 7.
-      --bitrate=<bps>        Average bitrate in bits per second. Default 64000.
+      --bitrate=<bps>        Average bitrate in bits per second, for all channels together. Default 64000, or 32000 per channel for more than 2 channels.
       --backend=<backend>    Set the audio system to use. Defaults to the first one that works.
-      --device=<device_id>   Select a specific device from its device ID (use `OpusRec devices`). Required if there is more than one device.
+      --device=<device_id>   Select a specific device from its device ID (use `OpusRec devices`). Required if there is more than one device. Give it more than once to record from several devices at the same time.
+      --separate-files       When recording from several devices, write each one to its own file (<output_file> with -1, -2 etc. added) rather than as separate tracks in one file.
+      --resample=<quality>   Capture at the device's own sampling rate and resample to --rate with the given quality: low, medium or high. Default medium. Use "off" to ask the device for --rate and let the audio system resample if it has to. Files are resampled if they aren't at --rate.
       --duration=<s>         Stop recording after the given number of seconds. Default to infinite (stop with Ctrl-C).
+      --live                 Stream live WebM that can be played while it is being recorded, with no index and unknown sizes, and pass each packet on straight away. <output_file> can be "-" for stdout, "unix:<path>" to connect to a Unix domain socket, or a FIFO.
+      --cluster-ms=<ms>      With --live, start a new WebM cluster or Ogg page at least this often. For WebM this is how soon something that starts reading part way through can start playing; for Ogg it is also how often data is passed on. Default 1000.
+      --segment-seconds=<s>  Split the recording into files of this many seconds, named <output_file> with -0001, -0002 etc. added. Each file is finished in the background as the next one starts, and no audio is lost or repeated between them.
+      --segment-bytes=<n>    Split the recording into files of about this many bytes, as for --segment-seconds. Both can be used together.
+      --checkpoint-ms=<ms>   Every this many milliseconds make sure the file can be played as it is and is on the disk, so that no more than this much is lost if OpusRec is killed or the power goes off. WebM files are still missing their index (cues) after that; use `OpusRec repair` to add it. Default 0 (off).
+      --preroll=<s>          Keep the last <s> seconds of encoded audio in memory and only write a file when triggered, by SIGUSR1 or --trigger. The file (<output_file> with the date and time added) starts with what was kept and carries on live.
+      --postroll=<s>         With --preroll, finish the file this many seconds after the last trigger and go back to waiting. Default 0: keep writing until recording stops.
+      --trigger=<source>     With --preroll, also trigger on a connection to the Unix domain socket "unix:<path>", or when the file <source> is touched.
+      --dtx                  Discontinuous transmission: during silence the encoder only sends a tiny update every 400 ms, which the player fills with comfort noise.
+      --gate=<db>            Voice activated recording: only encode audio that is louder than <db> dB relative to full scale (e.g. -50), which saves CPU as well as space. The quiet parts are left out of the file as gaps.
+      --gate-hangover=<ms>   With --gate, keep encoding for this long after the audio goes quiet. Default 500.
+      --gate-preroll=<ms>    With --gate, also encode this much from before the audio got loud. Default 200.
+      --metrics=<target>     Make live metrics available: ring buffer fill, callback and encode times, overflows, stalls and bytes written. "unix:<path>" serves them in the Prometheus text format on a Unix domain socket (`curl --unix-socket <path> http://localhost/metrics`); anything else is a JSON file that is rewritten every second.
+      --trace=<file>         Record when the read callback, conversion, encoding and writing run on each thread, and write it to <file> when recording stops, to be opened in chrome://tracing or ui.perfetto.dev. Only the last few minutes are kept.
+      --container=<format>   The output file format: webm or ogg. By default it is Ogg if the output filename ends in .ogg, .opus or .oga, and WebM otherwise. Ogg has less overhead, which matters at low bitrates.
+      --format=<format>      Encode a raw PCM file with no header, in one of these sample formats: s16le, s16be, s24le, s24be (packed in 3 bytes), s32le, s32be, f32le or f32be. Without this <input> must be a WAV file.
+      --input-rate=<hz>      The sampling rate of a raw PCM file. Default 48000.
+      --input-channels=<n>   The number of interleaved channels in a raw PCM file. Default 2. Raw files with 3 to 8 channels should be in the standard WAV order.
+      --threads=<n>          The number of threads to encode with. Long files are split into chunks that are encoded in parallel. Defaults to one per core.
+
+    Batch encoding:
+      <manifest> lists the files to encode, one per line, as the input and output filenames separated by a tab (or a space). With no <manifest> or "-" the list is read from stdin. The files are encoded on --threads threads, a whole file at a time. The encoding options apply to every file.
+
+    Benchmarking:
+      `benchmark` encodes a synthetic signal through the same pipeline as `record`, as fast as it will go, and prints how many times realtime that was, the percentage of one core each channel needs, the bitrate and the peak memory use. --rate, --channels, --complexity and --frame-ms take comma-separated lists and every combination is run; by default 16000,48000 Hz, 1,2,6 channels, complexity 0,5,10 and 10,20,60 ms frames.
+      --signal=<signal>      sweep, noise, silence or speech (bursts of voice-like sound with pauses). Default speech.
+      --sample-format=<format>  The format the signal is generated in and converted from, as if a device delivered it: s16, s24, s32 or f32. Default s16.
+      --frame-ms=<ms>        Opus frame lengths: 2.5, 5, 10, 20, 40 or 60.
+      --inputs=<n>           Encode this many signals at once, as if recording from several devices. Default 1.
+      --seconds=<s>          Seconds of audio to encode for each combination. Default 10.
+      With --input-rate the signal is generated at that rate and resampled.
+
+    Repairing:
+      `repair` copies a WebM file that was never finished (because OpusRec was killed, crashed or lost power) to <output_file> with a proper duration, index and sizes, keeping everything up to where it was cut off.
 )";
 
+static const std::map<std::string, Resampler::Quality> resamplerQualities = {
+    {"low", Resampler::Quality_Low},
+    {"medium", Resampler::Quality_Medium},
+    {"high", Resampler::Quality_High},
+};
+
+static const std::map<std::string, SyntheticInput::Signal> signals = {
+    {"sweep", SyntheticInput::Signal_Sweep},
+    {"noise", SyntheticInput::Signal_Noise},
+    {"silence", SyntheticInput::Signal_Silence},
+    {"speech", SyntheticInput::Signal_Speech},
+};
+
+static const std::map<std::string, SoundIoFormat> sampleFormats = {
+    {"s16", SoundIoFormatS16NE},
+    {"s24", SoundIoFormatS24NE},
+    {"s32", SoundIoFormatS32NE},
+    {"f32", SoundIoFormatFloat32NE},
+};
+
+// Parse a comma-separated list of numbers, multiplied by `scale` (which
+// allows "2.5" to be given in milliseconds and kept in microseconds). An
+// empty string leaves `values` as it is. Returns false if it isn't valid.
+static bool parseList(const string& text, vector<int>& values, int scale)
+{
+	if (text.empty())
+		return true;
+
+	vector<int> parsed;
+	size_t start = 0;
+	for (;;)
+	{
+		size_t comma = text.find(',', start);
+		string item = text.substr(start, comma == string::npos ? string::npos : comma - start);
+		try
+		{
+			size_t processed = 0;
+			double value = std::stod(item, &processed);
+			if (processed != item.size())
+				return false;
+			parsed.push_back(static_cast<int>(value * scale + 0.5));
+		}
+		catch (std::exception& e)
+		{
+			return false;
+		}
+		if (comma == string::npos)
+			break;
+		start = comma + 1;
+	}
+	values = parsed;
+	return true;
+}
+
+static const std::map<std::string, Container::Format> containers = {
+    {"webm", Container::Format_WebM},
+    {"ogg", Container::Format_Ogg},
+};
+
+// Set `format` from the value of --container, or to Format_Auto to choose it
+// from the file extension if there wasn't one. Returns false if it isn't valid.
+static bool parseContainer(const std::string& name, Container::Format& format)
+{
+	if (name.empty())
+	{
+		format = Container::Format_Auto;
+		return true;
+	}
+	if (containers.count(name) != 1)
+	{
+		cerr << "Invalid container: " << name << endl;
+		return false;
+	}
+	format = containers.at(name);
+	return true;
+}
+
 static const std::map<std::string, SoundIoBackend> backends = {
     {"dummy", SoundIoBackendDummy},
     {"alsa", SoundIoBackendAlsa},
@@ -457,6 +765,25 @@ int main(int argc, char* argv[])
 			return def;
 		return args[key].asString();
 	};
+	auto uint64Opt = [&](string key, uint64_t def) -> uint64_t {
+		if (args.count(key) != 1)
+			return def;
+		if (!args[key].isString())
+			return def;
+		string val = args[key].asString();
+		try
+		{
+			size_t processed = 0;
+			uint64_t x = std::stoull(val, &processed, 10);
+			if (processed != val.size() || val[0] == '-')
+				return def;
+			return x;
+		}
+		catch (std::exception& e)
+		{
+		}
+		return def;
+	};
 	auto intOpt = [&](string key, int def) -> int {
 		if (args.count(key) != 1)
 			return def;
@@ -476,7 +803,114 @@ int main(int argc, char* argv[])
 		}
 		return def;
 	};
+	auto doubleOpt = [&](string key, double def) -> double {
+		if (args.count(key) != 1)
+			return def;
+		if (!args[key].isString())
+			return def;
+		string val = args[key].asString();
+		try
+		{
+			size_t processed = 0;
+			double x = std::stod(val, &processed);
+			if (processed != val.size() || !isfinite(x))
+				return def;
+			return x;
+		}
+		catch (std::exception& e)
+		{
+		}
+		return def;
+	};
 	
+	// Encoding and repairing files doesn't need an audio system.
+	if (args["repair"].asBool())
+		return RepairWebm(stringOpt("<input>", ""), stringOpt("<output_file>", "")) ? 0 : 1;
+
+	if (args["benchmark"].asBool())
+	{
+		BenchmarkOptions options;
+		bool valid = parseList(stringOpt("--rate", ""), options.rates, 1) && parseList(stringOpt("--channels", ""), options.channels, 1) &&
+		             parseList(stringOpt("--complexity", ""), options.complexities, 1) &&
+		             parseList(stringOpt("--frame-ms", ""), options.frameLengths, 1000);
+		for (int rate : options.rates)
+			valid = valid && (rate == 8000 || rate == 12000 || rate == 16000 || rate == 24000 || rate == 48000);
+		for (int channels : options.channels)
+			valid = valid && channels >= 1 && channels <= OpusWriter::Channels_Max;
+		for (int complexity : options.complexities)
+			valid = valid && complexity >= 0 && complexity <= 10;
+		for (int frameLength : options.frameLengths)
+			valid = valid && (frameLength == 2500 || frameLength == 5000 || frameLength == 10000 || frameLength == 20000 ||
+			                  frameLength == 40000 || frameLength == 60000);
+		if (!valid)
+		{
+			cerr << "Invalid rate, channels, complexity or frame length." << endl;
+			return 1;
+		}
+
+		string signal = stringOpt("--signal", "speech");
+		string format = stringOpt("--sample-format", "s16");
+		string resample = stringOpt("--resample", "medium");
+		if (signals.count(signal) != 1 || sampleFormats.count(format) != 1 || resamplerQualities.count(resample) != 1)
+		{
+			cerr << "Invalid signal, sample format or resampler quality." << endl;
+			return 1;
+		}
+		options.signal = signals.at(signal);
+		options.format = sampleFormats.at(format);
+		options.resampleQuality = resamplerQualities.at(resample);
+		options.inputRate = intOpt("--input-rate", 0);
+		options.bitrate = intOpt("--bitrate", 0);
+		options.inputs = intOpt("--inputs", 1);
+		options.threads = intOpt("--threads", 0);
+		options.seconds = doubleOpt("--seconds", 10.0);
+		if (options.inputs < 1 || options.seconds <= 0 || options.inputRate < 0)
+		{
+			cerr << "Invalid number of inputs, seconds or input rate." << endl;
+			return 1;
+		}
+		return RunBenchmark(options) ? 0 : 1;
+	}
+
+	if (args["encode"].asBool() || args["batch"].asBool())
+	{
+		EncodeOptions options;
+		options.samplingRate = intOpt("--rate", 48000);
+		options.complexity = intOpt("--complexity", 10);
+		options.bitrate = intOpt("--bitrate", 0);
+		options.threads = intOpt("--threads", 0);
+
+		if (!parseContainer(stringOpt("--container", ""), options.container))
+			return 1;
+
+		string resample = stringOpt("--resample", "medium");
+		if (resamplerQualities.count(resample) != 1)
+		{
+			cerr << "Invalid resampler quality: " << resample << endl;
+			return 1;
+		}
+		options.resampleQuality = resamplerQualities.at(resample);
+
+		string format = stringOpt("--format", "");
+		if (!format.empty() && rawFormats.count(format) != 1)
+		{
+			cerr << "Invalid raw format: " << format << endl;
+			return 1;
+		}
+
+		int inputRate = intOpt("--input-rate", 48000);
+		int inputChannels = intOpt("--input-channels", 2);
+		OpenInput open = [&](PcmFile& input, const string& filename) {
+			if (format.empty())
+				return input.open(filename);
+			return input.openRaw(filename, rawFormats.at(format), inputRate, inputChannels);
+		};
+
+		bool ok = args["batch"].asBool() ? batch(stringOpt("<manifest>", ""), open, options)
+		                                 : encode(stringOpt("<input>", ""), stringOpt("<output_file>", ""), open, options);
+		return ok ? 0 : 1;
+	}
+
 	enum SoundIoBackend backend = SoundIoBackendNone;
 	string backendOpt = args["--backend"].isString() ? args["--backend"].asString() : "";
 	
@@ -532,18 +966,81 @@ int main(int argc, char* argv[])
 	}
 	else if (args["record"].asBool())
 	{
-		string device_id = args["--device"].isString() ? args["--device"].asString() : "";
-		bool is_raw = args["--raw"].isBool() ? args["--raw"].asBool() : false;
-		int samplingRate = intOpt("--rate", 48000);
-		int channels = intOpt("--channels", 2);
-		int complexity = intOpt("--complexity", 10);
-		int bitrate = intOpt("--bitrate", 64000);
-		int duration = intOpt("--duration", -1);
-		string outfile = stringOpt("<output_file>", "");
+		RecordOptions options;
+		options.device_ids = args["--device"].isStringList() ? args["--device"].asStringList() : vector<string>();
+		options.is_raw = args["--raw"].isBool() ? args["--raw"].asBool() : false;
+		options.samplingRate = intOpt("--rate", 48000);
+		options.channels = intOpt("--channels", 2);
+		options.complexity = intOpt("--complexity", 10);
+		options.bitrate = intOpt("--bitrate", options.channels > 2 ? 32000 * options.channels : 64000);
+		options.duration = intOpt("--duration", -1);
+		options.outfile = stringOpt("<output_file>", "");
+		options.separate_files = args["--separate-files"].isBool() ? args["--separate-files"].asBool() : false;
+		options.live = args["--live"].isBool() ? args["--live"].asBool() : false;
+		options.cluster_ms = intOpt("--cluster-ms", 1000);
+		options.segment_seconds = uint64Opt("--segment-seconds", 0);
+		options.segment_bytes = uint64Opt("--segment-bytes", 0);
+		options.checkpoint_ms = intOpt("--checkpoint-ms", 0);
+		options.preroll_seconds = uint64Opt("--preroll", 0);
+		options.postroll_seconds = uint64Opt("--postroll", 0);
+		options.trigger = stringOpt("--trigger", "");
+		options.dtx = args["--dtx"].isBool() ? args["--dtx"].asBool() : false;
+		options.gate = args["--gate"].isString();
+		options.gate_db = intOpt("--gate", -50);
+		options.gate_hangover_ms = intOpt("--gate-hangover", 500);
+		options.gate_preroll_ms = intOpt("--gate-preroll", 200);
+		options.metrics = stringOpt("--metrics", "");
+		options.trace = stringOpt("--trace", "");
+
+		if (!parseContainer(stringOpt("--container", ""), options.container))
+		{
+			soundio_destroy(soundio);
+			return 1;
+		}
+		if (options.channels < 1 || options.channels > OpusWriter::Channels_Max)
+		{
+			cerr << "Invalid number of channels: " << options.channels << endl;
+			soundio_destroy(soundio);
+			return 1;
+		}
+		if (options.cluster_ms <= 0)
+		{
+			cerr << "Invalid cluster duration: " << options.cluster_ms << endl;
+			soundio_destroy(soundio);
+			return 1;
+		}
+		if (options.checkpoint_ms < 0)
+		{
+			cerr << "Invalid checkpoint interval: " << options.checkpoint_ms << endl;
+			soundio_destroy(soundio);
+			return 1;
+		}
+		if (options.gate && (options.gate_db > 0 || options.gate_hangover_ms < 0 || options.gate_preroll_ms < 0))
+		{
+			cerr << "Invalid voice gate settings." << endl;
+			soundio_destroy(soundio);
+			return 1;
+		}
+
+		string resample = stringOpt("--resample", "medium");
+		if (resample == "off")
+		{
+			options.native_rate = false;
+		}
+		else if (resamplerQualities.count(resample) == 1)
+		{
+			options.resample_quality = resamplerQualities.at(resample);
+		}
+		else
+		{
+			cerr << "Invalid resampler quality: " << resample << endl;
+			soundio_destroy(soundio);
+			return 1;
+		}
 		
-		cerr << "Duration: " << duration << endl;
+		cerr << "Duration: " << options.duration << endl;
 
-		record(soundio, device_id, is_raw, samplingRate, channels, complexity, bitrate, duration, outfile);
+		record(soundio, options);
 	}
 
 	soundio_destroy(soundio);